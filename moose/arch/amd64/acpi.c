@@ -0,0 +1,133 @@
+#include <moose/arch/amd64/acpi.h>
+#include <moose/arch/amd64/virtmem.h>
+#include <moose/bitops.h>
+#include <moose/kstdio.h>
+#include <moose/param.h>
+#include <moose/string.h>
+
+// RSDP is located either in first KiB of EBDA or in BIOS read-only area
+#define EBDA_SEGMENT_PTR 0x40e
+#define BIOS_AREA_BASE 0xe0000
+#define BIOS_AREA_END 0x100000
+
+static int checksum_ok(const void *data, size_t size) {
+    const u8 *bytes = data;
+    u8 sum = 0;
+    for (size_t i = 0; i < size; ++i)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+// Memory of ACPI tables is reported as reserved and is not part of direct
+// map above the boot identity region, so tables are mapped to MMIO window
+static const void *map_acpi_memory(u64 phys, u64 size) {
+    if (phys + size <= IDENTITY_MAP_SIZE)
+        return FIXUP_PTR(phys);
+
+    u64 base = phys & ~(PAGE_SIZE - 1);
+    u64 end = align_po2(phys + size, PAGE_SIZE);
+    if (map_virtual_region(base, MMIO_VIRTUAL_BASE + base,
+                           (end - base) >> PAGE_SIZE_BITS))
+        return NULL;
+
+    return (const void *)(MMIO_VIRTUAL_BASE + phys);
+}
+
+static const struct acpi_rsdp *scan_rsdp(u64 base, u64 end) {
+    for (u64 addr = base; addr + sizeof(struct acpi_rsdp) <= end; addr += 16) {
+        const struct acpi_rsdp *rsdp = FIXUP_PTR(addr);
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 &&
+            checksum_ok(rsdp, offsetof(struct acpi_rsdp, length)))
+            return rsdp;
+    }
+
+    return NULL;
+}
+
+static const struct acpi_rsdp *find_rsdp(void) {
+    u64 ebda = (u64)(*(const u16 *)FIXUP_PTR(EBDA_SEGMENT_PTR)) << 4;
+    const struct acpi_rsdp *rsdp = NULL;
+    if (ebda)
+        rsdp = scan_rsdp(ebda, ebda + 1024);
+    if (rsdp == NULL)
+        rsdp = scan_rsdp(BIOS_AREA_BASE, BIOS_AREA_END);
+
+    return rsdp;
+}
+
+static const struct acpi_sdt_header *map_sdt(u64 phys) {
+    const struct acpi_sdt_header *header =
+        map_acpi_memory(phys, sizeof(*header));
+    if (header == NULL)
+        return NULL;
+
+    header = map_acpi_memory(phys, header->length);
+    if (header == NULL || !checksum_ok(header, header->length))
+        return NULL;
+
+    return header;
+}
+
+// Looks up table with given signature in RSDT or XSDT
+static const struct acpi_sdt_header *find_sdt(const char *signature) {
+    const struct acpi_rsdp *rsdp = find_rsdp();
+    if (rsdp == NULL)
+        return NULL;
+
+    int use_xsdt = rsdp->revision >= 2 && rsdp->xsdt_address &&
+                   checksum_ok(rsdp, rsdp->length);
+    const struct acpi_sdt_header *root =
+        map_sdt(use_xsdt ? rsdp->xsdt_address : rsdp->rsdt_address);
+    if (root == NULL)
+        return NULL;
+
+    size_t entry_size = use_xsdt ? sizeof(u64) : sizeof(u32);
+    size_t count = (root->length - sizeof(*root)) / entry_size;
+    const u8 *entries = (const u8 *)(root + 1);
+    for (size_t i = 0; i < count; ++i) {
+        u64 phys = use_xsdt ? *(const u64 *)(entries + i * entry_size)
+                            : *(const u32 *)(entries + i * entry_size);
+        const struct acpi_sdt_header *header =
+            map_acpi_memory(phys, sizeof(*header));
+        if (header && memcmp(header->signature, signature, 4) == 0)
+            return map_sdt(phys);
+    }
+
+    return NULL;
+}
+
+int acpi_parse_madt(struct madt_info *info) {
+    const struct acpi_madt *madt = (const void *)find_sdt("APIC");
+    if (madt == NULL)
+        return -1;
+
+    info->lapic_base = madt->lapic_address;
+    info->cpu_count = 0;
+
+    const u8 *ptr = (const u8 *)(madt + 1);
+    const u8 *end = (const u8 *)madt + madt->header.length;
+    while (ptr + sizeof(struct madt_entry) <= end) {
+        const struct madt_entry *entry = (const void *)ptr;
+        if (entry->length < sizeof(*entry) || ptr + entry->length > end)
+            return -1;
+
+        if (entry->type == MADT_TYPE_LAPIC) {
+            const struct madt_lapic *lapic = (const void *)entry;
+            if (!(lapic->flags & MADT_LAPIC_ENABLED))
+                goto next;
+            if (info->cpu_count == MAX_CPUS) {
+                kprintf("acpi: ignoring cpu with apic id %u\n",
+                        lapic->apic_id);
+                goto next;
+            }
+            info->apic_ids[info->cpu_count++] = lapic->apic_id;
+        } else if (entry->type == MADT_TYPE_LAPIC_OVERRIDE) {
+            const struct madt_lapic_override *override = (const void *)entry;
+            info->lapic_base = override->lapic_address;
+        }
+    next:
+        ptr += entry->length;
+    }
+
+    return 0;
+}
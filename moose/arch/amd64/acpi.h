@@ -0,0 +1,76 @@
+//
+// ACPI table discovery
+//
+#pragma once
+
+#include <moose/arch/cpu.h>
+#include <moose/types.h>
+
+struct acpi_rsdp {
+    char signature[8];
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;
+    u32 rsdt_address;
+    // fields below are valid only for revision 2 and above
+    u32 length;
+    u64 xsdt_address;
+    u8 extended_checksum;
+    u8 reserved[3];
+} __packed;
+
+static_assert(sizeof(struct acpi_rsdp) == 36);
+
+struct acpi_sdt_header {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+};
+
+static_assert(sizeof(struct acpi_sdt_header) == 36);
+
+struct acpi_madt {
+    struct acpi_sdt_header header;
+    u32 lapic_address;
+    u32 flags;
+};
+
+#define MADT_TYPE_LAPIC 0
+#define MADT_TYPE_LAPIC_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED 0x1
+#define MADT_LAPIC_ONLINE_CAPABLE 0x2
+
+struct madt_entry {
+    u8 type;
+    u8 length;
+};
+
+struct madt_lapic {
+    struct madt_entry entry;
+    u8 processor_id;
+    u8 apic_id;
+    u32 flags;
+};
+
+struct madt_lapic_override {
+    struct madt_entry entry;
+    u16 reserved;
+    u64 lapic_address;
+} __packed;
+
+// Processors found in MADT
+struct madt_info {
+    u64 lapic_base;
+    u32 cpu_count;
+    u8 apic_ids[MAX_CPUS];
+};
+
+// returns -1 if MADT is not found or is corrupted
+int acpi_parse_madt(struct madt_info *info);
@@ -0,0 +1,155 @@
+#include <moose/arch/amd64/apic.h>
+#include <moose/arch/amd64/asm.h>
+#include <moose/arch/amd64/cpuid.h>
+#include <moose/arch/amd64/tsc.h>
+#include <moose/arch/cpu.h>
+#include <moose/drivers/io_resource.h>
+#include <moose/kstdio.h>
+#include <moose/param.h>
+#include <moose/time.h>
+
+#define LAPIC_REGION_SIZE 0x400
+
+#define MSR_APIC_BASE 0x1b
+#define MSR_TSC_DEADLINE 0x6e0
+#define APIC_BASE_MASK 0xffffff000ul
+
+#define TIMER_CALIBRATION_NSECS 10000000ul
+
+static volatile u32 *lapic_regs;
+
+static struct {
+    u8 vector;
+    int tsc_deadline;
+    // frequency of timer count after divider
+    u64 khz;
+} lapic_timer;
+
+static u32 lapic_read(u32 reg) {
+    return lapic_regs[reg / sizeof(u32)];
+}
+
+static void lapic_write(u32 reg, u32 value) {
+    lapic_regs[reg / sizeof(u32)] = value;
+}
+
+u64 get_lapic_base(void) {
+    return read_msr(MSR_APIC_BASE) & APIC_BASE_MASK;
+}
+
+int init_lapic(u64 phys_base) {
+    struct io_resource *res = request_mem_region(phys_base, LAPIC_REGION_SIZE);
+    if (res == NULL)
+        return -1;
+
+    lapic_regs = (volatile u32 *)(MMIO_VIRTUAL_BASE + phys_base);
+    enable_lapic();
+    return 0;
+}
+
+void enable_lapic(void) {
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+u32 lapic_id(void) {
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+static void lapic_send_ipi(u32 apic_id, u32 command) {
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, command);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+        spinloop_hint();
+}
+
+void lapic_send_init(u32 apic_id) {
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(u32 apic_id, u8 vector) {
+    lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | vector);
+}
+
+void lapic_send_fixed(u32 apic_id, u8 vector) {
+    lapic_send_ipi(apic_id, vector);
+}
+
+void lapic_send_ipi_others(u8 vector) {
+    lapic_send_ipi(0, LAPIC_ICR_ALL_BUT_SELF | vector);
+}
+
+static u64 measure_timer_khz(void) {
+    cpuflags_t flags = irq_save();
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TIMER_INIT, ~0u);
+    u64 start = ktime_get();
+    u64 now;
+    while ((now = ktime_get()) - start < TIMER_CALIBRATION_NSECS)
+        spinloop_hint();
+    u32 counted = ~0u - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    irq_restore(flags);
+
+    return (u64)counted * 1000000 / (now - start);
+}
+
+void init_lapic_timer(u8 vector) {
+    lapic_timer.vector = vector;
+    if (cpu_supports(CPUID_TSC_DEADLINE)) {
+        lapic_timer.tsc_deadline = 1;
+        kprintf("lapic timer: tsc-deadline mode\n");
+        return;
+    }
+
+    lapic_timer.khz = measure_timer_khz();
+    kprintf("lapic timer: %lu.%03lu MHz\n", lapic_timer.khz / 1000,
+            lapic_timer.khz % 1000);
+}
+
+void enable_lapic_timer(void) {
+    if (lapic_timer.tsc_deadline) {
+        lapic_write(LAPIC_REG_LVT_TIMER,
+                    lapic_timer.vector | LAPIC_TIMER_TSC_DEADLINE);
+        // mode switch has to be visible before deadline msr is written
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return;
+    }
+
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, lapic_timer.vector);
+}
+
+void lapic_timer_set_deadline(u64 deadline) {
+    // deadline is compared with TSC of this cpu, so on application
+    // processors it is only correct if their TSCs are synchronized with the
+    // boot cpu one
+    if (lapic_timer.tsc_deadline) {
+        // zero would disarm the timer
+        u64 tsc = sched_clock_to_tsc(deadline);
+        write_msr(MSR_TSC_DEADLINE, tsc ? tsc : 1);
+        return;
+    }
+
+    u64 now = ktime_get();
+    u64 delta = deadline > now ? deadline - now : 0;
+    u64 count = delta * lapic_timer.khz / 1000000;
+    // zero count stops the timer instead of firing it
+    if (count == 0)
+        count = 1;
+    if (count > ~0u)
+        count = ~0u;
+    lapic_write(LAPIC_REG_TIMER_INIT, count);
+}
+
+void lapic_timer_cancel(void) {
+    if (lapic_timer.tsc_deadline)
+        write_msr(MSR_TSC_DEADLINE, 0);
+    else
+        lapic_write(LAPIC_REG_TIMER_INIT, 0);
+}
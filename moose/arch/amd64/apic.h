@@ -0,0 +1,58 @@
+//
+// Local APIC
+//
+#pragma once
+
+#include <moose/types.h>
+
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_TPR 0x80
+#define LAPIC_REG_EOI 0xb0
+#define LAPIC_REG_SVR 0xf0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INIT 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_SPURIOUS_VECTOR 0xff
+
+#define LAPIC_ICR_INIT 0x500
+#define LAPIC_ICR_STARTUP 0x600
+#define LAPIC_ICR_ASSERT 0x4000
+#define LAPIC_ICR_PENDING 0x1000
+#define LAPIC_ICR_ALL_BUT_SELF 0xc0000
+
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+// physical address of local APIC registers of calling cpu
+u64 get_lapic_base(void);
+// Maps local APIC registers and enables it on boot cpu
+int init_lapic(u64 phys_base);
+// Enables local APIC of calling cpu, init_lapic must be called before
+void enable_lapic(void);
+
+u32 lapic_id(void);
+void lapic_eoi(void);
+
+void lapic_send_init(u32 apic_id);
+void lapic_send_startup(u32 apic_id, u8 vector);
+void lapic_send_fixed(u32 apic_id, u8 vector);
+// sends fixed interrupt to every cpu except calling one
+void lapic_send_ipi_others(u8 vector);
+
+// Selects TSC-deadline mode if cpu has it and measures timer frequency
+// against TSC otherwise. Called once on boot cpu after TSC is calibrated
+void init_lapic_timer(u8 vector);
+// sets up one-shot timer of calling cpu, it stays disarmed until deadline
+// is set
+void enable_lapic_timer(void);
+// Timer of calling cpu fires once at ktime_get() deadline, replacing the
+// one that was set before. Past deadline fires immediately
+void lapic_timer_set_deadline(u64 deadline);
+// disarms timer of calling cpu
+void lapic_timer_cancel(void);
@@ -72,6 +72,12 @@ static __forceinline u32 read_rdseed(void) {
     return result;
 }
 
+static __forceinline u64 read_tsc(void) {
+    u32 lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
 static __forceinline u8 port_in8(u16 port) {
     u8 result;
     asm volatile("in %%dx, %%al" : "=a"(result) : "d"(port));
@@ -4,6 +4,7 @@
 #include <moose/assert.h>
 #include <moose/kstdio.h>
 #include <moose/mm/kmalloc.h>
+#include <moose/mm/physmem.h>
 #include <moose/param.h>
 #include <moose/sched/sched.h>
 #include <moose/sys/syscalls.h>
@@ -16,8 +17,6 @@
 #define MSR_GS_BASE 0xc0000101
 #define MSR_IA32_EFER 0xc0000080
 
-#define MAX_CPUS 64
-
 struct process;
 
 struct debug_registers {
@@ -106,9 +105,11 @@ struct tss_entry {
     u16 iomapbase;
 };
 
-static struct gdt_entry gdt[256] __aligned(16);
-static struct gdt_reg gdtr;
-static struct tss_entry tss;
+// null, kernel and user code and data, 16-byte tss descriptor
+#define GDT_ENTRY_COUNT 8
+
+static struct gdt_entry cpu_gdts[MAX_CPUS][GDT_ENTRY_COUNT] __aligned(16);
+static struct tss_entry cpu_tss[MAX_CPUS];
 static struct percpu cpus[MAX_CPUS];
 static int ncpus;
 
@@ -289,16 +290,26 @@ void set_syscall_result(u64 result, struct registers_state *state) {
     state->rax = result;
 }
 
-static void init_percpu(void) {
-    // TODO: This is certainly not nice
-    extern struct process idle_process;
+// cpus are brought up one at a time, so ncpus is not raced on
+static void init_percpu(struct process *idle) {
     expects(ncpus < MAX_CPUS);
-    struct percpu *percpu = cpus + ncpus++;
+    struct percpu *percpu = cpus + ncpus;
     percpu->this = percpu;
-    percpu->current = &idle_process;
+    percpu->cpu_id = ncpus++;
+    percpu->current = idle;
+    init_percpu_pages(percpu->cpu_id);
     write_msr(MSR_GS_BASE, (u64)percpu);
 }
 
+int get_cpu_count(void) {
+    return ncpus;
+}
+
+struct percpu *get_cpu_percpu(int cpu) {
+    expects(cpu < ncpus);
+    return cpus + cpu;
+}
+
 static void setup_syscall(void) {
     if (!cpu_supports(CPUID_SYSCALL))
         panic("cpu must support syscall instruction");
@@ -316,9 +327,10 @@ static void setup_syscall(void) {
         (u64)kmalloc(sizeof(union process_stack)) + sizeof(union process_stack);
 }
 
-static void flush_gdt(void) {
-    gdtr.offset = (u64)&gdt;
-    gdtr.size = sizeof(gdt) - 1;
+static void flush_gdt(struct gdt_entry *table) {
+    struct gdt_reg gdtr;
+    gdtr.offset = (u64)table;
+    gdtr.size = GDT_ENTRY_COUNT * sizeof(*table) - 1;
     asm volatile("lgdt %0\n"
                  "leaq 1f(%%rip), %%rax\n"
                  "pushq $0x8\n"
@@ -338,12 +350,19 @@ static void flush_tss(void) {
                      : "memory", "ax");
 }
 
-static void init_gdt(void) {
-    static union process_stack interrupt_stack;
-    u64 addr = (u64)(void *)(&interrupt_stack + 1);
-    tss.rsp0l = addr;
-    tss.rsp0h = addr >> 32;
-    tss.iomapbase = sizeof(tss);
+static void init_gdt(u64 interrupt_stack, const u64 *exception_stacks) {
+    int cpu = get_cpu_id();
+    struct gdt_entry *gdt = cpu_gdts[cpu];
+    struct tss_entry *tss = cpu_tss + cpu;
+    tss->rsp0l = interrupt_stack;
+    tss->rsp0h = interrupt_stack >> 32;
+    // ist fields are consecutive low and high halves starting with ist1
+    u32 *ist = &tss->ist1l;
+    for (int i = 0; i < IST_STACK_COUNT; ++i) {
+        ist[2 * i] = exception_stacks[i];
+        ist[2 * i + 1] = exception_stacks[i] >> 32;
+    }
+    tss->iomapbase = sizeof(*tss);
 
     gdt[0].low = 0x00000000;
     gdt[0].high = 0x00000000;
@@ -363,23 +382,41 @@ static void init_gdt(void) {
     gdt[USER_CS >> 3].high = 0x00af9a00;
 #endif
     struct gdt_entry *tss0 = gdt + (TSS_SEL >> 3);
-    gdte_set_base((u32)(u64)&tss, tss0);
-    gdte_set_limit(sizeof(tss) - 1, tss0);
+    gdte_set_base((u32)(u64)tss, tss0);
+    gdte_set_limit(sizeof(*tss) - 1, tss0);
     tss0->segment_present = 1;
     tss0->operation_size32 = 1;
     tss0->type = 0x9;
 
     struct gdt_entry *tss1 = tss0 + 1;
-    tss1->low = (u32)(((u64)&tss) >> 32);
+    tss1->low = (u32)(((u64)tss) >> 32);
 
-    flush_gdt();
+    flush_gdt(gdt);
     flush_tss();
 }
 
+void init_boot_percpu(void) {
+    // TODO: This is certainly not nice
+    extern struct process idle_process;
+    init_percpu(&idle_process);
+}
+
 void init_cpu(void) {
-    init_percpu();
+    static union process_stack interrupt_stack;
+    static union process_stack exception_stacks[IST_STACK_COUNT];
+    u64 exception_stack_tops[IST_STACK_COUNT];
+    for (int i = 0; i < IST_STACK_COUNT; ++i)
+        exception_stack_tops[i] = (u64)(void *)(exception_stacks + i + 1);
+
     init_cpuid();
-    init_gdt();
+    init_gdt((u64)(void *)(&interrupt_stack + 1), exception_stack_tops);
+    setup_syscall();
+}
+
+void init_ap_cpu(struct process *idle, u64 interrupt_stack,
+                 const u64 *exception_stacks) {
+    init_percpu(idle);
+    init_gdt(interrupt_stack, exception_stacks);
     setup_syscall();
 }
 
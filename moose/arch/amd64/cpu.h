@@ -52,10 +52,10 @@ static __forceinline void irq_enable(void) {
     sti();
 }
 
-#define __IRQS_DISABLED(_value) (((_value)&X86_FLAGS_IF) != 0)
+#define __IRQS_ENABLED(_value) (((_value)&X86_FLAGS_IF) != 0)
 
 static inline int irqs_disabled(void) {
-    return __IRQS_DISABLED(read_cpu_flags());
+    return !__IRQS_ENABLED(read_cpu_flags());
 }
 
 // NOTE: Linux uses strange-looking idiom where irq_save is implemented as
@@ -65,7 +65,7 @@ static inline int irqs_disabled(void) {
 static __nodiscard __forceinline cpuflags_t irq_save(void) {
     cpuflags_t flags = read_cpu_flags();
     cli();
-    return __IRQS_DISABLED(flags);
+    return __IRQS_ENABLED(flags);
 }
 
 static __forceinline void irq_restore(cpuflags_t flags) {
@@ -87,6 +87,11 @@ static __forceinline __noreturn void halt_cpu(void) {
 static __forceinline void wait_for_int(void) {
     hlt();
 }
+// interrupt that comes between enabling and halting still wakes the cpu,
+// because sti takes effect only after the next instruction
+static __forceinline void enable_int_and_wait(void) {
+    asm volatile("sti\nhlt" ::: "memory");
+}
 static __forceinline void spinloop_hint(void) {
     pause();
 }
@@ -96,10 +101,15 @@ void init_process_registers(struct registers_state *regs, void (*fn)(void *),
 
 void print_registers_state(const struct registers_state *state);
 
+#define MAX_CPUS 64
+
 struct percpu {
     // we need to add this thingy to be able to work with this structure
     // as regular pointer instead of constantly going through offsetof
     struct percpu *this;
+    // index of this cpu in range [0, MAX_CPUS)
+    int cpu_id;
+    u32 apic_id;
     struct process *current;
     atomic_t preempt_count;
     // this is not atomic because it is accessed only in non-interruptible
@@ -108,14 +118,38 @@ struct percpu {
 
     u64 user_stack;
     u64 kernel_stack;
+
+    // nesting depth of noreclaim sections
+    int noreclaim;
 };
 
+// Interrupt stack table slots of TSS. Faults raised by kernel stack
+// overflow run on stacks of their own, otherwise the cpu could not push
+// their frame and would reset with triple fault
+#define IST_DOUBLE_FAULT 1
+#define IST_PAGE_FAULT 2
+#define IST_STACK_COUNT 2
+
+// Sets up per-cpu data of boot cpu. Locks disable preemption through it,
+// so this comes before anything that may take a lock
+void init_boot_percpu(void);
+// initializes boot cpu
 void init_cpu(void);
+// initializes application processor, interrupt_stack is top of the stack
+// used on privilege level change, exception_stacks are tops of IST stacks
+void init_ap_cpu(struct process *idle, u64 interrupt_stack,
+                 const u64 *exception_stacks);
+int get_cpu_count(void);
+struct percpu *get_cpu_percpu(int cpu);
 
 static __forceinline __nodiscard struct percpu *get_percpu(void) {
     return read_gs_ptr(offsetof(struct percpu, this));
 }
 
+static __forceinline __nodiscard int get_cpu_id(void) {
+    return read_gs_int(offsetof(struct percpu, cpu_id));
+}
+
 static __forceinline __nodiscard struct process *get_current(void) {
     return read_gs_ptr(offsetof(struct percpu, current));
 }
@@ -125,18 +159,22 @@ static __forceinline void set_current(struct process *current) {
 }
 
 static __forceinline int get_preempt_count(void) {
-    struct percpu *percpu = get_percpu();
-    return atomic_read(&percpu->preempt_count);
+    return read_gs_int(offsetof(struct percpu, preempt_count));
 }
 
+// Counter is changed with single gs-relative instruction, so process that
+// is preempted and migrated in the middle can not change count of cpu it
+// left
 static __forceinline void preempt_disable(void) {
-    struct percpu *percpu = get_percpu();
-    atomic_inc(&percpu->preempt_count);
+    asm volatile("incl %%gs:%c[off]" ::[off] "i"(
+                     offsetof(struct percpu, preempt_count))
+                 : "memory");
 }
 
 static __forceinline void preempt_enable(void) {
-    struct percpu *percpu = get_percpu();
-    atomic_dec(&percpu->preempt_count);
+    asm volatile("decl %%gs:%c[off]" ::[off] "i"(
+                     offsetof(struct percpu, preempt_count))
+                 : "memory");
 }
 
 static __forceinline void set_invoke_scheduler_async(void) {
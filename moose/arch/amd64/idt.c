@@ -1,4 +1,6 @@
+#include <moose/arch/amd64/apic.h>
 #include <moose/arch/amd64/asm.h>
+#include <moose/arch/amd64/cpu.h>
 #include <moose/arch/amd64/idt.h>
 #include <moose/param.h>
 
@@ -47,6 +49,7 @@
 #define PIC_EOI 0x20 /* End-of-interrupt command code */
 #define IRQ_BASE 32
 
+#define EXCEPTION_DOUBLE_FAULT 0x8
 #define EXCEPTION_PAGE_FAULT 0xe
 
 static struct idt_entry idt[256] __aligned(16);
@@ -62,7 +65,11 @@ static void set_idt_entry(u8 n, u64 isr_addr, int is_trap) {
     e->reserved = 0;
 }
 
-static void load_idt(void) {
+static void set_idt_ist(u8 n, u8 ist) {
+    idt[n].ist = ist;
+}
+
+void load_idt(void) {
     struct idt_reg idt_reg;
     idt_reg.offset = (u64)&idt[0];
     idt_reg.size = 256 * sizeof(struct idt_entry) - 1;
@@ -70,6 +77,14 @@ static void load_idt(void) {
 }
 
 void eoi(u8 irq) {
+    // vectors above legacy PIC range are delivered by local APIC, spurious
+    // interrupts must not be acknowledged
+    if (irq >= 16 + IRQ_BASE) {
+        if (irq != LAPIC_SPURIOUS_VECTOR)
+            lapic_eoi();
+        return;
+    }
+
     if (irq >= 8 + IRQ_BASE)
         port_out8(PIC2_CMD, PIC_EOI);
 
@@ -213,6 +228,9 @@ void init_idt(void) {
     ENUMERATE_ISRS
 #undef _ISR
 
+    set_idt_ist(EXCEPTION_DOUBLE_FAULT, IST_DOUBLE_FAULT);
+    set_idt_ist(EXCEPTION_PAGE_FAULT, IST_PAGE_FAULT);
+
     // Remap the PIC
     port_out8(0x20, 0x11);
     port_out8(0xA0, 0x11);
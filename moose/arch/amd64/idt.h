@@ -22,4 +22,6 @@ struct idt_reg {
 } __packed;
 
 void init_idt(void);
+// loads idt on calling cpu, init_idt does it for boot cpu
+void load_idt(void);
 __noinline void eoi(u8 num);
@@ -1,15 +1,27 @@
 #include <moose/arch/amd64/idt.h>
 #include <moose/arch/amd64/memmap.h>
 #include <moose/arch/amd64/rtc.h>
+#include <moose/arch/amd64/smp.h>
+#include <moose/arch/amd64/tick.h>
+#include <moose/arch/amd64/tsc.h>
 #include <moose/arch/amd64/virtmem.h>
 #include <moose/arch/cpu.h>
 #include <moose/arch/interrupts.h>
 #include <moose/assert.h>
+#include <moose/bitops.h>
 #include <moose/kstdio.h>
+#include <moose/mm/alloc_trace.h>
 #include <moose/mm/kmalloc.h>
 #include <moose/mm/physmem.h>
+#include <moose/mm/slab.h>
+#include <moose/mm/vmalloc.h>
 #include <moose/param.h>
+#include <moose/sched/lock_stat.h>
+#include <moose/sched/mutex.h>
+#include <moose/sched/rcu.h>
 #include <moose/sched/sched.h>
+#include <moose/sched/stack.h>
+#include <moose/sched/timer.h>
 
 static void zero_bss(void) {
     extern u64 __bss_start;
@@ -20,28 +32,75 @@ static void zero_bss(void) {
         *p++ = 0;
 }
 
-static size_t get_total_kernel_size(void) {
-    extern char __start;
+// Checks if physical page is used by kernel before allocator is set up
+static int is_boot_reserved(u64 addr) {
     extern char __end;
-    return &__end - &__start;
+    u64 kernel_end = align_po2(ADDR_TO_PHYS((u64)&__end), PAGE_SIZE);
+    u64 stack_base = KERNEL_INITIAL_STACK - sizeof(union process_stack);
+
+    // real mode data and boot page tables
+    if (addr < 8 * PAGE_SIZE)
+        return 1;
+    if (addr == SMP_TRAMPOLINE_ADDR)
+        return 1;
+    if (addr >= stack_base && addr < KERNEL_INITIAL_STACK)
+        return 1;
+    if (addr >= KERNEL_PHYSICAL_BASE && addr < kernel_end)
+        return 1;
+
+    return 0;
 }
 
-int init_virt_mem(const struct mem_range *ranges, size_t range_count) {
-    // preallocate kernel physical space
-    size_t kernel_size_in_pages = get_total_kernel_size() >> PAGE_SIZE_BITS;
-    if (alloc_region(KERNEL_PHYSICAL_BASE, kernel_size_in_pages))
-        return -1;
+// Hands physical memory in range to allocator skipping reserved pages
+static void release_phys_range(u64 base, u64 end) {
+    base = align_po2(base, PAGE_SIZE);
+    end &= ~(PAGE_SIZE - 1);
+    while (base < end) {
+        if (is_boot_reserved(base)) {
+            base += PAGE_SIZE;
+            continue;
+        }
+
+        u64 run_end = base;
+        while (run_end < end && !is_boot_reserved(run_end))
+            run_end += PAGE_SIZE;
+
+        free_region(base, (run_end - base) >> PAGE_SIZE_BITS);
+        base = run_end;
+    }
+}
 
-    // preallocate currently used page tables
-    if (alloc_region(0, 8))
-        return -1;
+int init_virt_mem(const struct mem_range *ranges, size_t range_count) {
+    // memory mapped by boot page tables can be given to allocator right
+    // away. Page tables for the rest of direct map are allocated from it
+    for (size_t i = 0; i < range_count; i++) {
+        u64 end = ranges[i].base + ranges[i].size;
+        if (end > IDENTITY_MAP_SIZE)
+            end = IDENTITY_MAP_SIZE;
+        release_phys_range(ranges[i].base, end);
+    }
 
-    // all physical memory map to PHYSMEM_VIRTUAL_BASE
+    // all physical memory map to PHYSMEM_VIRTUAL_BASE using largest pages
+    // possible, each chunk is released as soon as it is mapped
     for (size_t i = 0; i < range_count; i++) {
-        if (map_virtual_region(
-                ranges[i].base, PHYSMEM_VIRTUAL_BASE + ranges[i].base,
-                align_po2(ranges[i].size, PAGE_SIZE) >> PAGE_SIZE_BITS))
-            return -1;
+        u64 addr = ranges[i].base & ~(PAGE_SIZE - 1);
+        u64 end = align_po2(ranges[i].base + ranges[i].size, PAGE_SIZE);
+        while (addr < end) {
+            u64 chunk_end = align_po2(addr + 1, LARGE_PAGE_1G_SIZE);
+            if (chunk_end > end)
+                chunk_end = end;
+
+            if (map_virtual_region_large(addr, PHYSMEM_VIRTUAL_BASE + addr,
+                                         (chunk_end - addr) >> PAGE_SIZE_BITS))
+                return -1;
+
+            if (chunk_end > IDENTITY_MAP_SIZE) {
+                u64 release_base =
+                    addr > IDENTITY_MAP_SIZE ? addr : IDENTITY_MAP_SIZE;
+                release_phys_range(release_base, chunk_end);
+            }
+            addr = chunk_end;
+        }
     }
 
     // physical memory identity unmap
@@ -76,6 +135,10 @@ static void init_memory(void) {
 
     if (init_virt_mem(ranges, usable_region_count))
         panic("failed to initialize virtual memory");
+
+    if (check_phys_mem())
+        panic("physical memory allocator self check failed");
+    print_phys_mem_stats();
 }
 
 __used static void other_task(void *arg __unused) {
@@ -85,6 +148,7 @@ __used static void other_task(void *arg __unused) {
 
 __noreturn void kmain(void) {
     zero_bss();
+    init_boot_percpu();
     init_kmalloc();
     init_kstdio();
     kprintf("running moOSe kernel\n");
@@ -92,17 +156,45 @@ __noreturn void kmain(void) {
 
     init_cpu();
     init_memory();
+    if (init_alloc_trace())
+        panic("failed to initialize allocation tracing");
+    if (init_slab_cache())
+        panic("failed to initialize slab caches");
+    if (init_vmalloc())
+        panic("failed to initialize vmalloc");
+    init_stack_pool();
+#ifdef CONFIG_BENCH
+    bench_kmalloc();
+    print_slab_stats();
+#endif
 
     init_interrupts();
     init_idt();
     init_scheduler();
+    init_timers();
+    init_rcu();
+    init_tsc();
     init_rtc();
-
+    init_tick();
+    init_smp();
+
+#ifdef CONFIG_BENCH
+    bench_scheduler();
+    bench_spinlock();
+    bench_mutex();
+#endif
+    // kmain continues as idle process of boot cpu and runs only when no
+    // other process is runnable
     launch_process("other", other_task, NULL);
+#ifdef CONFIG_BENCH
+    print_process_stacks();
+#endif
+    print_alloc_trace();
+    print_lock_stats();
 
     for (;;) {
         kprintf("hello\n");
-        wait_for_int();
+        tick_idle_sleep();
     }
 
     halt_cpu();
@@ -1,11 +1,7 @@
 #include <moose/arch/amd64/rtc.h>
 #include <moose/arch/cpu.h>
-#include <moose/arch/interrupts.h>
 #include <moose/time.h>
 
-#define RATE 8
-#define FREQUENCY (32768 >> (RATE - 1))
-
 #define REG_SECS 0x00
 #define REG_MINS 0x02
 #define REG_HOURS 0x04
@@ -15,58 +11,16 @@
 #define REG_STATA 0x0a
 #define REG_STATB 0x0b
 
-static irqresult_t timer_interrupt(void *dev,
-                                   const struct registers_state *ctx);
-
-static volatile u64 jiffies;
-static struct interrupt_handler irq = {
-    .number = 8, .name = "rtc", .handle_interrupt = timer_interrupt};
-
 static u8 cmos_read(u8 idx) {
     port_out8(0x70, idx);
     return port_in8(0x71);
 }
 
-static void cmos_write(u8 idx, u8 data) {
-    port_out8(0x70, idx);
-    port_out8(0x71, data);
-}
-
-static irqresult_t timer_interrupt(void *dev __unused,
-                                   const struct registers_state *r __unused) {
-    ++jiffies;
-    (void)cmos_read(0x0c);
-
-    set_invoke_scheduler_async();
-    return IRQ_HANDLED;
-}
-
+// tick comes from local APIC timer, RTC is only read for wall time
 void init_rtc(void) {
-    enable_interrupt(&irq);
-
-    u8 prev;
-    u8 rate = RATE;
-
-    irq_disable();
-    (void)cmos_read(0x0c);
-    cmos_write(0x8a, 0x20);
-
-    prev = cmos_read(0x8b);
-    cmos_write(0x8b, prev | 0x40);
-    // register frequency
-    prev = cmos_read(0x8a);
-    cmos_write(0x8a, (prev & 0xf0) | rate);
-    irq_enable();
-}
-
-u64 get_jiffies(void) {
-    return jiffies;
-}
-u64 jiffies_to_msecs(u64 jiffies) {
-    return jiffies * 1000 / FREQUENCY;
-}
-u64 msecs_to_jiffies64(u64 msecs) {
-    return msecs * 1000 * FREQUENCY;
+    struct ktm tm;
+    rtc_read_tm(&tm);
+    init_timekeeping(ktm_to_time(&tm));
 }
 
 static int is_update_in_progress(void) {
@@ -130,13 +84,3 @@ void rtc_read_tm(struct ktm *tm) {
     tm->tm_mon = mon - 1;
     tm->tm_year = 100 + year;
 }
-
-time_t current_time(void) {
-    struct ktm tm;
-    rtc_read_tm(&tm);
-    return ktm_to_time(&tm);
-}
-
-void current_time_tm(struct ktm *tm) {
-    rtc_read_tm(tm);
-}
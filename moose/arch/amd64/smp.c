@@ -0,0 +1,233 @@
+#include <moose/arch/amd64/acpi.h>
+#include <moose/arch/amd64/apic.h>
+#include <moose/arch/amd64/idt.h>
+#include <moose/arch/amd64/smp.h>
+#include <moose/arch/amd64/tick.h>
+#include <moose/arch/amd64/virtmem.h>
+#include <moose/arch/cpu.h>
+#include <moose/arch/interrupts.h>
+#include <moose/assert.h>
+#include <moose/kstdio.h>
+#include <moose/param.h>
+#include <moose/sched/sched.h>
+#include <moose/sched/stack.h>
+#include <moose/string.h>
+
+// delays required by INIT-SIPI-SIPI sequence
+#define INIT_DELAY_US 10000
+#define STARTUP_DELAY_US 200
+// time application processor has to report in after startup
+#define AP_STARTUP_TIMEOUT_US 100000
+
+extern char trampoline_start[];
+extern char trampoline_end[];
+extern char trampoline_cr3[];
+extern char trampoline_stack[];
+extern char trampoline_entry[];
+
+// trampoline variable in its copy in low memory
+#define TRAMPOLINE_VAR(_sym)                                                   \
+    ((u64 *)FIXUP_PTR(SMP_TRAMPOLINE_ADDR + ((_sym)-trampoline_start)))
+
+// Handed to application processor that is being started, processors are
+// started one at a time
+static struct {
+    struct process *idle;
+    u64 interrupt_stack;
+    u64 exception_stacks[IST_STACK_COUNT];
+    atomic_t started;
+} ap_boot;
+
+// set once all application processors are started
+static int ipi_enabled;
+
+static irqresult_t
+reschedule_interrupt(void *dev __unused,
+                     const struct registers_state *r __unused) {
+    set_invoke_scheduler_async();
+    return IRQ_HANDLED;
+}
+
+static struct interrupt_handler reschedule_irq = {
+    .number = IPI_RESCHEDULE_VECTOR - 32,
+    .name = "ipi reschedule",
+    .handle_interrupt = reschedule_interrupt};
+
+void send_reschedule(int cpu) {
+    if (ipi_enabled)
+        lapic_send_fixed(get_cpu_percpu(cpu)->apic_id, IPI_RESCHEDULE_VECTOR);
+}
+
+// Only one shootdown is in flight. Requester sets pending flag of every
+// other cpu and waits until each of them clears it after flushing
+static struct {
+    int busy;
+    const struct tlb_batch *batch;
+} tlb_shootdown;
+
+static struct {
+    int pending;
+} __aligned(CACHE_LINE_SIZE) tlb_flush_pending[MAX_CPUS];
+
+// interrupts must be disabled
+static void handle_tlb_shootdown(void) {
+    int *pending = &tlb_flush_pending[get_cpu_id()].pending;
+    if (!__atomic_load_n(pending, __ATOMIC_ACQUIRE))
+        return;
+
+    flush_tlb_batch_local(tlb_shootdown.batch);
+    __atomic_store_n(pending, 0, __ATOMIC_RELEASE);
+}
+
+void poll_tlb_shootdown(void) {
+    cpuflags_t flags = irq_save();
+    handle_tlb_shootdown();
+    irq_restore(flags);
+}
+
+static irqresult_t
+tlb_flush_interrupt(void *dev __unused,
+                    const struct registers_state *r __unused) {
+    handle_tlb_shootdown();
+    return IRQ_HANDLED;
+}
+
+static struct interrupt_handler tlb_flush_irq = {
+    .number = IPI_TLB_FLUSH_VECTOR - 32,
+    .name = "ipi tlb flush",
+    .handle_interrupt = tlb_flush_interrupt};
+
+void flush_tlb_others(const struct tlb_batch *batch) {
+    if (!ipi_enabled)
+        return;
+
+    // cpu waiting for its turn may be the one that current requester waits
+    // for, so it keeps answering while it spins
+    cpuflags_t flags = irq_save();
+    while (__atomic_exchange_n(&tlb_shootdown.busy, 1, __ATOMIC_ACQUIRE)) {
+        handle_tlb_shootdown();
+        spinloop_hint();
+    }
+
+    tlb_shootdown.batch = batch;
+    int this = get_cpu_id();
+    int count = get_cpu_count();
+    for (int cpu = 0; cpu < count; ++cpu) {
+        if (cpu == this)
+            continue;
+        // release makes batch visible to cpu that sees the flag
+        __atomic_store_n(&tlb_flush_pending[cpu].pending, 1,
+                         __ATOMIC_RELEASE);
+        lapic_send_fixed(get_cpu_percpu(cpu)->apic_id, IPI_TLB_FLUSH_VECTOR);
+    }
+
+    for (int cpu = 0; cpu < count; ++cpu) {
+        while (__atomic_load_n(&tlb_flush_pending[cpu].pending,
+                               __ATOMIC_ACQUIRE))
+            spinloop_hint();
+    }
+
+    __atomic_store_n(&tlb_shootdown.busy, 0, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+static __noreturn void ap_idle_loop(void) {
+    for (;;)
+        tick_idle_sleep();
+}
+
+__used __noreturn void ap_entry(void) {
+    init_ap_cpu(ap_boot.idle, ap_boot.interrupt_stack,
+                ap_boot.exception_stacks);
+    load_idt();
+    enable_lapic();
+    get_percpu()->apic_id = lapic_id();
+    start_ap_tick();
+    atomic_set_release(&ap_boot.started, 1);
+
+    irq_enable();
+    ap_idle_loop();
+}
+
+static int wait_for_ap(u32 us) {
+    for (; us && !atomic_read_acquire(&ap_boot.started); --us)
+        delay_us(1);
+    return atomic_read_acquire(&ap_boot.started);
+}
+
+// On failure resources are not freed because processor may still start
+// later and use them
+static int start_ap(u32 apic_id) {
+    int cpu = get_cpu_count();
+    struct process *idle = create_idle_process(cpu);
+    union process_stack *interrupt_stack = alloc_process_stack();
+    if (idle == NULL || interrupt_stack == NULL)
+        return -1;
+
+    for (int i = 0; i < IST_STACK_COUNT; ++i) {
+        union process_stack *stack = alloc_process_stack();
+        if (stack == NULL)
+            return -1;
+        ap_boot.exception_stacks[i] = (u64)(stack + 1);
+    }
+
+    ap_boot.idle = idle;
+    ap_boot.interrupt_stack = (u64)(interrupt_stack + 1);
+    atomic_set(&ap_boot.started, 0);
+    *TRAMPOLINE_VAR(trampoline_stack) = (u64)(idle->stack + 1);
+
+    u8 vector = SMP_TRAMPOLINE_ADDR >> PAGE_SIZE_BITS;
+    lapic_send_init(apic_id);
+    delay_us(INIT_DELAY_US);
+    lapic_send_startup(apic_id, vector);
+    if (wait_for_ap(STARTUP_DELAY_US))
+        return 0;
+
+    // second startup ipi is sent only if the first one was missed
+    lapic_send_startup(apic_id, vector);
+    return wait_for_ap(AP_STARTUP_TIMEOUT_US) ? 0 : -1;
+}
+
+void init_smp(void) {
+    struct madt_info madt;
+    if (acpi_parse_madt(&madt)) {
+        kprintf("smp: MADT not found, running on boot cpu only\n");
+        return;
+    }
+
+    u32 bsp_id = lapic_id();
+    get_percpu()->apic_id = bsp_id;
+
+    // trampoline switches to long mode with kernel page tables while
+    // executing from low memory, so its page is identity mapped during
+    // bring-up. Page tables have to be below 4GiB to be loaded in 32-bit mode
+    u64 cr3 = read_cr3();
+    expects(cr3 < (1ul << 32));
+    memcpy(FIXUP_PTR(SMP_TRAMPOLINE_ADDR), trampoline_start,
+           trampoline_end - trampoline_start);
+    *TRAMPOLINE_VAR(trampoline_cr3) = cr3;
+    *TRAMPOLINE_VAR(trampoline_entry) = (u64)ap_entry;
+    if (map_virtual_page(SMP_TRAMPOLINE_ADDR, SMP_TRAMPOLINE_ADDR)) {
+        kprintf("smp: failed to map trampoline\n");
+        return;
+    }
+
+    for (u32 i = 0; i < madt.cpu_count; ++i) {
+        u32 apic_id = madt.apic_ids[i];
+        if (apic_id == bsp_id)
+            continue;
+
+        if (start_ap(apic_id))
+            kprintf("smp: cpu with apic id %u failed to start\n", apic_id);
+    }
+
+    // started cpus may have trampoline mapping cached, so it is unmapped
+    // after shootdowns are enabled
+    if (get_cpu_count() > 1) {
+        enable_interrupt(&reschedule_irq);
+        enable_interrupt(&tlb_flush_irq);
+        ipi_enabled = 1;
+    }
+    unmap_virtual_page(SMP_TRAMPOLINE_ADDR);
+    kprintf("smp: %d cpus online\n", get_cpu_count());
+}
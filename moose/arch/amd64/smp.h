@@ -0,0 +1,20 @@
+//
+// Application processor bring-up
+//
+#pragma once
+
+// makes receiving cpu invoke scheduler
+#define IPI_RESCHEDULE_VECTOR 0xf0
+// makes receiving cpu flush TLB entries of pending shootdown
+#define IPI_TLB_FLUSH_VECTOR 0xf1
+
+struct tlb_batch;
+
+// Discovers cpus with ACPI MADT and starts all application processors.
+// Must be called after scheduler and tick are initialized.
+void init_smp(void);
+
+// Flushes batch on all other cpus and waits until each of them is done.
+// Shootdowns are serialized and waiting cpus answer each other, so this is
+// safe with interrupts disabled and spinlocks held.
+void flush_tlb_others(const struct tlb_batch *batch);
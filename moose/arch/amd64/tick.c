@@ -0,0 +1,115 @@
+#include <moose/arch/amd64/apic.h>
+#include <moose/arch/amd64/tick.h>
+#include <moose/arch/cpu.h>
+#include <moose/arch/interrupts.h>
+#include <moose/arch/jiffies.h>
+#include <moose/panic.h>
+#include <moose/param.h>
+#include <moose/sched/rcu.h>
+#include <moose/sched/sched.h>
+#include <moose/sched/timer.h>
+#include <moose/time.h>
+
+// Every cpu has one local APIC timer in one-shot mode, it is armed for the
+// earlier of the next tick and the earliest timer of that cpu. Ticks are
+// armed relative to the previous deadline, so they do not drift with
+// interrupt latency. Idle cpu stops its tick and wakes only for timers
+struct tick {
+    u64 next;
+    // set once timer of this cpu is set up
+    int running;
+    int idle;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct tick ticks[MAX_CPUS];
+
+// interrupts must be disabled
+static void program_next_event(struct tick *tick) {
+    if (!tick->running)
+        return;
+
+    u64 expires = next_timer_expiry();
+    if (!tick->idle && tick->next < expires)
+        expires = tick->next;
+    if (expires == TIMER_NEVER)
+        lapic_timer_cancel();
+    else
+        lapic_timer_set_deadline(expires);
+}
+
+static void advance_tick(struct tick *tick, u64 now) {
+    tick->next += TICK_NSEC;
+    // ticks missed while interrupts were disabled are skipped
+    if (tick->next <= now)
+        tick->next = now + TICK_NSEC - (now - tick->next) % TICK_NSEC;
+}
+
+static irqresult_t tick_interrupt(void *dev __unused,
+                                  const struct registers_state *r __unused) {
+    struct tick *tick = ticks + get_cpu_id();
+    u64 now = ktime_get();
+    if (!tick->idle && tick->next <= now) {
+        advance_tick(tick, now);
+        set_invoke_scheduler_async();
+        balance_tick();
+    }
+
+    run_timers();
+    program_next_event(tick);
+    return IRQ_HANDLED;
+}
+
+static struct interrupt_handler tick_irq = {.number = TICK_VECTOR - 32,
+                                            .name = "tick",
+                                            .handle_interrupt =
+                                                tick_interrupt};
+
+static void start_tick(void) {
+    struct tick *tick = ticks + get_cpu_id();
+    cpuflags_t flags = irq_save();
+    enable_lapic_timer();
+    tick->next = ktime_get() + TICK_NSEC;
+    tick->running = 1;
+    program_next_event(tick);
+    irq_restore(flags);
+}
+
+void init_tick(void) {
+    if (init_lapic(get_lapic_base()))
+        panic("tick: failed to map local apic");
+
+    init_lapic_timer(TICK_VECTOR);
+    enable_interrupt(&tick_irq);
+    start_tick();
+}
+
+void start_ap_tick(void) {
+    start_tick();
+}
+
+void reprogram_tick(void) {
+    program_next_event(ticks + get_cpu_id());
+}
+
+void tick_idle_sleep(void) {
+    schedule();
+    irq_disable();
+    struct tick *tick = ticks + get_cpu_id();
+    tick->idle = 1;
+    rcu_idle_enter();
+    program_next_event(tick);
+    enable_int_and_wait();
+}
+
+// interrupt may wake process, so tick has to run again before it is
+// scheduled
+void tick_irq_enter(void) {
+    struct tick *tick = ticks + get_cpu_id();
+    if (!tick->idle)
+        return;
+
+    tick->idle = 0;
+    rcu_idle_exit();
+    tick->next = ktime_get() + TICK_NSEC;
+    program_next_event(tick);
+}
@@ -0,0 +1,22 @@
+//
+// Scheduler tick
+//
+#pragma once
+
+// local APIC timer interrupt, below reschedule ipi
+#define TICK_VECTOR 0xef
+
+// Maps local APIC, calibrates its timer and starts tick on boot cpu. TSC
+// has to be calibrated before
+void init_tick(void);
+// starts tick on calling application processor
+void start_ap_tick(void);
+
+// Sleeps until the next interrupt with tick stopped, so that idle cpu is
+// woken only by its timers and interrupts sent to it. Called in loop by
+// idle process, it schedules first so that idle cpu steals waiting
+// processes of busy cpus before it sleeps
+void tick_idle_sleep(void);
+// restarts tick if cpu was sleeping in idle, called on interrupt entry
+// before handlers run
+void tick_irq_enter(void);
@@ -0,0 +1,91 @@
+#include <moose/arch/amd64/asm.h>
+#include <moose/arch/amd64/tsc.h>
+#include <moose/arch/cpu.h>
+#include <moose/kstdio.h>
+#include <moose/time.h>
+
+// PIT channel 2 counts down at fixed frequency without interrupts, its
+// output is visible in bit 5 of port 0x61 once count reaches zero
+#define PIT_HZ 1193182
+#define PIT_PORT_CH2 0x42
+#define PIT_PORT_CMD 0x43
+#define PIT_PORT_GATE 0x61
+#define PIT_GATE_CH2 0x01
+#define PIT_GATE_SPEAKER 0x02
+#define PIT_OUT_CH2 0x20
+// channel 2, low and high byte, mode 0 (interrupt on terminal count)
+#define PIT_CMD_CH2_ONESHOT 0xb0
+
+// must fit in 16-bit counter
+#define CALIBRATION_MSECS 50
+#define CALIBRATION_RUNS 3
+
+static struct {
+    u64 khz;
+    // ns = tsc * mult >> 32
+    u64 mult;
+    // tsc = ns * inv_mult >> 32
+    u64 inv_mult;
+    // TSC value at which sched_clock starts counting
+    u64 base;
+} tsc_clock;
+
+static u64 measure_pit_interval(u32 msecs) {
+    u32 count = PIT_HZ * msecs / 1000;
+    u8 gate = port_in8(PIT_PORT_GATE);
+    port_out8(PIT_PORT_GATE, (gate & ~PIT_GATE_SPEAKER) | PIT_GATE_CH2);
+    port_out8(PIT_PORT_CMD, PIT_CMD_CH2_ONESHOT);
+    port_out8(PIT_PORT_CH2, count & 0xff);
+    port_out8(PIT_PORT_CH2, count >> 8);
+
+    u64 start = read_tsc();
+    while (!(port_in8(PIT_PORT_GATE) & PIT_OUT_CH2))
+        spinloop_hint();
+    u64 cycles = read_tsc() - start;
+
+    port_out8(PIT_PORT_GATE, gate);
+    return cycles;
+}
+
+// Shortest of several runs is used, longer ones were stretched by SMIs or
+// hypervisor preemption
+void init_tsc(void) {
+    cpuflags_t flags = irq_save();
+    tsc_clock.base = read_tsc();
+    u64 cycles = ~0ul;
+    for (int i = 0; i < CALIBRATION_RUNS; ++i) {
+        u64 run = measure_pit_interval(CALIBRATION_MSECS);
+        cycles = run < cycles ? run : cycles;
+    }
+    irq_restore(flags);
+
+    tsc_clock.khz = cycles / CALIBRATION_MSECS;
+    tsc_clock.mult = (NSEC_PER_SEC << 32) / (tsc_clock.khz * 1000);
+    tsc_clock.inv_mult = (tsc_clock.khz << 32) / 1000000;
+    kprintf("tsc: %lu.%03lu MHz\n", tsc_clock.khz / 1000,
+            tsc_clock.khz % 1000);
+}
+
+u64 tsc_to_ns(u64 tsc) {
+    return ((unsigned __int128)tsc * tsc_clock.mult) >> 32;
+}
+
+u64 ns_to_tsc(u64 ns) {
+    return ((unsigned __int128)ns * tsc_clock.inv_mult) >> 32;
+}
+
+u64 get_tsc_khz(void) {
+    return tsc_clock.khz;
+}
+
+// TSC counts from cpu reset, so clock starts at the TSC read by init_tsc.
+// All cpus share the base, which assumes their TSCs are synchronized as
+// firmware leaves them. Cpu lagging behind the boot one reads 0 for a while
+u64 sched_clock(void) {
+    u64 tsc = read_tsc();
+    return tsc > tsc_clock.base ? tsc_to_ns(tsc - tsc_clock.base) : 0;
+}
+
+u64 sched_clock_to_tsc(u64 ns) {
+    return tsc_clock.base + ns_to_tsc(ns);
+}
@@ -0,0 +1,16 @@
+//
+// Time stamp counter
+//
+#pragma once
+
+#include <moose/types.h>
+
+// Measures TSC frequency against PIT, works before any timer interrupt is
+// set up
+void init_tsc(void);
+// both return 0 before TSC is calibrated
+u64 tsc_to_ns(u64 tsc);
+u64 ns_to_tsc(u64 ns);
+u64 get_tsc_khz(void);
+// returns TSC value at which sched_clock reaches ns
+u64 sched_clock_to_tsc(u64 ns);
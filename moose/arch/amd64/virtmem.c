@@ -1,6 +1,9 @@
 #include <moose/arch/amd64/asm.h>
+#include <moose/arch/amd64/cpuid.h>
+#include <moose/arch/amd64/smp.h>
 #include <moose/arch/amd64/virtmem.h>
 #include <moose/arch/cpu.h>
+#include <moose/assert.h>
 #include <moose/mm/physmem.h>
 #include <moose/param.h>
 #include <moose/string.h>
@@ -14,6 +17,27 @@ static ssize_t alloc_page_table(void) {
     return addr;
 }
 
+// Installs new table into not present entry of upper level table. Tables
+// are allocated outside of any lock, as allocation may run shrinkers that
+// unmap pages, so cpus mapping into the same missing table race to install
+// it and the losing one frees its allocation.
+static int install_page_table(void *entry) {
+    u64 *raw = entry;
+    u64 old = __atomic_load_n(raw, __ATOMIC_ACQUIRE);
+    if (old & PT_ENTRY_PRESENT)
+        return 0;
+
+    ssize_t table = alloc_page_table();
+    if (table < 0)
+        return -1;
+
+    u64 new = (u64)table | PT_ENTRY_PRESENT | PT_ENTRY_RW | PT_ENTRY_US;
+    if (!__atomic_compare_exchange_n(raw, &old, new, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+        free_page(table);
+    return 0;
+}
+
 static struct pml4_table *get_pml4_table(void) {
     return FIXUP_PTR(PML4_BASE_ADDR);
 }
@@ -48,7 +72,9 @@ static struct page_table *pt_from_pdire(const struct pd_entry *e) {
     return FIXUP_PTR((u64)e->addr << PAGE_SIZE_BITS);
 }
 
-static struct pt_entry *get_page_entry(u64 virt_addr) {
+// returns page table covering address or NULL if it is not present or
+// address is mapped with large page
+static struct page_table *get_page_table(u64 virt_addr) {
     struct pml4_table *pml4_table = get_pml4_table();
     struct pml4_entry *pml4_entry = pml4_lookup(pml4_table, virt_addr);
     if (!pml4_entry->present)
@@ -56,134 +82,346 @@ static struct pt_entry *get_page_entry(u64 virt_addr) {
 
     struct pdptr_table *pdptr_table = pdptr_from_pml4e(pml4_entry);
     struct pdpt_entry *pdpt_entry = pdpt_lookup(pdptr_table, virt_addr);
-    if (!pdpt_entry->present)
+    // large pages have no page table entry
+    if (!pdpt_entry->present || pdpt_entry->page_size)
         return NULL;
 
     struct page_directory *page_directory = pdir_from_pdpte(pdpt_entry);
     struct pd_entry *pd_entry = pd_lookup(page_directory, virt_addr);
-    if (!pd_entry->present)
+    if (!pd_entry->present || pd_entry->page_size)
         return NULL;
 
-    struct page_table *page_table = pt_from_pdire(pd_entry);
-    struct pt_entry *entry = pt_lookup(page_table, virt_addr);
-
-    return entry;
+    return pt_from_pdire(pd_entry);
 }
 
-int map_virtual_page(u64 phys_addr, u64 virt_addr) {
+static struct pml4_entry *get_or_alloc_pml4_entry(u64 virt_addr) {
     struct pml4_table *pml4_table = get_pml4_table();
     struct pml4_entry *pml4_entry = pml4_lookup(pml4_table, virt_addr);
 
-    if (!pml4_entry->present) {
-        ssize_t pdptr_table = alloc_page_table();
-        if (pdptr_table < 0)
-            return -1;
+    if (install_page_table(pml4_entry))
+        return NULL;
 
-        pml4_entry->present = 1;
-        pml4_entry->rw = 1;
-        pml4_entry->addr = (u64)pdptr_table >> PAGE_SIZE_BITS;
-        pml4_entry->us = 1;
-    }
+    return pml4_entry;
+}
+
+static struct pdpt_entry *get_or_alloc_pdpt_entry(u64 virt_addr) {
+    struct pml4_entry *pml4_entry = get_or_alloc_pml4_entry(virt_addr);
+    if (pml4_entry == NULL)
+        return NULL;
 
     struct pdptr_table *pdptr_table = pdptr_from_pml4e(pml4_entry);
-    struct pdpt_entry *pdpt_entry = pdpt_lookup(pdptr_table, virt_addr);
+    return pdpt_lookup(pdptr_table, virt_addr);
+}
 
-    if (!pdpt_entry->present) {
-        ssize_t page_directory = alloc_page_table();
-        if (page_directory < 0)
-            return -1;
+static struct pd_entry *get_or_alloc_pd_entry(u64 virt_addr) {
+    struct pdpt_entry *pdpt_entry = get_or_alloc_pdpt_entry(virt_addr);
+    if (pdpt_entry == NULL)
+        return NULL;
+    expects(!pdpt_entry->page_size);
 
-        pdpt_entry->present = 1;
-        pdpt_entry->rw = 1;
-        pdpt_entry->addr = (u64)page_directory >> PAGE_SIZE_BITS;
-        pdpt_entry->us = 1;
-    }
+    if (install_page_table(pdpt_entry))
+        return NULL;
 
     struct page_directory *page_directory = pdir_from_pdpte(pdpt_entry);
-    struct pd_entry *pd_entry = pd_lookup(page_directory, virt_addr);
+    return pd_lookup(page_directory, virt_addr);
+}
 
-    if (!pd_entry->present) {
-        ssize_t page_table = alloc_page_table();
-        if (page_table < 0)
-            return -1;
+static struct page_table *get_or_alloc_page_table(u64 virt_addr) {
+    struct pd_entry *pd_entry = get_or_alloc_pd_entry(virt_addr);
+    if (pd_entry == NULL)
+        return NULL;
+    expects(!pd_entry->page_size);
 
-        pd_entry->present = 1;
-        pd_entry->rw = 1;
-        pd_entry->addr = (u64)page_table >> PAGE_SIZE_BITS;
-        pd_entry->us = 1;
+    if (install_page_table(pd_entry))
+        return NULL;
+
+    return pt_from_pdire(pd_entry);
+}
+
+void init_tlb_batch(struct tlb_batch *batch) {
+    batch->count = 0;
+    batch->flush_all = 0;
+    init_list_head(&batch->freed);
+}
+
+void tlb_batch_add(struct tlb_batch *batch, u64 virt_addr) {
+    if (batch->flush_all)
+        return;
+
+    if (batch->count == TLB_BATCH_SIZE) {
+        batch->flush_all = 1;
+        return;
+    }
+
+    batch->addrs[batch->count++] = virt_addr;
+}
+
+void tlb_batch_free_page(struct tlb_batch *batch, u64 phys_addr) {
+    list_add_tail(FIXUP_PTR(phys_addr), &batch->freed);
+}
+
+void flush_tlb_batch_local(const struct tlb_batch *batch) {
+    if (batch->flush_all) {
+        flush_tlb();
+    } else {
+        for (u32 i = 0; i < batch->count; i++)
+            flush_tlb_entry(batch->addrs[i]);
     }
+}
+
+void flush_tlb_batch(struct tlb_batch *batch) {
+    if (batch->flush_all || batch->count) {
+        // migration in between would leave new cpu unflushed
+        preempt_disable();
+        flush_tlb_batch_local(batch);
+        flush_tlb_others(batch);
+        preempt_enable();
+    }
+
+    while (!list_is_empty(&batch->freed)) {
+        struct list_head *page = batch->freed.next;
+        list_remove(page);
+        free_page_cold((u64)PTR_TO_PHYS(page));
+    }
+    init_tlb_batch(batch);
+}
+
+void init_pt_cursor(struct pt_cursor *cursor) {
+    cursor->table = NULL;
+}
+
+// returns page table entry of address reusing table of previous lookup
+// if possible, missing tables are allocated if alloc is set
+static struct pt_entry *cursor_lookup(struct pt_cursor *cursor, u64 virt_addr,
+                                      int alloc) {
+    u64 base = virt_addr & ~(LARGE_PAGE_2M_SIZE - 1);
+    if (cursor->table == NULL || cursor->base != base) {
+        struct page_table *table = alloc ? get_or_alloc_page_table(virt_addr)
+                                         : get_page_table(virt_addr);
+        if (table == NULL)
+            return NULL;
+
+        cursor->table = table;
+        cursor->base = base;
+    }
+
+    return pt_lookup(cursor->table, virt_addr);
+}
 
-    struct page_table *page_table = pt_from_pdire(pd_entry);
-    struct pt_entry *pt_entry = pt_lookup(page_table, virt_addr);
+int map_range(struct pt_cursor *cursor, struct tlb_batch *batch, u64 phys_base,
+              u64 virt_base, size_t count) {
+    for (u64 addr = 0; addr < count * PAGE_SIZE; addr += PAGE_SIZE) {
+        struct pt_entry *pt_entry = cursor_lookup(cursor, virt_base + addr, 1);
+        if (pt_entry == NULL)
+            return -1;
 
-    pt_entry->present = 1;
-    pt_entry->addr = phys_addr >> PAGE_SIZE_BITS;
-    pt_entry->us = 1;
-    pt_entry->rw = 1;
+        // not present entries are never cached, so only remapping needs
+        // invalidation
+        if (pt_entry->present)
+            tlb_batch_add(batch, virt_base + addr);
 
-    flush_tlb_entry(virt_addr);
-    flush_tlb_entry(phys_addr);
+        pt_entry->present = 1;
+        pt_entry->addr = (phys_base + addr) >> PAGE_SIZE_BITS;
+        pt_entry->us = 1;
+        pt_entry->rw = 1;
+    }
 
     return 0;
 }
 
-int map_virtual_region(u64 phys_base, u64 virt_base, size_t count) {
+void unmap_range(struct pt_cursor *cursor, struct tlb_batch *batch,
+                 u64 virt_base, size_t count) {
     for (u64 addr = 0; addr < count * PAGE_SIZE; addr += PAGE_SIZE) {
-        if (map_virtual_page(phys_base + addr, virt_base + addr))
+        struct pt_entry *pt_entry = cursor_lookup(cursor, virt_base + addr, 0);
+        if (pt_entry != NULL && pt_entry->present) {
+            pt_entry->present = 0;
+            tlb_batch_add(batch, virt_base + addr);
+        }
+    }
+}
+
+int map_virtual_page(u64 phys_addr, u64 virt_addr) {
+    return map_virtual_region(phys_addr, virt_addr, 1);
+}
+
+int map_virtual_region(u64 phys_base, u64 virt_base, size_t count) {
+    struct pt_cursor cursor;
+    struct tlb_batch batch;
+    init_pt_cursor(&cursor);
+    init_tlb_batch(&batch);
+    int result = map_range(&cursor, &batch, phys_base, virt_base, count);
+    flush_tlb_batch(&batch);
+    return result;
+}
+
+// Maps 2 MiB page, returns 1 if directory entry is already used by page
+// table and region has to be mapped with small pages
+static int map_virtual_page_2m(struct tlb_batch *batch, u64 phys_addr,
+                               u64 virt_addr) {
+    struct pd_entry *pd_entry = get_or_alloc_pd_entry(virt_addr);
+    if (pd_entry == NULL)
+        return -1;
+    if (pd_entry->present && !pd_entry->page_size)
+        return 1;
+
+    if (pd_entry->present)
+        tlb_batch_add(batch, virt_addr);
+
+    pd_entry->present = 1;
+    pd_entry->rw = 1;
+    pd_entry->us = 1;
+    pd_entry->page_size = 1;
+    pd_entry->addr = phys_addr >> PAGE_SIZE_BITS;
+
+    return 0;
+}
+
+// Maps 1 GiB page, returns 1 if pdpt entry is already used by page
+// directory and region has to be mapped with smaller pages
+static int map_virtual_page_1g(struct tlb_batch *batch, u64 phys_addr,
+                               u64 virt_addr) {
+    struct pdpt_entry *pdpt_entry = get_or_alloc_pdpt_entry(virt_addr);
+    if (pdpt_entry == NULL)
+        return -1;
+    if (pdpt_entry->present && !pdpt_entry->page_size)
+        return 1;
+
+    if (pdpt_entry->present)
+        tlb_batch_add(batch, virt_addr);
+
+    pdpt_entry->present = 1;
+    pdpt_entry->rw = 1;
+    pdpt_entry->us = 1;
+    pdpt_entry->page_size = 1;
+    pdpt_entry->addr = phys_addr >> PAGE_SIZE_BITS;
+
+    return 0;
+}
+
+static int can_map_large(u64 phys_addr, u64 virt_addr, u64 remaining,
+                         u64 page_size) {
+    return remaining >= page_size && (phys_addr & (page_size - 1)) == 0 &&
+           (virt_addr & (page_size - 1)) == 0;
+}
+
+static int map_region_large(struct pt_cursor *cursor, struct tlb_batch *batch,
+                            u64 phys_base, u64 virt_base, size_t count) {
+    int has_1g_pages = cpu_supports(CPUID_PDPE1GB);
+    u64 size = count << PAGE_SIZE_BITS;
+    u64 offset = 0;
+    while (offset < size) {
+        u64 phys_addr = phys_base + offset;
+        u64 virt_addr = virt_base + offset;
+        u64 remaining = size - offset;
+        int result;
+
+        if (has_1g_pages && can_map_large(phys_addr, virt_addr, remaining,
+                                          LARGE_PAGE_1G_SIZE)) {
+            result = map_virtual_page_1g(batch, phys_addr, virt_addr);
+            if (result < 0)
+                return -1;
+            if (result == 0) {
+                offset += LARGE_PAGE_1G_SIZE;
+                continue;
+            }
+        }
+
+        if (can_map_large(phys_addr, virt_addr, remaining,
+                          LARGE_PAGE_2M_SIZE)) {
+            result = map_virtual_page_2m(batch, phys_addr, virt_addr);
+            if (result < 0)
+                return -1;
+            if (result == 0) {
+                offset += LARGE_PAGE_2M_SIZE;
+                continue;
+            }
+        }
+
+        if (map_range(cursor, batch, phys_addr, virt_addr, 1))
             return -1;
+        offset += PAGE_SIZE;
     }
 
     return 0;
 }
 
+int map_virtual_region_large(u64 phys_base, u64 virt_base, size_t count) {
+    struct pt_cursor cursor;
+    struct tlb_batch batch;
+    init_pt_cursor(&cursor);
+    init_tlb_batch(&batch);
+    int result = map_region_large(&cursor, &batch, phys_base, virt_base, count);
+    flush_tlb_batch(&batch);
+    return result;
+}
+
 void unmap_virtual_page(u64 virt_addr) {
-    struct pt_entry *entry = get_page_entry(virt_addr);
-    if (entry) {
-        entry->present = 0;
-        /* memset((void *)entry, 0, sizeof(*entry)); */
-        flush_tlb_entry(virt_addr);
-    }
+    unmap_virtual_region(virt_addr, 1);
 }
 
 void unmap_virtual_region(u64 virt_addr, size_t count) {
-    for (u64 addr = 0; addr < count * PAGE_SIZE; addr += PAGE_SIZE)
-        unmap_virtual_page(virt_addr + addr);
+    struct pt_cursor cursor;
+    struct tlb_batch batch;
+    init_pt_cursor(&cursor);
+    init_tlb_batch(&batch);
+    unmap_range(&cursor, &batch, virt_addr, count);
+    flush_tlb_batch(&batch);
 }
 
 void flush_tlb_entry(u64 virt_addr) {
-    cpuflags_t flags = irq_save();
     asm volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
-    irq_restore(flags);
 }
 
-int alloc_virtual_page(u64 virt_addr) {
-    ssize_t addr = alloc_page();
-    if (addr < 0)
-        return -1;
-
-    map_virtual_page(addr, virt_addr);
+void flush_tlb(void) {
+    write_cr3(read_cr3());
+}
 
-    return 0;
+int alloc_virtual_page(u64 virt_addr) {
+    return alloc_virtual_pages(virt_addr, 1);
 }
 
 int alloc_virtual_pages(u64 virt_addr, size_t page_count) {
+    struct pt_cursor cursor;
+    struct tlb_batch batch;
+    init_pt_cursor(&cursor);
+    init_tlb_batch(&batch);
+
+    int result = 0;
     for (; page_count; --page_count, virt_addr += PAGE_SIZE) {
-        if (alloc_virtual_page(virt_addr))
-            return -1;
+        ssize_t addr = alloc_page();
+        if (addr < 0) {
+            result = -1;
+            break;
+        }
+
+        if (map_range(&cursor, &batch, addr, virt_addr, 1)) {
+            free_page(addr);
+            result = -1;
+            break;
+        }
     }
+    flush_tlb_batch(&batch);
 
-    return 0;
+    return result;
 }
 
 void free_virtual_page(u64 virt_addr) {
-    struct pt_entry *pt_entry = get_page_entry(virt_addr);
-    if (pt_entry != NULL && pt_entry->present) {
-        free_page(pt_entry->addr);
-        unmap_virtual_page(virt_addr);
-    }
+    free_virtual_pages(virt_addr, 1);
 }
 
 void free_virtual_pages(u64 virt_addr, size_t page_count) {
-    for (; page_count; --page_count, virt_addr += PAGE_SIZE)
-        free_virtual_page(virt_addr);
+    struct pt_cursor cursor;
+    struct tlb_batch batch;
+    init_pt_cursor(&cursor);
+    init_tlb_batch(&batch);
+    for (; page_count; --page_count, virt_addr += PAGE_SIZE) {
+        struct pt_entry *pt_entry = cursor_lookup(&cursor, virt_addr, 0);
+        if (pt_entry != NULL && pt_entry->present) {
+            pt_entry->present = 0;
+            tlb_batch_add(&batch, virt_addr);
+            tlb_batch_free_page(&batch,
+                                (u64)pt_entry->addr << PAGE_SIZE_BITS);
+        }
+    }
+    flush_tlb_batch(&batch);
 }
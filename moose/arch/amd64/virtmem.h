@@ -1,5 +1,6 @@
 #pragma once
 
+#include <moose/list.h>
 #include <moose/types.h>
 
 #define ENTRIES_PER_TABLE 512
@@ -10,8 +11,16 @@
 #define PAGE_PLM4_INDEX(_x) (((_x) >> 39) & 0x1ff)
 
 #define IDENTITY_MAP_SIZE (2 * 1024 * 1024)
+
+#define LARGE_PAGE_2M_SIZE (1lu << 21)
+#define LARGE_PAGE_1G_SIZE (1lu << 30)
 #define PML4_BASE_ADDR 0x1000
 
+// flag bits shared by entries of all levels
+#define PT_ENTRY_PRESENT (1lu << 0)
+#define PT_ENTRY_RW (1lu << 1)
+#define PT_ENTRY_US (1lu << 2)
+
 struct pml4_entry {
     u64 present : 1;
     u64 rw : 1;
@@ -98,6 +107,42 @@ struct page_table {
     struct pt_entry entries[ENTRIES_PER_TABLE];
 };
 
+// TLB invalidations collected during range operation. Up to TLB_BATCH_SIZE
+// pages are flushed with invlpg each, larger ranges reload cr3. Frames that
+// were mapped by removed entries are freed only after the flush, so that no
+// stale TLB entry points to a page that is already reused.
+#define TLB_BATCH_SIZE 32
+
+struct tlb_batch {
+    u64 addrs[TLB_BATCH_SIZE];
+    u32 count;
+    int flush_all;
+    // frames to free, linked through their direct map addresses
+    struct list_head freed;
+};
+
+// Page table used by previous lookup of range operation. Consecutive pages
+// covered by the same table are resolved without walking from root.
+struct pt_cursor {
+    u64 base;
+    struct page_table *table;
+};
+
+void init_tlb_batch(struct tlb_batch *batch);
+void tlb_batch_add(struct tlb_batch *batch, u64 virt_addr);
+void tlb_batch_free_page(struct tlb_batch *batch, u64 phys_addr);
+// flushes batch on all cpus and frees collected frames
+void flush_tlb_batch(struct tlb_batch *batch);
+// flushes batch only on calling cpu
+void flush_tlb_batch_local(const struct tlb_batch *batch);
+
+void init_pt_cursor(struct pt_cursor *cursor);
+// Map and unmap 4 KiB pages, TLB is not flushed until flush_tlb_batch
+int map_range(struct pt_cursor *cursor, struct tlb_batch *batch, u64 phys_base,
+              u64 virt_base, size_t count);
+void unmap_range(struct pt_cursor *cursor, struct tlb_batch *batch,
+                 u64 virt_base, size_t count);
+
 int alloc_virtual_page(u64 virt_addr);
 int alloc_virtual_pages(u64 virt_addr, size_t page_count);
 void free_virtual_page(u64 virt_addr);
@@ -105,7 +150,12 @@ void free_virtual_pages(u64 virt_addr, size_t page_count);
 
 int map_virtual_page(u64 phys_addr, u64 virt_addr);
 int map_virtual_region(u64 phys_base, u64 virt_base, size_t size);
+// Same as map_virtual_region, but uses 2 MiB and 1 GiB pages where
+// addresses are aligned. Such mappings can't be partially unmapped, so this
+// is meant for permanent mappings like direct map.
+int map_virtual_region_large(u64 phys_base, u64 virt_base, size_t count);
 void unmap_virtual_page(u64 virt_addr);
 void unmap_virtual_region(u64 virt_addr, size_t size);
 
 void flush_tlb_entry(u64 virt_addr);
+void flush_tlb(void);
@@ -4,3 +4,11 @@
 
 void dump_registers(void);
 void delay_us(u32 us);
+// makes cpu invoke scheduler as soon as possible
+void send_reschedule(int cpu);
+// answers TLB shootdown that another cpu is waiting for, called by loops
+// that spin with interrupts disabled
+void poll_tlb_shootdown(void);
+// re-arms timer interrupt of calling cpu after its earliest timer changed,
+// interrupts must be disabled
+void reprogram_tick(void);
@@ -1,9 +1,13 @@
 #include <moose/arch/amd64/idt.h>
+#include <moose/arch/amd64/tick.h>
 #include <moose/arch/interrupts.h>
 #include <moose/kstdio.h>
 #include <moose/sched/locks.h>
+#include <moose/sched/rcu.h>
 #include <moose/sched/sched.h>
+#include <moose/sched/stack.h>
 
+// handlers are looked up under rcu, lock only serializes changes
 static struct {
     struct list_head isr_lists[256];
     spinlock_t lock;
@@ -36,9 +40,14 @@ illegal_instruction_handler(void *dev __unused,
     __abort_in_handler("illegal instruction");
 }
 
+// page fault runs on its own stack, so overflow of process stack into its
+// guard page can still be reported
 static irqresult_t page_fault_handler(void *dev __unused,
                                       const struct registers_state *r) {
-    __abort_in_handler("page fault at address: %#018lx", read_cr2());
+    u64 addr = read_cr2();
+    if (is_stack_guard_page(addr))
+        __abort_in_handler("kernel stack overflow at address: %#018lx", addr);
+    __abort_in_handler("page fault at address: %#018lx", addr);
 }
 
 // TODO: This has to be somewhere x86-specific
@@ -74,6 +83,8 @@ static irqresult_t no_fpu_handler(void *dev __unused,
 
 static irqresult_t double_fault_handler(void *dev __unused,
                                         const struct registers_state *r) {
+    if (is_stack_guard_page(r->ursp))
+        __abort_in_handler("double fault, kernel stack overflow");
     __abort_in_handler("double fault");
 }
 
@@ -141,31 +152,39 @@ void init_interrupts(void) {
 
 void isr_handler(struct registers_state *regs) {
     unsigned no = regs->isr_number;
-    if (spin_trylock(&interrupts.lock)) {
-        struct interrupt_handler *handler;
-        list_for_each_entry(handler, &interrupts.isr_lists[no], list) {
-            irqresult_t result = handler->handle_interrupt(handler->dev, regs);
-            if (result == IRQ_HANDLED)
-                break;
-        }
-        spin_unlock(&interrupts.lock);
+    if (no >= 32)
+        tick_irq_enter();
+    rcu_read_lock();
+    struct interrupt_handler *handler;
+    list_for_each_entry_rcu(handler, &interrupts.isr_lists[no], list) {
+        irqresult_t result = handler->handle_interrupt(handler->dev, regs);
+        if (result == IRQ_HANDLED)
+            break;
     }
+    rcu_read_unlock();
 
     eoi(no);
     sti();
 
-    if (eat_should_invoke_scheduler())
-        schedule();
+    // interrupted code that disabled preemption may be in rcu read-side
+    // section, it is rescheduled by one of the following interrupts
+    if (get_preempt_count() == 0) {
+        rcu_note_qs();
+        if (eat_should_invoke_scheduler())
+            schedule();
+    }
 }
 
 void enable_interrupt(struct interrupt_handler *handler) {
-    spin_lock(&interrupts.lock);
-    list_add(&handler->list, &interrupts.isr_lists[handler->number + 32]);
-    spin_unlock(&interrupts.lock);
+    cpuflags_t flags = spin_lock_irqsave(&interrupts.lock);
+    list_add_rcu(&handler->list, &interrupts.isr_lists[handler->number + 32]);
+    spin_unlock_irqrestore(&interrupts.lock, flags);
 }
 
 void disable_interrupt(struct interrupt_handler *handler) {
-    spin_lock(&interrupts.lock);
-    list_remove(&handler->list);
-    spin_unlock(&interrupts.lock);
+    cpuflags_t flags = spin_lock_irqsave(&interrupts.lock);
+    list_remove_rcu(&handler->list);
+    spin_unlock_irqrestore(&interrupts.lock, flags);
+    // handler may still be running on another cpu
+    synchronize_rcu();
 }
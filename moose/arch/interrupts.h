@@ -23,6 +23,8 @@ struct interrupt_handler {
 
 void init_interrupts(void);
 void enable_interrupt(struct interrupt_handler *handler);
+// handler is not used anymore once this returns, so it sleeps and must be
+// called from process context
 void disable_interrupt(struct interrupt_handler *handler);
 
 // This is called from within the assembly
@@ -2,6 +2,13 @@
 
 #include <moose/types.h>
 
+// frequency of scheduler tick, jiffies count its periods since boot
+#define HZ 250
+#define TICK_NSEC (1000000000ul / HZ)
+
 u64 get_jiffies(void);
-u32 msecs_to_jiffies(u64 msecs);
-u64 jiffies_to_msecs(u64 jiffies);
\ No newline at end of file
+// rounds up, so that nonzero timeout does not expire immediately
+u64 msecs_to_jiffies(u64 msecs);
+u64 jiffies_to_msecs(u64 jiffies);
+// nanoseconds since boot, 0 until clock is calibrated
+u64 sched_clock(void);
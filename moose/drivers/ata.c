@@ -1,6 +1,7 @@
 #include <moose/arch/cpu.h>
 #include <moose/assert.h>
 #include <moose/drivers/ata.h>
+#include <moose/time.h>
 
 #define PRIMARY_BUS 0x1f0
 #define SECONDARY_BUS 0x170
@@ -18,10 +19,32 @@
 #define CMD_READ 0x20
 #define CMD_WRITE 0x30
 
-static void cache_flush(void) {
+#define STAT_BSY 0x80
+
+// busy device that does not finish in this time fails the request
+#define ATA_TIMEOUT_USECS 500000
+
+// Returns status once device is not busy or -1 on timeout. Boot loader
+// that includes this file has no clock, so it waits without timeout
+static int wait_not_busy(void) {
+#ifndef __i686__
+    u64 deadline = ktime_get() + ATA_TIMEOUT_USECS * NSEC_PER_USEC;
+#endif
+    for (;;) {
+        int status = port_in8(PRIMARY_BUS + STAT_CMD_REG);
+        if ((status & STAT_BSY) == 0)
+            return status;
+#ifndef __i686__
+        if (ktime_get() >= deadline)
+            return -1;
+#endif
+        spinloop_hint();
+    }
+}
+
+static int cache_flush(void) {
     port_out8(PRIMARY_BUS + STAT_CMD_REG, CMD_READ);
-    while ((port_in8(PRIMARY_BUS + STAT_CMD_REG) & 0x80) != 0)
-        ;
+    return wait_not_busy() < 0 ? -1 : 0;
 }
 
 static int ata_pio_read(void *buf, u32 lba, u8 sector_count) {
@@ -44,10 +67,8 @@ static int ata_pio_read(void *buf, u32 lba, u8 sector_count) {
     }
 
     while (sector_count) {
-        int a = port_in8(PRIMARY_BUS + STAT_CMD_REG);
-        if ((a & 0x80) != 0)
-            continue;
-        if ((a & 0x21) != 0)
+        int a = wait_not_busy();
+        if (a < 0 || (a & 0x21) != 0)
             return -1;
     read:
         for (int i = 256; i--;)
@@ -83,10 +104,8 @@ static int ata_pio_write(const void *buf, u32 lba, u8 sector_count) {
     }
 
     while (sector_count) {
-        int a = port_in8(PRIMARY_BUS + STAT_CMD_REG);
-        if ((a & 0x80) != 0)
-            continue;
-        if ((a & 0x21) != 0)
+        int a = wait_not_busy();
+        if (a < 0 || (a & 0x21) != 0)
             return -1;
     read:
         for (int i = 256; i--;) {
@@ -97,9 +116,7 @@ static int ata_pio_write(const void *buf, u32 lba, u8 sector_count) {
         --sector_count;
     }
 
-    cache_flush();
-
-    return 0;
+    return cache_flush();
 }
 
 int ata_read_block(size_t idx, void *buf) {
@@ -5,14 +5,17 @@
 #include <moose/mm/kmalloc.h>
 #include <moose/param.h>
 #include <moose/sched/locks.h>
+#include <moose/sched/rcu.h>
 
+// regions are checked under rcu, lock only serializes changes
 static LIST_HEAD(port_regions);
 static LIST_HEAD(mem_regions);
-static rwlock_t regions_lock = INIT_RWLOCK();
+static spinlock_t regions_lock = INIT_SPIN_LOCK();
 
+// rcu read lock must be held
 static int check_region(u64 base, u64 size, struct list_head *regions) {
     struct io_resource *res;
-    list_for_each_entry(res, regions, list) {
+    list_for_each_entry_rcu(res, regions, list) {
         if (base < res->base + res->size && base + size > res->base) {
             return -1;
         }
@@ -21,7 +24,7 @@ static int check_region(u64 base, u64 size, struct list_head *regions) {
     return 0;
 }
 
-static struct io_resource *alloc_region(u64 base, u64 size) {
+static struct io_resource *alloc_resource(u64 base, u64 size) {
     expects(size);
     struct io_resource *res = kmalloc(sizeof(*res));
     if (res == NULL)
@@ -33,52 +36,52 @@ static struct io_resource *alloc_region(u64 base, u64 size) {
     return res;
 }
 
+static void free_resource(struct rcu_head *head) {
+    kfree(container_of(head, struct io_resource, rcu));
+}
+
 static void release_region(struct io_resource *res) {
-    list_remove(&res->list);
-    kfree(res);
+    spin_lock(&regions_lock);
+    list_remove_rcu(&res->list);
+    spin_unlock(&regions_lock);
+    call_rcu(&res->rcu, free_resource);
+}
+
+static void add_region(struct io_resource *res, struct list_head *regions) {
+    spin_lock(&regions_lock);
+    list_add_rcu(&res->list, regions);
+    spin_unlock(&regions_lock);
 }
 
 struct io_resource *request_port_region(u64 base, u64 size) {
-    struct io_resource *res = alloc_region(base, size);
-    if (!res) {
-        write_unlock(&regions_lock);
+    struct io_resource *res = alloc_resource(base, size);
+    if (!res)
         return NULL;
-    }
 
     res->kind = IO_RES_PORT;
 
-    write_lock(&regions_lock);
-    list_add(&res->list, &port_regions);
-    write_unlock(&regions_lock);
+    add_region(res, &port_regions);
     return res;
 }
 
 void release_port_region(struct io_resource *res) {
-    write_lock(&regions_lock);
     release_region(res);
-    write_unlock(&regions_lock);
 }
 
 struct io_resource *request_mem_region(u64 base, u64 size) {
-    struct io_resource *res = alloc_region(base, size);
-    if (!res) {
-        write_unlock(&regions_lock);
+    struct io_resource *res = alloc_resource(base, size);
+    if (!res)
         return NULL;
-    }
 
     res->kind = IO_RES_MEM;
 
-    write_lock(&regions_lock);
-    list_add(&res->list, &port_regions);
-    write_unlock(&regions_lock);
+    add_region(res, &mem_regions);
 
     base = base & ~(PAGE_SIZE - 1);
     size = align_po2(size, PAGE_SIZE);
     if (map_virtual_region(base, MMIO_VIRTUAL_BASE + base,
                            size >> PAGE_SIZE_BITS)) {
-        write_lock(&regions_lock);
         release_region(res);
-        write_unlock(&regions_lock);
         return NULL;
     }
 
@@ -88,23 +91,21 @@ struct io_resource *request_mem_region(u64 base, u64 size) {
 void release_mem_region(struct io_resource *res) {
     u64 base = res->base & ~(PAGE_SIZE - 1);
     u64 size = align_po2(res->size, PAGE_SIZE);
-    unmap_virtual_region(base, size);
+    unmap_virtual_region(MMIO_VIRTUAL_BASE + base, size >> PAGE_SIZE_BITS);
 
-    write_lock(&regions_lock);
     release_region(res);
-    write_unlock(&regions_lock);
 }
 
 int check_mem_region(u64 base, u64 size) {
-    read_lock(&regions_lock);
+    rcu_read_lock();
     int result = check_region(base, size, &mem_regions);
-    read_unlock(&regions_lock);
+    rcu_read_unlock();
     return result;
 }
 
-int check_io_region(u64 base, u64 size) {
-    read_lock(&regions_lock);
+int check_port_region(u64 base, u64 size) {
+    rcu_read_lock();
     int result = check_region(base, size, &port_regions);
-    read_unlock(&regions_lock);
+    rcu_read_unlock();
     return result;
 }
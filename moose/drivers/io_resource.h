@@ -1,6 +1,7 @@
 #pragma once
 
 #include <moose/list.h>
+#include <moose/sched/rcu.h>
 
 enum io_resource_kind {
     IO_RES_PORT,
@@ -12,6 +13,7 @@ struct io_resource {
     u64 size;
     struct list_head list;
     enum io_resource_kind kind;
+    struct rcu_head rcu;
 };
 
 int check_mem_region(u64 base, u64 size);
@@ -5,6 +5,7 @@
 #include <moose/errno.h>
 #include <moose/kstdio.h>
 #include <moose/mm/kmalloc.h>
+#include <moose/sched/rcu.h>
 
 #define PCI_CONFIG_ADDRESS 0xcf8
 #define PCI_CONFIG_DATA 0xcfc
@@ -17,6 +18,8 @@
 
 #define PCI_BRIDGE_BARS_COUNT 2
 
+// Bus tree is built completely before it is published, lookups traverse it
+// under rcu
 static struct pci_bus *root_bus;
 
 u8 read_pci_config_u8(u32 bdf, unsigned offset) {
@@ -151,14 +154,15 @@ err_free_bus:
 }
 
 struct pci_bus *get_root_bus(void) {
-    return root_bus;
+    return rcu_dereference(root_bus);
 }
 
 int init_pci(void) {
-    root_bus = scan_bus(0);
-    if (root_bus == NULL)
+    struct pci_bus *bus = scan_bus(0);
+    if (bus == NULL)
         return -1;
 
+    rcu_assign_pointer(root_bus, bus);
     return 0;
 }
 
@@ -243,13 +247,13 @@ err_free_resources:
 static struct pci_device *find_pci_dev(struct pci_bus *bus, u16 vendor_id,
                                        u16 dev_id) {
     struct pci_device *dev;
-    list_for_each_entry(dev, &bus->dev_list, list) {
+    list_for_each_entry_rcu(dev, &bus->dev_list, list) {
         if (dev->vendor == vendor_id && dev->dev == dev_id)
             return dev;
     }
 
     struct pci_bus *sub_bus;
-    list_for_each_entry(sub_bus, &bus->children, list) {
+    list_for_each_entry_rcu(sub_bus, &bus->children, list) {
         dev = find_pci_dev(sub_bus, vendor_id, dev_id);
         if (dev)
             return dev;
@@ -258,8 +262,13 @@ static struct pci_device *find_pci_dev(struct pci_bus *bus, u16 vendor_id,
     return NULL;
 }
 
+// devices are never freed, so found one stays valid after read-side section
 struct pci_device *get_pci_device(u16 vendor, u16 dev) {
-    return find_pci_dev(root_bus, vendor, dev);
+    rcu_read_lock();
+    struct pci_bus *bus = rcu_dereference(root_bus);
+    struct pci_device *device = bus ? find_pci_dev(bus, vendor, dev) : NULL;
+    rcu_read_unlock();
+    return device;
 }
 
 static void debug_print_dev(struct pci_device *dev) {
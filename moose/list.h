@@ -40,7 +40,7 @@ static inline void list_remove(struct list_head *it) {
 }
 
 static __forceinline __nodiscard int list_is_empty(const struct list_head *it) {
-    return it->next == it->prev;
+    return it->next == it;
 }
 
 #define list_first_entry(_item, _type, _member)                                \
@@ -0,0 +1,234 @@
+#ifdef CONFIG_KMALLOC_TRACE
+
+#include <moose/arch/amd64/asm.h>
+#include <moose/bitops.h>
+#include <moose/kstdio.h>
+#include <moose/mm/alloc_trace.h>
+#include <moose/mm/physmem.h>
+#include <moose/param.h>
+#include <moose/sched/locks.h>
+#include <moose/string.h>
+
+#define TRACE_SITE_COUNT (1u << TRACE_SITE_BITS)
+#define TRACE_OBJ_COUNT (1u << TRACE_OBJ_BITS)
+
+struct trace_site {
+    const void *caller;
+    u64 alloc_count;
+    u64 alloc_bytes;
+    u64 live_count;
+    u64 live_bytes;
+};
+
+struct trace_obj {
+    const void *ptr;
+    u64 timestamp;
+    u32 size;
+    u32 site;
+};
+
+// Both tables use open addressing with linear probing. Sites are never
+// removed, live objects are removed with backward shift so no tombstones
+// are needed.
+static struct {
+    struct trace_site sites[TRACE_SITE_COUNT];
+    struct trace_obj *objs;
+    u32 obj_count;
+    // allocations not recorded because one of tables was full
+    u64 dropped;
+    spinlock_t lock;
+} trace_state = {.lock = INIT_SPIN_LOCK()};
+
+static u32 hash_ptr(const void *ptr, u32 bits) {
+    return ((u64)ptr * 0x9e3779b97f4a7c15ul) >> (64 - bits);
+}
+
+int init_alloc_trace(void) {
+    size_t size = TRACE_OBJ_COUNT * sizeof(struct trace_obj);
+    u32 order = __log2(align_po2(size, PAGE_SIZE) >> PAGE_SIZE_BITS);
+    if ((PAGE_SIZE << order) < size)
+        ++order;
+
+    ssize_t addr = alloc_pages(order);
+    if (addr < 0)
+        return -1;
+
+    struct trace_obj *objs = FIXUP_PTR(addr);
+    memset(objs, 0, size);
+    cpuflags_t flags = spin_lock_irqsave(&trace_state.lock);
+    trace_state.objs = objs;
+    spin_unlock_irqrestore(&trace_state.lock, flags);
+
+    return 0;
+}
+
+// returns index of site or -1 if table is full
+static int get_site(const void *caller) {
+    u32 mask = TRACE_SITE_COUNT - 1;
+    u32 i = hash_ptr(caller, TRACE_SITE_BITS);
+    for (u32 probe = 0; probe < TRACE_SITE_COUNT; ++probe) {
+        struct trace_site *site = trace_state.sites + i;
+        if (site->caller == caller)
+            return i;
+        if (site->caller == NULL) {
+            site->caller = caller;
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return -1;
+}
+
+static struct trace_obj *find_obj(const void *ptr) {
+    u32 mask = TRACE_OBJ_COUNT - 1;
+    u32 i = hash_ptr(ptr, TRACE_OBJ_BITS);
+    for (; trace_state.objs[i].ptr; i = (i + 1) & mask) {
+        if (trace_state.objs[i].ptr == ptr)
+            return trace_state.objs + i;
+    }
+
+    return NULL;
+}
+
+static void insert_obj(const struct trace_obj *obj) {
+    u32 mask = TRACE_OBJ_COUNT - 1;
+    u32 i = hash_ptr(obj->ptr, TRACE_OBJ_BITS);
+    while (trace_state.objs[i].ptr)
+        i = (i + 1) & mask;
+    trace_state.objs[i] = *obj;
+    trace_state.obj_count++;
+}
+
+static void remove_obj(struct trace_obj *obj) {
+    u32 mask = TRACE_OBJ_COUNT - 1;
+    u32 hole = obj - trace_state.objs;
+    for (u32 i = (hole + 1) & mask; trace_state.objs[i].ptr;
+         i = (i + 1) & mask) {
+        // entry can move to hole only if its home slot is not between hole
+        // and its current position
+        u32 home = hash_ptr(trace_state.objs[i].ptr, TRACE_OBJ_BITS);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            trace_state.objs[hole] = trace_state.objs[i];
+            hole = i;
+        }
+    }
+    trace_state.objs[hole].ptr = NULL;
+    trace_state.obj_count--;
+}
+
+void trace_alloc(const void *ptr, size_t size, const void *caller) {
+    if (ptr == NULL)
+        return;
+
+    u64 timestamp = read_tsc();
+    cpuflags_t flags = spin_lock_irqsave(&trace_state.lock);
+    int site = get_site(caller);
+    // keep one slot empty so that probing always terminates
+    if (trace_state.objs == NULL || site < 0 ||
+        trace_state.obj_count == TRACE_OBJ_COUNT - 1) {
+        trace_state.dropped++;
+        goto out;
+    }
+
+    struct trace_site *ts = trace_state.sites + site;
+    ts->alloc_count++;
+    ts->alloc_bytes += size;
+    ts->live_count++;
+    ts->live_bytes += size;
+    struct trace_obj obj = {
+        .ptr = ptr, .timestamp = timestamp, .size = size, .site = site};
+    insert_obj(&obj);
+out:
+    spin_unlock_irqrestore(&trace_state.lock, flags);
+}
+
+void trace_free(const void *ptr) {
+    if (ptr == NULL)
+        return;
+
+    cpuflags_t flags = spin_lock_irqsave(&trace_state.lock);
+    struct trace_obj *obj = trace_state.objs ? find_obj(ptr) : NULL;
+    if (obj) {
+        struct trace_site *site = trace_state.sites + obj->site;
+        site->live_count--;
+        site->live_bytes -= obj->size;
+        remove_obj(obj);
+    }
+    spin_unlock_irqrestore(&trace_state.lock, flags);
+}
+
+// keeps top array sorted by descending allocated bytes
+static void add_top_site(struct trace_site *top, u32 *count,
+                         const struct trace_site *site) {
+    u32 i = *count;
+    if (i == TRACE_TOP_COUNT) {
+        if (top[i - 1].alloc_bytes >= site->alloc_bytes)
+            return;
+        --i;
+    } else {
+        ++*count;
+    }
+
+    for (; i && top[i - 1].alloc_bytes < site->alloc_bytes; --i)
+        top[i] = top[i - 1];
+    top[i] = *site;
+}
+
+// keeps top array sorted by ascending timestamp
+static void add_oldest_obj(struct trace_obj *top, u32 *count,
+                           const struct trace_obj *obj) {
+    u32 i = *count;
+    if (i == TRACE_TOP_COUNT) {
+        if (top[i - 1].timestamp <= obj->timestamp)
+            return;
+        --i;
+    } else {
+        ++*count;
+    }
+
+    for (; i && top[i - 1].timestamp > obj->timestamp; --i)
+        top[i] = top[i - 1];
+    top[i] = *obj;
+}
+
+void print_alloc_trace(void) {
+    struct trace_site top_sites[TRACE_TOP_COUNT];
+    struct trace_obj oldest[TRACE_TOP_COUNT];
+    const void *oldest_callers[TRACE_TOP_COUNT];
+    u32 site_count = 0, obj_count = 0;
+
+    cpuflags_t flags = spin_lock_irqsave(&trace_state.lock);
+    for (u32 i = 0; i < TRACE_SITE_COUNT; ++i) {
+        if (trace_state.sites[i].caller)
+            add_top_site(top_sites, &site_count, trace_state.sites + i);
+    }
+    for (u32 i = 0; trace_state.objs && i < TRACE_OBJ_COUNT; ++i) {
+        if (trace_state.objs[i].ptr)
+            add_oldest_obj(oldest, &obj_count, trace_state.objs + i);
+    }
+    for (u32 i = 0; i < obj_count; ++i)
+        oldest_callers[i] = trace_state.sites[oldest[i].site].caller;
+    u32 live_count = trace_state.obj_count;
+    u64 dropped = trace_state.dropped;
+    spin_unlock_irqrestore(&trace_state.lock, flags);
+
+    kprintf("%-18s %8s %10s %8s %10s\n", "caller", "allocs", "bytes", "live",
+            "live bytes");
+    for (u32 i = 0; i < site_count; ++i) {
+        const struct trace_site *site = top_sites + i;
+        kprintf("%-18p %8lu %10lu %8lu %10lu\n", site->caller,
+                site->alloc_count, site->alloc_bytes, site->live_count,
+                site->live_bytes);
+    }
+
+    u64 now = read_tsc();
+    kprintf("outstanding %u, untracked %lu\n", live_count, dropped);
+    kprintf("%-18s %-18s %8s %14s\n", "ptr", "caller", "size", "age cycles");
+    for (u32 i = 0; i < obj_count; ++i) {
+        kprintf("%-18p %-18p %8u %14lu\n", oldest[i].ptr, oldest_callers[i],
+                oldest[i].size, now - oldest[i].timestamp);
+    }
+}
+
+#endif // CONFIG_KMALLOC_TRACE
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <moose/types.h>
+
+// Allocation tracing is enabled with CONFIG_KMALLOC_TRACE. Every object
+// returned by kmalloc, kzalloc, kstrdup or cache_alloc is recorded with its
+// call site, size and timestamp until it is freed.
+
+#define ALLOC_CALLER() __builtin_return_address(0)
+
+#ifdef CONFIG_KMALLOC_TRACE
+
+// number of distinct call sites tracked
+#define TRACE_SITE_BITS 9
+// number of live objects tracked
+#define TRACE_OBJ_BITS 14
+// number of call sites shown by print_alloc_trace
+#define TRACE_TOP_COUNT 16
+
+// Must be called once page allocator is ready, allocations made before
+// are not tracked
+int init_alloc_trace(void);
+
+void trace_alloc(const void *ptr, size_t size, const void *caller);
+void trace_free(const void *ptr);
+
+// prints top allocating call sites and oldest outstanding allocations
+void print_alloc_trace(void);
+
+#else
+
+static inline int init_alloc_trace(void) { return 0; }
+
+static inline void trace_alloc(const void *ptr __unused, size_t size __unused,
+                               const void *caller __unused) {}
+
+static inline void trace_free(const void *ptr __unused) {}
+
+static inline void print_alloc_trace(void) {}
+
+#endif
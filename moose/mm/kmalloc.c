@@ -1,18 +1,29 @@
+#include <moose/arch/amd64/asm.h>
 #include <moose/arch/amd64/virtmem.h>
 #include <moose/assert.h>
 #include <moose/bitops.h>
+#include <moose/kstdio.h>
 #include <moose/list.h>
+#include <moose/mm/alloc_trace.h>
 #include <moose/mm/kmalloc.h>
+#include <moose/mm/shrinker.h>
+#include <moose/mm/slab.h>
+#include <moose/mm/vmalloc.h>
 #include <moose/param.h>
+#include <moose/sched/lock_stat.h>
 #include <moose/sched/locks.h>
 #include <moose/string.h>
 
-#define BRK_BASE ((uintptr_t)0xffffc90000000000llu)
-#define BRK_LIMIT ((uintptr_t)0xffffe8ffffffffffllu)
+#define BRK_BASE ((uintptr_t)KMALLOC_VIRTUAL_BASE)
+#define BRK_LIMIT ((uintptr_t)VMALLOC_VIRTUAL_BASE - 1)
 
 #define INITIAL_HEAP_SIZE (1 << 19)
 #define ALIGNMENT 16
 
+// allocations up to this size are served by slab general caches, the
+// largest ones take whole pages
+#define KMALLOC_SLAB_MAX_SIZE 32768
+
 struct mem_block {
     size_t size;
     int used;
@@ -37,7 +48,7 @@ static struct {
                    .pbrk = BRK_BASE,
                    .plimit = BRK_BASE};
 
-// expand-only version of sbrk
+// pages above new break are unmapped when it moves down
 static void *sbrk(intptr_t increment) {
     uintptr_t pbrk = kmalloc_state.pbrk;
     uintptr_t plimit = kmalloc_state.plimit;
@@ -54,6 +65,13 @@ static void *sbrk(intptr_t increment) {
             return NULL;
 
         plimit += alloc_page_count << PAGE_SIZE_BITS;
+    } else if (increment < 0) {
+        uintptr_t new_plimit = align_po2(pbrk + increment, PAGE_SIZE);
+        if (new_plimit < plimit) {
+            free_virtual_pages(new_plimit,
+                               (plimit - new_plimit) >> PAGE_SIZE_BITS);
+            plimit = new_plimit;
+        }
     }
 
     pbrk += increment;
@@ -67,17 +85,24 @@ static void init_subheap(struct subheap *heap) {
     init_list_head(&heap->blocks);
     struct mem_block *block = heap->memory;
     block->size = heap->size - sizeof(struct mem_block);
+    block->used = 0;
     list_add(&block->list, &heap->blocks);
 }
 
+// heap used before slab caches and page allocator are available
+static u8 initial_memory[INITIAL_HEAP_SIZE] __aligned(ALIGNMENT);
+
+static struct shrinker heap_shrinker;
+
 void init_kmalloc(void) {
-    static u8 initial_memory[INITIAL_HEAP_SIZE] __aligned(ALIGNMENT);
     static struct subheap initial_subheap = {
         .memory = initial_memory,
         .size = INITIAL_HEAP_SIZE,
     };
     init_subheap(&initial_subheap);
     list_add(&initial_subheap.list, &kmalloc_state.subheaps);
+    register_shrinker(&heap_shrinker);
+    set_spin_lock_class(&kmalloc_state.lock, "kmalloc");
 }
 
 static struct mem_block *subheap_find_best_block(struct subheap *heap,
@@ -123,10 +148,57 @@ static struct subheap *add_new_subheap(size_t min_size) {
     return subheap;
 }
 
-void *kmalloc(size_t size) {
-    if (size == 0)
+static int is_subheap_free(struct subheap *heap) {
+    struct mem_block *block =
+        list_first_or_null(&heap->blocks, struct mem_block, list);
+    return !block->used && block->size == heap->size - sizeof(*block);
+}
+
+// returns top subheap if it is entirely free and can be given back with sbrk
+static struct subheap *get_trimmable_subheap(void) {
+    struct subheap *heap =
+        list_first_or_null(&kmalloc_state.subheaps, struct subheap, list);
+    if (heap == NULL ||
+        (uintptr_t)heap->memory + heap->size != kmalloc_state.pbrk ||
+        !is_subheap_free(heap))
         return NULL;
 
+    return heap;
+}
+
+static size_t count_heap_pages(struct shrinker *shrinker __unused) {
+    if (!spin_trylock(&kmalloc_state.lock))
+        return 0;
+    size_t count = 0;
+    struct subheap *heap = get_trimmable_subheap();
+    if (heap)
+        count = (kmalloc_state.pbrk - (uintptr_t)heap) >> PAGE_SIZE_BITS;
+    spin_unlock(&kmalloc_state.lock);
+    return count;
+}
+
+static size_t scan_heap_pages(struct shrinker *shrinker __unused,
+                              size_t nr_pages) {
+    if (!spin_trylock(&kmalloc_state.lock))
+        return 0;
+
+    size_t freed = 0;
+    struct subheap *heap;
+    while (freed < nr_pages && (heap = get_trimmable_subheap())) {
+        size_t size = kmalloc_state.pbrk - (uintptr_t)heap;
+        list_remove(&heap->list);
+        sbrk(-(intptr_t)size);
+        freed += size >> PAGE_SIZE_BITS;
+    }
+    spin_unlock(&kmalloc_state.lock);
+
+    return freed;
+}
+
+static struct shrinker heap_shrinker = {.count = count_heap_pages,
+                                        .scan = scan_heap_pages};
+
+static void *heap_alloc(size_t size) {
     size = align_po2(size, ALIGNMENT);
     expects(size != 0);
 
@@ -163,11 +235,38 @@ void *kmalloc(size_t size) {
     return result;
 }
 
+static void *__kmalloc(size_t size) {
+    if (size == 0)
+        return NULL;
+
+    if (size <= KMALLOC_SLAB_MAX_SIZE) {
+        void *result = smalloc(size);
+        if (result)
+            return result;
+    } else {
+        // larger memory does not have to be physically contiguous, so it is
+        // mapped page by page instead of taking high order blocks. Heap is
+        // left for the time before vmalloc is initialized
+        void *result = vmalloc(size);
+        if (result)
+            return result;
+    }
+
+    return heap_alloc(size);
+}
+
+void *kmalloc(size_t size) {
+    void *mem = __kmalloc(size);
+    trace_alloc(mem, size, ALLOC_CALLER());
+    return mem;
+}
+
 void *kzalloc(size_t size) {
-    void *mem = kmalloc(size);
+    void *mem = __kmalloc(size);
     if (mem)
         memset(mem, 0, size);
 
+    trace_alloc(mem, size, ALLOC_CALLER());
     return mem;
 }
 
@@ -182,10 +281,16 @@ static struct subheap *find_block_heap(struct mem_block *block) {
     return NULL;
 }
 
-void kfree(void *mem) {
-    if (mem == NULL)
-        return;
+static int is_heap_ptr(const void *mem) {
+    uintptr_t addr = (uintptr_t)mem;
+    if (addr >= (uintptr_t)initial_memory &&
+        addr < (uintptr_t)initial_memory + INITIAL_HEAP_SIZE)
+        return 1;
+
+    return addr >= BRK_BASE && addr <= BRK_LIMIT;
+}
 
+static void heap_free(void *mem) {
     cpuflags_t flags = spin_lock_irqsave(&kmalloc_state.lock);
 
     struct mem_block *block = (struct mem_block *)mem - 1;
@@ -195,8 +300,8 @@ void kfree(void *mem) {
 
     struct mem_block *left =
         list_prev_entry_or_null(block, &subheap->blocks, list);
-    expects(left->size);
     if (left && !left->used) {
+        expects(left->size);
         left->size += block->size + sizeof(struct mem_block);
         list_remove(&block->list);
         block = left;
@@ -204,8 +309,8 @@ void kfree(void *mem) {
 
     struct mem_block *right =
         list_next_entry_or_null(block, &subheap->blocks, list);
-    expects(right->size);
     if (right && !right->used) {
+        expects(right->size);
         block->size += right->size + sizeof(struct mem_block);
         list_remove(&right->list);
     }
@@ -213,14 +318,60 @@ void kfree(void *mem) {
     spin_unlock_irqrestore(&kmalloc_state.lock, flags);
 }
 
+void kfree(void *mem) {
+    if (mem == NULL)
+        return;
+
+    trace_free(mem);
+    if (is_heap_ptr(mem))
+        heap_free(mem);
+    else if (is_vmalloc_addr(mem))
+        vfree(mem);
+    else
+        sfree(mem);
+}
+
 char *kstrdup(const char *str) {
     if (str == NULL)
         return NULL;
 
     size_t len = strlen(str);
-    void *memory = kmalloc(len + 1);
+    void *memory = __kmalloc(len + 1);
     if (memory)
         strcpy(memory, str);
 
+    trace_alloc(memory, len + 1, ALLOC_CALLER());
     return memory;
 }
+
+#ifdef CONFIG_BENCH
+
+#define BENCH_ROUNDS 256
+#define BENCH_BATCH 64
+
+// average cycles for one allocation and free with BENCH_BATCH objects alive
+static u64 bench_allocator(void *(*alloc)(size_t), void (*free)(void *),
+                           size_t size) {
+    void *objs[BENCH_BATCH];
+    u64 start = read_tsc();
+    for (u32 round = 0; round < BENCH_ROUNDS; ++round) {
+        for (u32 i = 0; i < BENCH_BATCH; ++i)
+            objs[i] = alloc(size);
+        for (u32 i = 0; i < BENCH_BATCH; ++i)
+            free(objs[i]);
+    }
+
+    return (read_tsc() - start) / (BENCH_ROUNDS * BENCH_BATCH);
+}
+
+void bench_kmalloc(void) {
+    static const size_t sizes[] = {16, 64, 256, 1024, 2048, 4096, 16384};
+    for (u32 i = 0; i < ARRAY_SIZE(sizes); ++i) {
+        u64 heap = bench_allocator(heap_alloc, heap_free, sizes[i]);
+        u64 slab = bench_allocator(kmalloc, kfree, sizes[i]);
+        kprintf("kmalloc %lu bytes: heap %lu, slab %lu cycles\n", sizes[i],
+                heap, slab);
+    }
+}
+
+#endif
@@ -9,3 +9,7 @@ void *kzalloc(size_t size);
 void kfree(void *mem);
 
 char *kstrdup(const char *src);
+
+#ifdef CONFIG_BENCH
+void bench_kmalloc(void);
+#endif
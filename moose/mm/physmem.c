@@ -1,25 +1,64 @@
 #include <moose/arch/amd64/types.h>
+#include <moose/arch/cpu.h>
 #include <moose/assert.h>
 #include <moose/bitops.h>
+#include <moose/kstdio.h>
+#include <moose/list.h>
 #include <moose/mm/kmalloc.h>
 #include <moose/mm/physmem.h>
+#include <moose/mm/shrinker.h>
 #include <moose/param.h>
+#include <moose/sched/locks.h>
+#include <moose/string.h>
+
+// Header written into the first page of every free block
+struct free_block {
+    struct list_head list;
+};
 
 struct free_area {
-    u32 size;
+    struct list_head free_list;
+    // bit is set if block with this index is free and is on free_list
     u64 *bitmap;
+    // count of blocks of this order that fit in zone
+    u64 size;
+    u64 free_count;
 };
 
 struct mem_zone {
-    u64 mem_size;
+    u64 page_count;
     u64 base_addr;
+    u32 max_order;
     struct free_area free_area[MAX_ORDER + 1];
 };
 
+// Per-cpu cache of single pages sitting in front of buddy allocator.
+// Recently freed (hot) pages are kept at the head of the list and are given
+// out first, cold pages are added to the tail and are the first ones to be
+// returned to buddy allocator. Lock is normally taken only by its cpu, other
+// cpus take it to drain the list when higher order allocation fails.
+// Lock order is per-cpu lock, then phys_mem.lock
+struct percpu_pages {
+    spinlock_t lock;
+    struct list_head list;
+    u32 count;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct percpu_pages percpu_pages[MAX_CPUS];
+
+// shrinkers are called when free memory drops below low watermark until it
+// is back above high watermark
+#define LOW_WATERMARK_MIN_PAGES 64
+
 static struct phys_mem {
     struct mem_zone *zones;
     u32 zone_count;
-} phys_mem;
+    spinlock_t lock;
+    // pages in buddy free lists, excluding per-cpu caches
+    u64 free_pages;
+    u64 low_watermark;
+    u64 high_watermark;
+} phys_mem = {.lock = INIT_SPIN_LOCK()};
 
 static void free_phys_mem(void) {
     for (size_t i = 0; i < phys_mem.zone_count; ++i) {
@@ -36,138 +75,513 @@ int init_phys_mem(const struct mem_range *ranges, size_t range_count) {
         return -1;
 
     phys_mem.zone_count = range_count;
+    u64 total_pages = 0;
     for (u32 i = 0; i < range_count; ++i) {
         const struct mem_range *entry = ranges + i;
         struct mem_zone *zone = phys_mem.zones + i;
-        zone->base_addr = entry->base;
-
-        // count of the largest page blocks
-        u32 block_count = entry->size >> MAX_BLOCK_SIZE_BITS;
-        u32 max_order = MAX_ORDER;
-        zone->mem_size = entry->size & ~(MAX_BLOCK_SIZE - 1);
+        u64 base = align_po2(entry->base, PAGE_SIZE);
+        u64 end = (entry->base + entry->size) & ~(PAGE_SIZE - 1);
+        zone->base_addr = base;
+        zone->page_count = end > base ? (end - base) >> PAGE_SIZE_BITS : 0;
+        total_pages += zone->page_count;
 
         // if zone size less than max block size
         // buddy max order decreases
-        if (entry->size < MAX_BLOCK_SIZE) {
-            max_order = __log2(entry->size >> PAGE_SIZE_BITS);
-            block_count = 1;
-            zone->mem_size = block_count << PAGE_SIZE_BITS;
-        }
+        zone->max_order = MAX_ORDER;
+        if (zone->page_count < (1lu << MAX_ORDER))
+            zone->max_order =
+                zone->page_count ? __log2(zone->page_count) : 0;
 
         // alloc per order bitmaps
-        for (int j = max_order; j >= 0; j--) {
-            u32 bitmap_size = bits_to_bitmap(block_count << j);
-            u64 *bitmap = kzalloc(bitmap_size * sizeof(u64));
-            if (bitmap == NULL) {
+        for (u32 j = 0; j <= zone->max_order; j++) {
+            struct free_area *area = zone->free_area + j;
+            init_list_head(&area->free_list);
+            area->size = zone->page_count >> j;
+            size_t bitmap_size = bits_to_bitmap(area->size);
+            if (bitmap_size == 0)
+                bitmap_size = 1;
+
+            area->bitmap = kzalloc(bitmap_size * sizeof(u64));
+            if (area->bitmap == NULL) {
                 free_phys_mem();
                 return -1;
             }
-
-            u32 index = max_order - j;
-            zone->free_area[index].size = block_count << j;
-            zone->free_area[index].bitmap = bitmap;
         }
     }
 
+    phys_mem.low_watermark = total_pages / 64;
+    if (phys_mem.low_watermark < LOW_WATERMARK_MIN_PAGES)
+        phys_mem.low_watermark = LOW_WATERMARK_MIN_PAGES;
+    phys_mem.high_watermark = 2 * phys_mem.low_watermark;
+
     return 0;
 }
 
-static int test_buddies(const struct free_area *free_area, u32 order,
-                        u64 index) {
-    for (u32 i = 0; i <= order; i++) {
-        u32 bit_count = 1 << i;
-        u32 area_index = order - i;
-        for (u32 j = 0; j < bit_count; j++)
-            if (test_bit((index << i) + j, free_area[area_index].bitmap))
-                return 1;
+static struct mem_zone *find_zone(u64 addr) {
+    for (u32 zone_idx = 0; zone_idx < phys_mem.zone_count; zone_idx++) {
+        struct mem_zone *zone = &phys_mem.zones[zone_idx];
+        if (addr >= zone->base_addr &&
+            addr < zone->base_addr + (zone->page_count << PAGE_SIZE_BITS))
+            return zone;
     }
 
-    return 0;
+    return NULL;
 }
 
-static void set_buddies(struct free_area *free_area, u32 order, u64 index) {
-    for (u32 i = 0; i <= order; i++) {
-        u32 bit_count = 1 << i;
-        u32 area_index = order - i;
-        for (u32 j = 0; j < bit_count; j++)
-            set_bit((index << i) + j, free_area[area_index].bitmap);
+static u64 block_addr(const struct mem_zone *zone, u32 order, u64 index) {
+    return zone->base_addr + (index << (order + PAGE_SIZE_BITS));
+}
+
+static struct free_block *get_free_block(const struct mem_zone *zone,
+                                         u32 order, u64 index) {
+    return FIXUP_PTR(block_addr(zone, order, index));
+}
+
+static void add_free_block(struct mem_zone *zone, u32 order, u64 index) {
+    struct free_area *area = zone->free_area + order;
+    struct free_block *block = get_free_block(zone, order, index);
+    list_add(&block->list, &area->free_list);
+    set_bit(index, area->bitmap);
+    ++area->free_count;
+    phys_mem.free_pages += 1lu << order;
+}
+
+static void remove_free_block(struct mem_zone *zone, u32 order, u64 index) {
+    struct free_area *area = zone->free_area + order;
+    struct free_block *block = get_free_block(zone, order, index);
+    list_remove(&block->list);
+    clear_bit(index, area->bitmap);
+    --area->free_count;
+    phys_mem.free_pages -= 1lu << order;
+}
+
+static int is_block_free(const struct mem_zone *zone, u32 order, u64 index) {
+    const struct free_area *area = zone->free_area + order;
+    return index < area->size && test_bit(index, area->bitmap);
+}
+
+static ssize_t zone_alloc_pages(struct mem_zone *zone, u32 order) {
+    for (u32 current = order; current <= zone->max_order; ++current) {
+        struct free_area *area = zone->free_area + current;
+        struct free_block *block =
+            list_first_or_null(&area->free_list, struct free_block, list);
+        if (block == NULL)
+            continue;
+
+        u64 addr = (u64)PTR_TO_PHYS(block);
+        u64 index = (addr - zone->base_addr) >> (current + PAGE_SIZE_BITS);
+        remove_free_block(zone, current, index);
+
+        // split block keeping lower half and returning upper ones
+        while (current > order) {
+            --current;
+            index <<= 1;
+            add_free_block(zone, current, index + 1);
+        }
+
+        return addr;
     }
+
+    return -1;
 }
 
-static void clear_buddies(struct free_area *free_area, u32 order, u64 index) {
-    for (u32 i = 0; i <= order; i++) {
-        u32 bit_count = 1 << i;
-        u32 area_index = order - i;
-        for (u32 j = 0; j < bit_count; j++)
-            clear_bit((index << i) + j, free_area[area_index].bitmap);
+static void zone_free_pages(struct mem_zone *zone, u64 addr, u32 order) {
+    u64 index = (addr - zone->base_addr) >> (order + PAGE_SIZE_BITS);
+    expects(!is_block_free(zone, order, index));
+
+    // coalesce with buddies while they are free
+    for (; order < zone->max_order; ++order, index >>= 1) {
+        u64 buddy = index ^ 1;
+        if (!is_block_free(zone, order, buddy))
+            break;
+
+        remove_free_block(zone, order, buddy);
     }
+
+    add_free_block(zone, order, index);
 }
 
-ssize_t alloc_pages(u32 order) {
-    assert(order <= MAX_ORDER);
-    // finds first available memory zone
+// must be called with phys_mem.lock held
+static ssize_t __alloc_pages(u32 order) {
+    // finds first memory zone with large enough block
     for (u32 zone_idx = 0; zone_idx < phys_mem.zone_count; zone_idx++) {
         struct mem_zone *zone = &phys_mem.zones[zone_idx];
-        struct free_area *area = &zone->free_area[order];
-        if (area->bitmap == NULL)
+        if (order > zone->max_order)
             continue;
 
-        for (u64 bit_idx = 0; bit_idx < area->size; bit_idx++) {
-            if (!test_buddies(zone->free_area, order, bit_idx)) {
-                set_buddies(zone->free_area, order, bit_idx);
-                return zone->base_addr + (bit_idx << (order + PAGE_SIZE_BITS));
-            }
-        }
+        ssize_t result = zone_alloc_pages(zone, order);
+        if (result >= 0)
+            return result;
     }
 
     return -1;
 }
 
+// must be called with phys_mem.lock held
+static void __free_pages(u64 addr, u32 order) {
+    struct mem_zone *zone = find_zone(addr);
+    expects(zone);
+    zone_free_pages(zone, addr, order);
+}
+
+// returns number of pages shrinkers should free, must be called with
+// phys_mem.lock held
+static u64 reclaim_target(void) {
+    if (phys_mem.free_pages >= phys_mem.low_watermark)
+        return 0;
+    return phys_mem.high_watermark - phys_mem.free_pages;
+}
+
+static ssize_t try_alloc_pages(u32 order, u64 *reclaim) {
+    cpuflags_t flags = spin_lock_irqsave(&phys_mem.lock);
+    ssize_t result = __alloc_pages(order);
+    *reclaim = reclaim_target();
+    spin_unlock_irqrestore(&phys_mem.lock, flags);
+    return result;
+}
+
+ssize_t alloc_pages(u32 order) {
+    assert(order <= MAX_ORDER);
+    u64 reclaim;
+    ssize_t result = try_alloc_pages(order, &reclaim);
+
+    // pages sitting in per-cpu cache may be preventing coalescing
+    if (result < 0 && order != 0) {
+        drain_percpu_pages();
+        result = try_alloc_pages(order, &reclaim);
+    }
+
+    if (result < 0) {
+        if (shrink_memory(1lu << order)) {
+            // reclaimed pages end up in per-cpu cache
+            if (order != 0)
+                drain_percpu_pages();
+            result = try_alloc_pages(order, &reclaim);
+        }
+    } else if (reclaim) {
+        shrink_memory(reclaim);
+    }
+
+    return result;
+}
+
 void free_pages(u64 addr, u32 order) {
     assert((addr & 0xfff) == 0);
     assert(order <= MAX_ORDER);
-    for (u32 zone_idx = 0; zone_idx < phys_mem.zone_count; zone_idx++) {
-        struct mem_zone *zone = &phys_mem.zones[zone_idx];
-        if (addr >= zone->base_addr &&
-            addr < zone->base_addr + zone->mem_size) {
-            u64 bit_idx = (addr - zone->base_addr) >> (order + PAGE_SIZE_BITS);
-            clear_buddies(zone->free_area, order, bit_idx);
-        }
+    cpuflags_t flags = spin_lock_irqsave(&phys_mem.lock);
+    __free_pages(addr, order);
+    spin_unlock_irqrestore(&phys_mem.lock, flags);
+}
+
+void init_percpu_pages(int cpu) {
+    struct percpu_pages *pcp = percpu_pages + cpu;
+    init_spin_lock(&pcp->lock);
+    init_list_head(&pcp->list);
+    pcp->count = 0;
+}
+
+// moves up to count pages from buddy allocator to the tail of per-cpu list,
+// returns number of pages shrinkers should free
+static u64 refill_percpu_pages(struct percpu_pages *pcp, u32 count) {
+    spin_lock(&phys_mem.lock);
+    for (; count; --count) {
+        ssize_t addr = __alloc_pages(0);
+        if (addr < 0)
+            break;
+
+        struct free_block *block = FIXUP_PTR(addr);
+        list_add_tail(&block->list, &pcp->list);
+        ++pcp->count;
+    }
+    u64 reclaim = reclaim_target();
+    spin_unlock(&phys_mem.lock);
+
+    if (pcp->count == 0 && reclaim < PERCPU_PAGES_BATCH)
+        reclaim = PERCPU_PAGES_BATCH;
+    return reclaim;
+}
+
+// returns up to count coldest pages from per-cpu list to buddy allocator,
+// list lock must be held
+static void drain_pages(struct percpu_pages *pcp, u32 count) {
+    spin_lock(&phys_mem.lock);
+    for (; count && pcp->count; --count) {
+        struct free_block *block =
+            list_last_or_null(&pcp->list, struct free_block, list);
+        list_remove(&block->list);
+        --pcp->count;
+        __free_pages((u64)PTR_TO_PHYS(block), 0);
+    }
+    spin_unlock(&phys_mem.lock);
+}
+
+void drain_percpu_pages(void) {
+    for (int cpu = 0; cpu < get_cpu_count(); ++cpu) {
+        struct percpu_pages *pcp = percpu_pages + cpu;
+        cpuflags_t flags = spin_lock_irqsave(&pcp->lock);
+        drain_pages(pcp, pcp->count);
+        spin_unlock_irqrestore(&pcp->lock, flags);
     }
 }
 
 ssize_t alloc_page(void) {
-    return alloc_pages(0);
+    cpuflags_t flags = irq_save();
+    struct percpu_pages *pcp = percpu_pages + get_cpu_id();
+    spin_lock(&pcp->lock);
+    if (pcp->count == 0) {
+        u64 reclaim = refill_percpu_pages(pcp, PERCPU_PAGES_BATCH);
+        if (reclaim) {
+            // freed pages go to this cpu's cache, interrupts stay disabled
+            // so that this is still the same cpu afterwards
+            spin_unlock(&pcp->lock);
+            int shrunk = shrink_memory(reclaim);
+            spin_lock(&pcp->lock);
+            if (shrunk && pcp->count == 0)
+                refill_percpu_pages(pcp, PERCPU_PAGES_BATCH);
+        }
+    }
+
+    struct free_block *block =
+        list_first_or_null(&pcp->list, struct free_block, list);
+    if (block == NULL) {
+        spin_unlock(&pcp->lock);
+        irq_restore(flags);
+        return -1;
+    }
+
+    list_remove(&block->list);
+    --pcp->count;
+    spin_unlock(&pcp->lock);
+    irq_restore(flags);
+
+    return (u64)PTR_TO_PHYS(block);
+}
+
+static void free_percpu_page(u64 addr, int cold) {
+    assert((addr & 0xfff) == 0);
+    cpuflags_t flags = irq_save();
+    struct percpu_pages *pcp = percpu_pages + get_cpu_id();
+    spin_lock(&pcp->lock);
+    struct free_block *block = FIXUP_PTR(addr);
+    if (cold)
+        list_add_tail(&block->list, &pcp->list);
+    else
+        list_add(&block->list, &pcp->list);
+
+    if (++pcp->count > PERCPU_PAGES_HIGH)
+        drain_pages(pcp, PERCPU_PAGES_BATCH);
+    spin_unlock(&pcp->lock);
+    irq_restore(flags);
 }
 
 void free_page(u64 addr) {
-    free_pages(addr, 0);
+    free_percpu_page(addr, 0);
+}
+
+void free_page_cold(u64 addr) {
+    free_percpu_page(addr, 1);
+}
+
+// returns order of free block containing page or -1 if page is used
+static int find_free_block(const struct mem_zone *zone, u64 page_idx) {
+    for (u32 order = 0; order <= zone->max_order; ++order) {
+        if (is_block_free(zone, order, page_idx >> order))
+            return order;
+    }
+
+    return -1;
+}
+
+static void reserve_page(struct mem_zone *zone, u64 page_idx) {
+    int order = find_free_block(zone, page_idx);
+    expects(order >= 0);
+    remove_free_block(zone, order, page_idx >> order);
+
+    // split containing block returning halves that do not contain page
+    while (order > 0) {
+        --order;
+        add_free_block(zone, order, (page_idx >> order) ^ 1);
+    }
 }
 
 int alloc_region(u64 addr, u64 count) {
     assert((addr & 0xfff) == 0);
-    for (u32 zone_idx = 0; zone_idx < phys_mem.zone_count; zone_idx++) {
-        struct mem_zone *zone = &phys_mem.zones[zone_idx];
-        if (addr < zone->base_addr || addr >= zone->base_addr + zone->mem_size)
+    cpuflags_t flags = spin_lock_irqsave(&phys_mem.lock);
+    for (u64 i = 0; i < count; ++i) {
+        u64 page = addr + (i << PAGE_SIZE_BITS);
+        struct mem_zone *zone = find_zone(page);
+        if (zone == NULL)
             continue;
 
-        struct free_area *area = &zone->free_area[0];
-        u64 bit_idx = (addr - zone->base_addr) >> PAGE_SIZE_BITS;
-        if (bit_idx + count > area->size)
+        u64 page_idx = (page - zone->base_addr) >> PAGE_SIZE_BITS;
+        if (find_free_block(zone, page_idx) < 0) {
+            spin_unlock_irqrestore(&phys_mem.lock, flags);
             return -1;
+        }
+    }
+
+    for (u64 i = 0; i < count; ++i) {
+        u64 page = addr + (i << PAGE_SIZE_BITS);
+        struct mem_zone *zone = find_zone(page);
+        if (zone != NULL)
+            reserve_page(zone, (page - zone->base_addr) >> PAGE_SIZE_BITS);
+    }
+    spin_unlock_irqrestore(&phys_mem.lock, flags);
+
+    return 0;
+}
 
-        for (u64 idx = bit_idx; idx < bit_idx + count; idx++)
-            if (test_bit(idx, area->bitmap))
+void free_region(u64 addr, u64 count) {
+    assert((addr & 0xfff) == 0);
+    cpuflags_t flags = spin_lock_irqsave(&phys_mem.lock);
+    while (count) {
+        struct mem_zone *zone = find_zone(addr);
+        if (zone == NULL) {
+            addr += PAGE_SIZE;
+            --count;
+            continue;
+        }
+
+        // free largest aligned blocks that fit in region
+        u64 page_idx = (addr - zone->base_addr) >> PAGE_SIZE_BITS;
+        u64 limit = zone->page_count - page_idx;
+        if (limit > count)
+            limit = count;
+
+        u32 order = zone->max_order;
+        if (page_idx && __count_trailing_zeroes(page_idx) < order)
+            order = __count_trailing_zeroes(page_idx);
+        while ((1lu << order) > limit)
+            --order;
+
+        zone_free_pages(zone, addr, order);
+        addr += PAGE_SIZE << order;
+        count -= 1lu << order;
+    }
+    spin_unlock_irqrestore(&phys_mem.lock, flags);
+}
+
+void get_phys_mem_stats(struct phys_mem_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    cpuflags_t flags = spin_lock_irqsave(&phys_mem.lock);
+    for (u32 zone_idx = 0; zone_idx < phys_mem.zone_count; zone_idx++) {
+        const struct mem_zone *zone = &phys_mem.zones[zone_idx];
+        stats->total_pages += zone->page_count;
+        for (u32 order = 0; order <= zone->max_order; ++order) {
+            u64 free_count = zone->free_area[order].free_count;
+            stats->free_blocks[order] += free_count;
+            stats->free_pages += free_count << order;
+        }
+    }
+    spin_unlock_irqrestore(&phys_mem.lock, flags);
+
+    for (int cpu = 0; cpu < get_cpu_count(); ++cpu)
+        stats->cached_pages += percpu_pages[cpu].count;
+}
+
+void print_phys_mem_stats(void) {
+    struct phys_mem_stats stats;
+    get_phys_mem_stats(&stats);
+    kprintf("physical memory: %lu/%lu pages free, %lu cached\n",
+            stats.free_pages, stats.total_pages, stats.cached_pages);
+    kprintf("free blocks per order:");
+    for (u32 order = 0; order <= MAX_ORDER; ++order)
+        kprintf(" %lu", stats.free_blocks[order]);
+    kprintf("\n");
+}
+
+static int check_zone(const struct mem_zone *zone) {
+    for (u32 order = 0; order <= zone->max_order; ++order) {
+        const struct free_area *area = zone->free_area + order;
+        u64 list_count = 0;
+        struct free_block *block;
+        list_for_each_entry(block, &area->free_list, list) {
+            u64 addr = (u64)PTR_TO_PHYS(block);
+            u64 offset = addr - zone->base_addr;
+            u64 index = offset >> (order + PAGE_SIZE_BITS);
+            if (addr < zone->base_addr ||
+                (offset & ((PAGE_SIZE << order) - 1)) ||
+                !is_block_free(zone, order, index)) {
+                kprintf("physmem: bad free block %#lx of order %u\n", addr,
+                        order);
                 return -1;
+            }
+
+            // buddies should have been coalesced
+            if (order < zone->max_order &&
+                is_block_free(zone, order, index ^ 1)) {
+                kprintf("physmem: block %#lx of order %u is not coalesced\n",
+                        addr, order);
+                return -1;
+            }
+            ++list_count;
+        }
 
-        for (u64 idx = bit_idx; idx < bit_idx + count; idx++)
-            set_bit(idx, area->bitmap);
+        u64 bit_count = 0;
+        for (u64 i = 0; i < bits_to_bitmap(area->size); ++i) {
+            // NOTE: popcount builtin needs libgcc without -mpopcnt
+            for (u64 word = area->bitmap[i]; word; word &= word - 1)
+                ++bit_count;
+        }
+
+        if (list_count != area->free_count || bit_count != area->free_count) {
+            kprintf("physmem: order %u counts mismatch: list=%lu bitmap=%lu "
+                    "counter=%lu\n",
+                    order, list_count, bit_count, area->free_count);
+            return -1;
+        }
     }
 
     return 0;
 }
 
-void free_region(u64 addr, u64 count) {
-    for (u64 i = 0; i < count; i++)
-        free_page(addr);
+// Boot-time self check: verifies free lists against bitmaps and counters
+// and makes sure that allocation and freeing of every order leaves
+// allocator in the same state
+int check_phys_mem(void) {
+    cpuflags_t flags = spin_lock_irqsave(&phys_mem.lock);
+    u64 listed_free_pages = 0;
+    for (u32 zone_idx = 0; zone_idx < phys_mem.zone_count; zone_idx++) {
+        const struct mem_zone *zone = &phys_mem.zones[zone_idx];
+        if (check_zone(zone)) {
+            spin_unlock_irqrestore(&phys_mem.lock, flags);
+            return -1;
+        }
+        for (u32 order = 0; order <= zone->max_order; ++order)
+            listed_free_pages += zone->free_area[order].free_count << order;
+    }
+    u64 counted_free_pages = phys_mem.free_pages;
+    spin_unlock_irqrestore(&phys_mem.lock, flags);
+
+    if (listed_free_pages != counted_free_pages) {
+        kprintf("physmem: free page counter is %lu, free lists hold %lu\n",
+                counted_free_pages, listed_free_pages);
+        return -1;
+    }
+
+    struct phys_mem_stats before, after;
+    get_phys_mem_stats(&before);
+    ssize_t blocks[MAX_ORDER + 1];
+    for (u32 order = 0; order <= MAX_ORDER; ++order) {
+        blocks[order] = alloc_pages(order);
+        if (blocks[order] >= 0 &&
+            ((blocks[order] - find_zone(blocks[order])->base_addr) &
+             ((PAGE_SIZE << order) - 1)) != 0) {
+            kprintf("physmem: block %#lx of order %u is misaligned\n",
+                    blocks[order], order);
+            return -1;
+        }
+    }
+    for (u32 order = 0; order <= MAX_ORDER; ++order) {
+        if (blocks[order] >= 0)
+            free_pages(blocks[order], order);
+    }
+    get_phys_mem_stats(&after);
+
+    if (memcmp(&before, &after, sizeof(before)) != 0) {
+        kprintf("physmem: allocator state changed after alloc/free cycle\n");
+        return -1;
+    }
+
+    return 0;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <moose/list.h>
 #include <moose/types.h>
 
 struct mem_range {
@@ -14,6 +15,23 @@ struct mem_range {
 // largest page block for buddy allocator
 #define MAX_BLOCK_SIZE ((PAGE_SIZE << (MAX_ORDER)))
 
+// Every cpu has cache of single pages in front of buddy allocator, pages
+// are moved between them in batches
+#define PERCPU_PAGES_BATCH 16
+#define PERCPU_PAGES_HIGH (4 * PERCPU_PAGES_BATCH)
+
+struct phys_mem_stats {
+    u64 total_pages;
+    u64 free_pages;
+    // pages held by per-cpu caches, not included in free_pages
+    u64 cached_pages;
+    // count of free blocks of each order
+    u64 free_blocks[MAX_ORDER + 1];
+};
+
+// Zones are created with all of their memory reserved. Memory has to be
+// handed to the allocator with free_region once it is reachable through
+// the direct map, because free lists are stored inside free blocks.
 int init_phys_mem(const struct mem_range *ranges, size_t ranges_size);
 
 ssize_t alloc_page(void);
@@ -21,6 +39,16 @@ ssize_t alloc_pages(u32 order);
 
 void free_pages(u64 addr, u32 order);
 void free_page(u64 addr);
+// Frees page which contents are not expected to be in cpu cache
+void free_page_cold(u64 addr);
+
+void init_percpu_pages(int cpu);
+// returns pages cached by every cpu to buddy allocator
+void drain_percpu_pages(void);
 
 int alloc_region(u64 addr, u64 count);
 void free_region(u64 addr, u64 count);
+
+void get_phys_mem_stats(struct phys_mem_stats *stats);
+void print_phys_mem_stats(void);
+int check_phys_mem(void);
@@ -0,0 +1,62 @@
+#include <moose/arch/cpu.h>
+#include <moose/assert.h>
+#include <moose/mm/shrinker.h>
+#include <moose/sched/locks.h>
+
+static struct {
+    struct list_head shrinkers;
+    spinlock_t lock;
+    // only one cpu reclaims at a time, this also prevents recursion when
+    // shrinker allocates memory
+    atomic_t in_reclaim;
+} shrinker_state = {.shrinkers = INIT_LIST_HEAD(shrinker_state.shrinkers),
+                    .lock = INIT_SPIN_LOCK(),
+                    .in_reclaim = INIT_ATOMIC(0)};
+
+void register_shrinker(struct shrinker *shrinker) {
+    cpuflags_t flags = spin_lock_irqsave(&shrinker_state.lock);
+    list_add_tail(&shrinker->list, &shrinker_state.shrinkers);
+    spin_unlock_irqrestore(&shrinker_state.lock, flags);
+}
+
+void unregister_shrinker(struct shrinker *shrinker) {
+    cpuflags_t flags = spin_lock_irqsave(&shrinker_state.lock);
+    list_remove(&shrinker->list);
+    spin_unlock_irqrestore(&shrinker_state.lock, flags);
+}
+
+size_t shrink_memory(size_t nr_pages) {
+    if (get_percpu()->noreclaim)
+        return 0;
+
+    if (atomic_xchg_acquire(&shrinker_state.in_reclaim, 1))
+        return 0;
+
+    size_t freed = 0;
+    cpuflags_t flags = spin_lock_irqsave(&shrinker_state.lock);
+    struct shrinker *shrinker;
+    list_for_each_entry(shrinker, &shrinker_state.shrinkers, list) {
+        if (freed >= nr_pages)
+            break;
+
+        if (shrinker->count(shrinker) == 0)
+            continue;
+
+        freed += shrinker->scan(shrinker, nr_pages - freed);
+    }
+    spin_unlock_irqrestore(&shrinker_state.lock, flags);
+
+    atomic_set_release(&shrinker_state.in_reclaim, 0);
+    return freed;
+}
+
+void noreclaim_begin(void) {
+    expects(irqs_disabled());
+    get_percpu()->noreclaim++;
+}
+
+void noreclaim_end(void) {
+    struct percpu *percpu = get_percpu();
+    expects(percpu->noreclaim > 0);
+    percpu->noreclaim--;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <moose/list.h>
+#include <moose/types.h>
+
+// Reclaimable memory user. Shrinkers are called by page allocator when
+// allocation fails or free memory drops below low watermark.
+struct shrinker {
+    // returns estimate of pages that can be freed by scan
+    size_t (*count)(struct shrinker *shrinker);
+    // tries to free at least nr_pages pages, returns number of pages freed.
+    // Called with irqs disabled, so it must not block and should only
+    // trylock locks that may be held around page allocation.
+    size_t (*scan)(struct shrinker *shrinker, size_t nr_pages);
+    struct list_head list;
+};
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+
+// returns number of pages freed
+size_t shrink_memory(size_t nr_pages);
+
+// Disables reclaim on current cpu, used around allocations made while
+// holding locks shrinkers may need. Must be called with irqs disabled.
+void noreclaim_begin(void);
+void noreclaim_end(void);
@@ -1,5 +1,10 @@
+#include <moose/assert.h>
 #include <moose/bitops.h>
+#include <moose/errno.h>
+#include <moose/kstdio.h>
+#include <moose/mm/alloc_trace.h>
 #include <moose/mm/physmem.h>
+#include <moose/mm/shrinker.h>
 #include <moose/mm/slab.h>
 #include <moose/param.h>
 #include <moose/string.h>
@@ -9,15 +14,44 @@
 
 #define ALIGNMENT 16
 
-// cache chain
+// Page to slab lookup table indexed by physical page frame number. Pointer
+// masking cannot be used to find slab of an object once slabs span several
+// pages and their metadata may live elsewhere. Table has 4 levels of
+// 512-entry pages, upper levels point to tables of the next one and the
+// last level holds slab pointers. 36 bits of page frame number cover 256 TiB
+// of physical memory, more than direct map can reach. Tables are allocated
+// on demand when slabs are created and never freed.
+#define SLAB_MAP_BITS 9
+#define SLAB_MAP_LEVELS 4
+#define SLAB_MAP_SIZE (1u << SLAB_MAP_BITS)
+static_assert(SLAB_MAP_SIZE * sizeof(void *) == PAGE_SIZE);
+
+static struct {
+    void *root[SLAB_MAP_SIZE];
+    spinlock_t lock;
+} slab_map = {.lock = INIT_SPIN_LOCK()};
+
+// cache chain, shrinkers only try to lock it as they may be called from
+// allocations of cache owners
 static LIST_HEAD(caches);
+static spinlock_t caches_lock = INIT_SPIN_LOCK();
+
+#define INIT_STATIC_CACHE(_name, _size, _str)                                  \
+    {                                                                          \
+        .lock = INIT_SPIN_LOCK(),                                              \
+        .slabs_full = INIT_LIST_HEAD(_name.slabs_full),                        \
+        .slabs_partial = INIT_LIST_HEAD(_name.slabs_partial),                  \
+        .slabs_free = INIT_LIST_HEAD(_name.slabs_free),                        \
+        .obj_size = (_size), .flags = CACHE_NO_MAGAZINES, .name = _str,        \
+        .full_magazines = INIT_LIST_HEAD(_name.full_magazines),                \
+        .empty_magazines = INIT_LIST_HEAD(_name.empty_magazines),              \
+    }
+
+static struct slab_cache cache_cache =
+    INIT_STATIC_CACHE(cache_cache, sizeof(struct slab_cache), "slab_cache");
 
-static struct slab_cache cache_cache = {
-    .slabs_full = INIT_LIST_HEAD(cache_cache.slabs_full),
-    .slabs_partial = INIT_LIST_HEAD(cache_cache.slabs_partial),
-    .slabs_free = INIT_LIST_HEAD(cache_cache.slabs_free),
-    .obj_size = sizeof(struct slab_cache),
-    .name = "slab_cache"};
+static struct slab_cache magazine_cache =
+    INIT_STATIC_CACHE(magazine_cache, sizeof(struct magazine), "magazine");
 
 struct general_cache {
     char *name;
@@ -25,80 +59,214 @@ struct general_cache {
     struct slab_cache *cache;
 };
 
-#define GENERAL_CACHE_COUNT 8
+#define GENERAL_CACHE_COUNT 12
 #define GENERAL_CACHE_MIN_SIZE 16
 #define GENERAL_CACHE_MIN_SIZE_BITS 4
-#define GENERAL_CACHE_MAX_SIZE 2048
+#define GENERAL_CACHE_MAX_SIZE 32768
 
 static struct general_cache general_caches[] = {
     {"general-16", 16, NULL},   {"general-32", 32, NULL},
     {"general-64", 64, NULL},   {"general-128", 128, NULL},
     {"general-256", 256, NULL}, {"general-512", 512, NULL},
     {"general-1k", 1024, NULL}, {"general-2k", 2048, NULL},
+    // objects of page size and above, each slab holds whole pages of them
+    {"general-4k", 4096, NULL}, {"general-8k", 8192, NULL},
+    {"general-16k", 16384, NULL}, {"general-32k", 32768, NULL},
 };
 
+static_assert(ARRAY_SIZE(general_caches) == GENERAL_CACHE_COUNT);
+static_assert(GENERAL_CACHE_MAX_SIZE <= PAGE_SIZE << SLAB_MAX_ORDER);
+
+// computes object count and header size for slab of given order,
+// returns number of bytes left over after header and objects
+static u64 calc_slab_layout(const struct slab_cache *cache, u32 order,
+                            u32 *count, u32 *header_size) {
+    size_t mem_size = PAGE_SIZE << order;
+    if (cache->flags & CACHE_OFF_SLAB) {
+        *count = mem_size / cache->obj_size;
+        *header_size =
+            align_po2(sizeof(struct slab) + *count * sizeof(u32), ALIGNMENT);
+        return mem_size - *count * cache->obj_size;
+    }
+
+    *count = (mem_size - sizeof(struct slab)) / (sizeof(u32) + cache->obj_size);
+    *header_size =
+        align_po2(sizeof(struct slab) + *count * sizeof(u32), ALIGNMENT);
+    if (*header_size + *count * cache->obj_size > mem_size) {
+        --*count;
+        *header_size =
+            align_po2(sizeof(struct slab) + *count * sizeof(u32), ALIGNMENT);
+    }
+
+    return mem_size - *header_size - *count * cache->obj_size;
+}
+
+// picks slab order with the least relative waste, smaller orders are
+// preferred once waste is under 1/16 of slab size
 static void estimate_cache(struct slab_cache *cache) {
-    size_t mem_size = PAGE_SIZE;
-    cache->obj_count =
-        (mem_size - sizeof(struct slab)) / (sizeof(u32) + cache->obj_size);
+    u64 best_waste = 0;
+    cache->obj_count = 0;
+    for (u32 order = 0; order <= SLAB_MAX_ORDER; order++) {
+        u32 count, header_size;
+        u64 waste = calc_slab_layout(cache, order, &count, &header_size);
+        if (count == 0)
+            continue;
+
+        // waste / size < best_waste / best_size
+        if (cache->obj_count == 0 ||
+            (waste << cache->order) < (best_waste << order)) {
+            best_waste = waste;
+            cache->order = order;
+            cache->obj_count = count;
+            cache->slab_header_size = header_size;
+        }
+
+        if (waste <= (PAGE_SIZE << order) / 16)
+            break;
+    }
+    expects(cache->obj_count != 0);
+
+    cache->colour_count = best_waste / CACHE_LINE_SIZE + 1;
+    cache->colour_next = 0;
+}
+
+static struct slab **get_slab_map_entry(u64 pfn, int create) {
+    expects(pfn >> (SLAB_MAP_BITS * SLAB_MAP_LEVELS) == 0);
+
+    void **table = slab_map.root;
+    for (int level = SLAB_MAP_LEVELS - 1; level; --level) {
+        u32 idx = (pfn >> (level * SLAB_MAP_BITS)) & (SLAB_MAP_SIZE - 1);
+        if (table[idx] == NULL) {
+            if (!create)
+                return NULL;
+            ssize_t addr = alloc_page();
+            if (addr < 0)
+                return NULL;
+            memset(FIXUP_PTR(addr), 0, PAGE_SIZE);
+            table[idx] = FIXUP_PTR(addr);
+        }
+        table = table[idx];
+    }
 
-    cache->slab_header_size = align_po2(
-        sizeof(struct slab) + cache->obj_count * sizeof(u32), ALIGNMENT);
-    if (cache->slab_header_size + cache->obj_count * cache->obj_size > mem_size)
-        cache->obj_count--;
+    return (struct slab **)table + (pfn & (SLAB_MAP_SIZE - 1));
 }
 
-struct slab_cache *create_cache(const char *name, size_t size) {
+static int set_slab_map(void *memory, u32 order, struct slab *slab) {
+    u64 pfn = (u64)PTR_TO_PHYS(memory) >> PAGE_SIZE_BITS;
+    cpuflags_t flags = spin_lock_irqsave(&slab_map.lock);
+    for (u64 i = 0; i < (1u << order); i++) {
+        struct slab **entry = get_slab_map_entry(pfn + i, slab != NULL);
+        if (entry == NULL) {
+            spin_unlock_irqrestore(&slab_map.lock, flags);
+            return -1;
+        }
+        *entry = slab;
+    }
+    spin_unlock_irqrestore(&slab_map.lock, flags);
+
+    return 0;
+}
+
+// entries are only read for pages owned by live slabs, so no lock needed
+static struct slab *find_slab(const void *obj) {
+    u64 pfn = (u64)PTR_TO_PHYS(obj) >> PAGE_SIZE_BITS;
+    struct slab **entry = get_slab_map_entry(pfn, 0);
+    expects(entry && *entry);
+    return *entry;
+}
+
+struct slab_cache *create_cache(const char *name, size_t size,
+                                void (*ctor)(void *obj)) {
     // alloc cache from cache_cache
     struct slab_cache *cache = cache_alloc(&cache_cache);
     if (cache == NULL)
         return NULL;
 
+    init_spin_lock(&cache->lock);
     init_list_head(&cache->slabs_free);
     init_list_head(&cache->slabs_partial);
     init_list_head(&cache->slabs_full);
+    init_list_head(&cache->full_magazines);
+    init_list_head(&cache->empty_magazines);
+    cache->full_magazine_count = 0;
+    cache->empty_magazine_count = 0;
+    memset(cache->cpu_caches, 0, sizeof(cache->cpu_caches));
 
     strncpy(cache->name, name, CACHE_NAME_SIZE);
     cache->obj_size = align_po2(size, ALIGNMENT);
+    cache->flags = 0;
+    cache->ctor = ctor;
+    if (cache->obj_size >= SLAB_OFF_SLAB_MIN_SIZE)
+        cache->flags |= CACHE_OFF_SLAB;
 
     estimate_cache(cache);
 
     cache->active_count = 0;
-    if (grow_cache(cache))
+    cache->allocated_count = 0;
+    if (grow_cache(cache)) {
+        cache_free(&cache_cache, cache);
         return NULL;
+    }
 
+    cpuflags_t flags = spin_lock_irqsave(&caches_lock);
     list_add(&cache->list, &caches);
+    spin_unlock_irqrestore(&caches_lock, flags);
 
     return cache;
 }
 
-void free_cache(struct slab_cache *cache) {
-    list_for_each(iter, &cache->slabs_full) {
-        struct slab *slab = list_entry(iter, struct slab, list);
-        free_page((u64)PTR_TO_PHYS(slab));
-    }
+// returns start of pages backing the slab
+static void *slab_block(struct slab_cache *cache, struct slab *slab) {
+    if (cache->flags & CACHE_OFF_SLAB)
+        return slab->memory - slab->colour_off;
+    return slab;
+}
 
-    list_for_each(iter, &cache->slabs_partial) {
-        struct slab *slab = list_entry(iter, struct slab, list);
-        free_page((u64)PTR_TO_PHYS(slab));
-    }
+static void destroy_slab(struct slab_cache *cache, struct slab *slab) {
+    list_remove(&slab->list);
+    void *block = slab_block(cache, slab);
+    set_slab_map(block, cache->order, NULL);
+    if (cache->flags & CACHE_OFF_SLAB)
+        sfree(slab);
+
+    u64 addr = (u64)PTR_TO_PHYS(block);
+    if (cache->order == 0)
+        free_page(addr);
+    else
+        free_pages(addr, cache->order);
+}
 
-    list_for_each(iter, &cache->slabs_free) {
-        struct slab *slab = list_entry(iter, struct slab, list);
-        free_page((u64)PTR_TO_PHYS(slab));
+static void free_slabs(struct slab_cache *cache, struct list_head *slabs) {
+    struct slab *slab, *temp;
+    list_for_each_entry_safe(slab, temp, slabs, list) {
+        destroy_slab(cache, slab);
     }
-
-    cache_free(&cache_cache, cache);
 }
 
-int grow_cache(struct slab_cache *cache) {
-    ssize_t addr = alloc_page();
+static int __grow_cache(struct slab_cache *cache) {
+    ssize_t addr = cache->order ? alloc_pages(cache->order) : alloc_page();
     if (addr < 0)
         return -1;
 
-    struct slab *slab = FIXUP_PTR((void *)addr);
-    slab->memory =
-        (void *)slab + sizeof(struct slab) + cache->obj_count * sizeof(u32);
+    void *memory = FIXUP_PTR((void *)addr);
+    struct slab *slab;
+    u32 colour_off = cache->colour_next * CACHE_LINE_SIZE;
+    if (++cache->colour_next == cache->colour_count)
+        cache->colour_next = 0;
+
+    if (cache->flags & CACHE_OFF_SLAB) {
+        slab = smalloc(cache->slab_header_size);
+        if (slab == NULL)
+            goto free_memory;
+        slab->memory = memory + colour_off;
+    } else {
+        slab = memory;
+        slab->memory = memory + cache->slab_header_size + colour_off;
+    }
+    slab->colour_off = colour_off;
+
+    if (set_slab_map(memory, cache->order, slab))
+        goto free_slab;
 
     slab->cache = cache;
 
@@ -109,20 +277,40 @@ int grow_cache(struct slab_cache *cache) {
     free_queue[cache->obj_count - 1] = FREE_QUEUE_END;
     slab->free = 0;
 
+    if (cache->ctor) {
+        for (u32 i = 0; i < cache->obj_count; i++)
+            cache->ctor(slab->memory + i * cache->obj_size);
+    }
+
     list_add(&slab->list, &cache->slabs_free);
     cache->allocated_count += cache->obj_count;
 
     return 0;
+free_slab:
+    set_slab_map(memory, cache->order, NULL);
+    if (cache->flags & CACHE_OFF_SLAB)
+        sfree(slab);
+free_memory:
+    if (cache->order == 0)
+        free_page(addr);
+    else
+        free_pages(addr, cache->order);
+    return -1;
 }
 
-void shrink_cache(struct slab_cache *cache) {
-    list_for_each(iter, &cache->slabs_free) {
-        struct slab *slab = list_entry(iter, struct slab, list);
-        free_page((u64)PTR_TO_PHYS(slab));
-    }
+// Page allocations made here must not reclaim: shrinkers take slab locks
+// that may be held by the caller.
+int grow_cache(struct slab_cache *cache) {
+    cpuflags_t flags = irq_save();
+    noreclaim_begin();
+    int result = __grow_cache(cache);
+    noreclaim_end();
+    irq_restore(flags);
+    return result;
 }
 
-void *cache_alloc(struct slab_cache *cache) {
+// must be called with cache->lock held
+static void *slab_alloc(struct slab_cache *cache) {
     struct list_head *partial = &cache->slabs_partial;
     struct list_head *free = &cache->slabs_free;
 
@@ -149,12 +337,15 @@ void *cache_alloc(struct slab_cache *cache) {
         list_remove(&slab->list);
         list_add(&slab->list, &cache->slabs_full);
     }
+    cache->active_count++;
 
     return obj;
 }
 
-void cache_free(struct slab_cache *cache, void *obj) {
-    struct slab *slab = (void *)((u64)obj & ~0xfff);
+// must be called with cache->lock held
+static void slab_free(struct slab_cache *cache, void *obj) {
+    struct slab *slab = find_slab(obj);
+    expects(slab->cache == cache);
 
     u32 index = (obj - slab->memory) / cache->obj_size;
     FREE_QUEUE_PTR(slab)[index] = slab->free;
@@ -170,8 +361,343 @@ void cache_free(struct slab_cache *cache, void *obj) {
         list_remove(&slab->list);
         list_add(&slab->list, &cache->slabs_free);
     }
+    cache->active_count--;
+}
+
+// returns magazine objects to slabs and frees magazine itself,
+// must be called with cache->lock held
+static void free_magazine(struct slab_cache *cache, struct magazine *mag) {
+    while (mag->count)
+        slab_free(cache, mag->objs[--mag->count]);
+    cache_free(&magazine_cache, mag);
+}
+
+// must be called with cache->lock held
+static void flush_depot(struct slab_cache *cache) {
+    struct magazine *mag, *temp;
+    list_for_each_entry_safe(mag, temp, &cache->full_magazines, list) {
+        list_remove(&mag->list);
+        free_magazine(cache, mag);
+    }
+    list_for_each_entry_safe(mag, temp, &cache->empty_magazines, list) {
+        list_remove(&mag->list);
+        free_magazine(cache, mag);
+    }
+    cache->full_magazine_count = 0;
+    cache->empty_magazine_count = 0;
+}
+
+void free_cache(struct slab_cache *cache) {
+    // shrinkers can't reach cache once it is removed
+    cpuflags_t flags = spin_lock_irqsave(&caches_lock);
+    list_remove(&cache->list);
+    spin_unlock_irqrestore(&caches_lock, flags);
+
+    flags = spin_lock_irqsave(&cache->lock);
+    for (u32 cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct cpu_cache *cc = cache->cpu_caches + cpu;
+        if (cc->loaded)
+            free_magazine(cache, cc->loaded);
+        if (cc->prev)
+            free_magazine(cache, cc->prev);
+        cc->loaded = cc->prev = NULL;
+    }
+    flush_depot(cache);
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    free_slabs(cache, &cache->slabs_full);
+    free_slabs(cache, &cache->slabs_partial);
+    free_slabs(cache, &cache->slabs_free);
+
+    cache_free(&cache_cache, cache);
+}
+
+void shrink_cache(struct slab_cache *cache) {
+    cpuflags_t flags = spin_lock_irqsave(&cache->lock);
+    flush_depot(cache);
+    struct slab *slab, *temp;
+    list_for_each_entry_safe(slab, temp, &cache->slabs_free, list) {
+        cache->allocated_count -= cache->obj_count;
+        destroy_slab(cache, slab);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+static void swap_magazines(struct cpu_cache *cc) {
+    struct magazine *temp = cc->loaded;
+    cc->loaded = cc->prev;
+    cc->prev = temp;
+}
+
+// Fills magazine from slabs with at most one slab worth of objects, so that
+// caches of large objects do not park many pages on every cpu. Must be
+// called with cache lock held
+static void refill_magazine(struct slab_cache *cache, struct magazine *mag) {
+    u32 limit = mag->count + cache->obj_count;
+    if (limit > MAGAZINE_SIZE)
+        limit = MAGAZINE_SIZE;
+    while (mag->count < limit) {
+        void *obj = slab_alloc(cache);
+        if (obj == NULL)
+            break;
+        mag->objs[mag->count++] = obj;
+    }
+}
+
+// returns loaded magazine with at least one object or NULL if neither
+// depot nor slabs have objects left, must be called with irqs disabled
+static struct magazine *load_full_magazine(struct slab_cache *cache,
+                                           struct cpu_cache *cc) {
+    if (cc->loaded && cc->loaded->count)
+        return cc->loaded;
+
+    if (cc->prev && cc->prev->count) {
+        swap_magazines(cc);
+        return cc->loaded;
+    }
+
+    spin_lock(&cache->lock);
+    struct magazine *full =
+        list_first_or_null(&cache->full_magazines, struct magazine, list);
+    if (full) {
+        list_remove(&full->list);
+        cache->full_magazine_count--;
+        // both loaded and previous magazines are empty at this point
+        if (cc->prev) {
+            list_add(&cc->prev->list, &cache->empty_magazines);
+            cache->empty_magazine_count++;
+        }
+        cc->prev = cc->loaded;
+        cc->loaded = full;
+        goto out;
+    }
+
+    // depot is empty, so loaded magazine is refilled from slabs in one lock
+    // hold instead of taking the lock for every object
+    if (cc->loaded == NULL) {
+        cc->loaded = cache_alloc(&magazine_cache);
+        if (cc->loaded == NULL)
+            goto out;
+        cc->loaded->count = 0;
+    }
+    refill_magazine(cache, cc->loaded);
+    if (cc->loaded->count)
+        full = cc->loaded;
+
+out:
+    spin_unlock(&cache->lock);
+    return full;
+}
+
+// returns loaded magazine with space for at least one object or NULL if
+// no empty magazine can be allocated, must be called with irqs disabled
+static struct magazine *load_empty_magazine(struct slab_cache *cache,
+                                            struct cpu_cache *cc) {
+    if (cc->loaded && cc->loaded->count < MAGAZINE_SIZE)
+        return cc->loaded;
+
+    if (cc->prev && cc->prev->count < MAGAZINE_SIZE) {
+        swap_magazines(cc);
+        return cc->loaded;
+    }
+
+    spin_lock(&cache->lock);
+    struct magazine *empty =
+        list_first_or_null(&cache->empty_magazines, struct magazine, list);
+    if (empty) {
+        list_remove(&empty->list);
+        cache->empty_magazine_count--;
+    } else {
+        empty = cache_alloc(&magazine_cache);
+        if (empty)
+            empty->count = 0;
+    }
+
+    if (empty) {
+        // both loaded and previous magazines are full at this point
+        if (cc->prev) {
+            list_add(&cc->prev->list, &cache->full_magazines);
+            cache->full_magazine_count++;
+        }
+        cc->prev = cc->loaded;
+        cc->loaded = empty;
+    }
+    spin_unlock(&cache->lock);
+
+    return empty;
+}
+
+static void *__cache_alloc(struct slab_cache *cache) {
+    void *obj;
+    cpuflags_t flags;
+    if (cache->flags & CACHE_NO_MAGAZINES) {
+        flags = spin_lock_irqsave(&cache->lock);
+        obj = slab_alloc(cache);
+        spin_unlock_irqrestore(&cache->lock, flags);
+        return obj;
+    }
+
+    flags = irq_save();
+    struct cpu_cache *cc = cache->cpu_caches + get_cpu_id();
+    struct magazine *mag = load_full_magazine(cache, cc);
+    if (mag) {
+        obj = mag->objs[--mag->count];
+    } else {
+        spin_lock(&cache->lock);
+        obj = slab_alloc(cache);
+        spin_unlock(&cache->lock);
+    }
+    irq_restore(flags);
+
+    return obj;
+}
+
+void *cache_alloc(struct slab_cache *cache) {
+    void *obj = __cache_alloc(cache);
+    trace_alloc(obj, cache->obj_size, ALLOC_CALLER());
+    return obj;
+}
+
+static void __cache_free(struct slab_cache *cache, void *obj) {
+    cpuflags_t flags;
+    if (cache->flags & CACHE_NO_MAGAZINES) {
+        flags = spin_lock_irqsave(&cache->lock);
+        slab_free(cache, obj);
+        spin_unlock_irqrestore(&cache->lock, flags);
+        return;
+    }
+
+    flags = irq_save();
+    struct cpu_cache *cc = cache->cpu_caches + get_cpu_id();
+    struct magazine *mag = load_empty_magazine(cache, cc);
+    if (mag) {
+        mag->objs[mag->count++] = obj;
+    } else {
+        spin_lock(&cache->lock);
+        slab_free(cache, obj);
+        spin_unlock(&cache->lock);
+    }
+    irq_restore(flags);
+}
+
+void cache_free(struct slab_cache *cache, void *obj) {
+    trace_free(obj);
+    __cache_free(cache, obj);
+}
+
+int cache_alloc_bulk(struct slab_cache *cache, size_t count, void **objs) {
+    size_t allocated = 0;
+    cpuflags_t flags = irq_save();
+    if (!(cache->flags & CACHE_NO_MAGAZINES)) {
+        struct cpu_cache *cc = cache->cpu_caches + get_cpu_id();
+        struct magazine *mag;
+        while (allocated < count && (mag = load_full_magazine(cache, cc))) {
+            while (allocated < count && mag->count)
+                objs[allocated++] = mag->objs[--mag->count];
+        }
+    }
+
+    if (allocated < count) {
+        spin_lock(&cache->lock);
+        for (; allocated < count; allocated++) {
+            objs[allocated] = slab_alloc(cache);
+            if (objs[allocated] == NULL)
+                break;
+        }
+        spin_unlock(&cache->lock);
+    }
+    irq_restore(flags);
+
+    if (allocated < count) {
+        cache_free_bulk(cache, allocated, objs);
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        trace_alloc(objs[i], cache->obj_size, ALLOC_CALLER());
+    return 0;
 }
 
+void cache_free_bulk(struct slab_cache *cache, size_t count, void **objs) {
+    for (size_t i = 0; i < count; ++i)
+        trace_free(objs[i]);
+
+    size_t freed = 0;
+    cpuflags_t flags = irq_save();
+    if (!(cache->flags & CACHE_NO_MAGAZINES)) {
+        struct cpu_cache *cc = cache->cpu_caches + get_cpu_id();
+        struct magazine *mag;
+        while (freed < count && (mag = load_empty_magazine(cache, cc))) {
+            while (freed < count && mag->count < MAGAZINE_SIZE)
+                mag->objs[mag->count++] = objs[freed++];
+        }
+    }
+
+    if (freed < count) {
+        spin_lock(&cache->lock);
+        for (; freed < count; freed++)
+            slab_free(cache, objs[freed]);
+        spin_unlock(&cache->lock);
+    }
+    irq_restore(flags);
+}
+
+static u32 count_slabs(const struct list_head *slabs) {
+    u32 count = 0;
+    list_for_each(iter, slabs)
+        count++;
+    return count;
+}
+
+static size_t count_slab_pages(struct shrinker *shrinker __unused) {
+    if (!spin_trylock(&caches_lock))
+        return 0;
+
+    size_t count = 0;
+    struct slab_cache *cache;
+    list_for_each_entry(cache, &caches, list) {
+        // racy read is fine for estimate
+        count += count_slabs(&cache->slabs_free) << cache->order;
+        // objects of depot magazines may free slabs once flushed
+        count += (cache->full_magazine_count * MAGAZINE_SIZE *
+                  cache->obj_size) >>
+                 PAGE_SIZE_BITS;
+    }
+    spin_unlock(&caches_lock);
+    return count;
+}
+
+static size_t scan_slab_pages(struct shrinker *shrinker __unused,
+                              size_t nr_pages) {
+    if (!spin_trylock(&caches_lock))
+        return 0;
+
+    size_t freed = 0;
+    struct slab_cache *cache;
+    list_for_each_entry(cache, &caches, list) {
+        if (freed >= nr_pages)
+            break;
+        if (!spin_trylock(&cache->lock))
+            continue;
+
+        flush_depot(cache);
+        struct slab *slab, *temp;
+        list_for_each_entry_safe(slab, temp, &cache->slabs_free, list) {
+            if (freed >= nr_pages)
+                break;
+            cache->allocated_count -= cache->obj_count;
+            destroy_slab(cache, slab);
+            freed += 1lu << cache->order;
+        }
+        spin_unlock(&cache->lock);
+    }
+    spin_unlock(&caches_lock);
+    return freed;
+}
+
+static struct shrinker slab_shrinker = {.count = count_slab_pages,
+                                        .scan = scan_slab_pages};
+
 void *smalloc(size_t size) {
     size = align_po2(size, GENERAL_CACHE_MIN_SIZE);
     if (size > GENERAL_CACHE_MAX_SIZE)
@@ -182,13 +708,55 @@ void *smalloc(size_t size) {
         aligned <<= 1;
 
     u32 index = __log2(aligned >> GENERAL_CACHE_MIN_SIZE_BITS);
+    struct slab_cache *cache = general_caches[index].cache;
+    if (cache == NULL)
+        return NULL;
 
-    return cache_alloc(general_caches[index].cache);
+    return __cache_alloc(cache);
 }
 
 void sfree(void *ptr) {
-    struct slab *slab = (void *)((u64)ptr & ~0xfff);
-    cache_free(slab->cache, ptr);
+    struct slab *slab = find_slab(ptr);
+    __cache_free(slab->cache, ptr);
+}
+
+void get_cache_stats(struct slab_cache *cache, struct slab_cache_stats *stats) {
+    cpuflags_t flags = spin_lock_irqsave(&cache->lock);
+    stats->obj_size = cache->obj_size;
+    stats->obj_count = cache->obj_count;
+    stats->order = cache->order;
+    stats->slab_count = count_slabs(&cache->slabs_full) +
+                        count_slabs(&cache->slabs_partial) +
+                        count_slabs(&cache->slabs_free);
+    stats->active_count = cache->active_count;
+    stats->allocated_count = cache->allocated_count;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    u64 waste =
+        (PAGE_SIZE << cache->order) - cache->obj_count * cache->obj_size;
+    if (cache->flags & CACHE_OFF_SLAB)
+        waste += cache->slab_header_size;
+    stats->slab_bytes = (u64)stats->slab_count * (PAGE_SIZE << cache->order);
+    stats->wasted_bytes = stats->slab_count * waste;
+}
+
+void print_slab_stats(void) {
+    kprintf("%-16s %6s %5s %5s %8s %8s %8s %6s\n", "cache", "size", "objs",
+            "order", "active", "total", "bytes", "waste");
+    struct slab_cache *cache;
+    cpuflags_t flags = spin_lock_irqsave(&caches_lock);
+    list_for_each_entry(cache, &caches, list) {
+        struct slab_cache_stats stats;
+        get_cache_stats(cache, &stats);
+        u64 waste_permille =
+            stats.slab_bytes ? stats.wasted_bytes * 1000 / stats.slab_bytes
+                             : 0;
+        kprintf("%-16s %6u %5u %5u %8u %8u %8lu %3lu.%lu%%\n", cache->name,
+                stats.obj_size, stats.obj_count, stats.order,
+                stats.active_count, stats.allocated_count, stats.slab_bytes,
+                waste_permille / 10, waste_permille % 10);
+    }
+    spin_unlock_irqrestore(&caches_lock, flags);
 }
 
 int init_slab_cache(void) {
@@ -201,16 +769,22 @@ int init_slab_cache(void) {
 
     list_add(&cache_cache.list, &caches);
 
+    magazine_cache.obj_size = align_po2(magazine_cache.obj_size, ALIGNMENT);
+    estimate_cache(&magazine_cache);
+    list_add(&magazine_cache.list, &caches);
+
     // init general caches for smalloc, sfree
     for (u32 i = 0; i < GENERAL_CACHE_COUNT; i++) {
         struct slab_cache *cache =
-            create_cache(general_caches[i].name, general_caches[i].obj_size);
+            create_cache(general_caches[i].name, general_caches[i].obj_size,
+                         NULL);
         if (cache == NULL)
             return -1;
 
         general_caches[i].cache = cache;
-        list_add(&cache->list, &caches);
     }
 
+    register_shrinker(&slab_shrinker);
+
     return 0;
 }
@@ -1,22 +1,74 @@
 #pragma once
 
 #include <moose/list.h>
+#include <moose/sched/locks.h>
 #include <moose/types.h>
 
 #define CACHE_NAME_SIZE 32
 
+#define MAGAZINE_SIZE 15
+
+// Fixed-size stack of free objects. Magazines are either loaded into
+// per-cpu cache or sit in cache depot, where they are kept either full or
+// empty.
+struct magazine {
+    struct list_head list;
+    u32 count;
+    void *objs[MAGAZINE_SIZE];
+};
+
+// Per-cpu object cache. Objects are allocated and freed to loaded magazine,
+// previous one is kept to avoid thrashing depot when allocations and frees
+// alternate around magazine boundary. Accessed only with irqs disabled on
+// owning cpu.
+struct cpu_cache {
+    struct magazine *loaded;
+    struct magazine *prev;
+};
+
+// cache objects are always taken from slabs directly
+#define CACHE_NO_MAGAZINES 0x1
+// slab header and free queue are allocated with smalloc instead of being
+// stored at the start of slab memory
+#define CACHE_OFF_SLAB 0x2
+
+// largest slab is 2^SLAB_MAX_ORDER pages
+#define SLAB_MAX_ORDER 3
+// objects of this size and larger have their slab metadata off-slab
+#define SLAB_OFF_SLAB_MIN_SIZE 512
+
 struct slab_cache {
+    // protects slab lists and magazine depot
+    spinlock_t lock;
     struct list_head slabs_full;
     struct list_head slabs_partial;
     struct list_head slabs_free;
     u32 obj_size;
+    // objects per slab
     u32 obj_count;
+    // slab is 2^order pages
+    u32 order;
+    u32 flags;
     char name[CACHE_NAME_SIZE];
     struct list_head list;
-    // TODO: add constructor and destructor
     u32 active_count;
     u32 allocated_count;
     u32 slab_header_size;
+
+    // called for each object when slab is created, objects have to be
+    // returned to cache in constructed state
+    void (*ctor)(void *obj);
+
+    // object area of consecutive slabs is shifted by colour_next cache lines
+    // so that objects of different slabs are spread across cache sets
+    u32 colour_count;
+    u32 colour_next;
+
+    struct list_head full_magazines;
+    struct list_head empty_magazines;
+    u32 full_magazine_count;
+    u32 empty_magazine_count;
+    struct cpu_cache cpu_caches[MAX_CPUS];
 };
 
 struct slab {
@@ -25,17 +77,43 @@ struct slab {
     void *memory;
     u32 used_count;
     u32 free;
+    // offset of object area from the start of space reserved for it
+    u32 colour_off;
+};
+
+struct slab_cache_stats {
+    u32 obj_size;
+    u32 obj_count;
+    u32 order;
+    u32 slab_count;
+    u32 active_count;
+    u32 allocated_count;
+    // bytes of pages owned by cache slabs
+    u64 slab_bytes;
+    // bytes of slab memory (and off-slab headers) that can never hold an
+    // object
+    u64 wasted_bytes;
 };
 
 int init_slab_cache(void);
 
-struct slab_cache *create_cache(const char *name, size_t size);
+struct slab_cache *create_cache(const char *name, size_t size,
+                                void (*ctor)(void *obj));
 void free_cache(struct slab_cache *cache);
 int grow_cache(struct slab_cache *cache);
+// returns magazines from depot and free slabs to the page allocator
 void shrink_cache(struct slab_cache *cache);
 
 void *cache_alloc(struct slab_cache *cache);
 void cache_free(struct slab_cache *cache, void *obj);
+// allocates either all count objects or none of them, returns 0 or -ENOMEM
+int cache_alloc_bulk(struct slab_cache *cache, size_t count, void **objs);
+void cache_free_bulk(struct slab_cache *cache, size_t count, void **objs);
 
+// returns NULL if size is larger than the biggest general cache or if
+// general caches are not initialized yet
 void *smalloc(size_t size);
 void sfree(void *ptr);
+
+void get_cache_stats(struct slab_cache *cache, struct slab_cache_stats *stats);
+void print_slab_stats(void);
@@ -0,0 +1,247 @@
+#include <moose/arch/amd64/virtmem.h>
+#include <moose/assert.h>
+#include <moose/bitops.h>
+#include <moose/mm/kmalloc.h>
+#include <moose/mm/vmalloc.h>
+#include <moose/param.h>
+#include <moose/rbtree.h>
+#include <moose/sched/locks.h>
+#include <moose/string.h>
+
+// Range of virtual addresses, either free or used by allocation
+struct vm_area {
+    u64 base;
+    u64 size;
+    // largest free area size in subtree, only maintained in free tree
+    u64 subtree_max_size;
+    struct rb_node node;
+};
+
+// Free areas are kept in tree sorted by address and augmented with the
+// largest size in subtree, so that lowest fitting area can be found in
+// logarithmic time. Busy areas are kept in separate tree for lookup on free.
+static struct {
+    struct rb_node *free_root;
+    struct rb_node *busy_root;
+    spinlock_t lock;
+} vmalloc_state = {.lock = INIT_SPIN_LOCK()};
+
+static struct vm_area *to_vm_area(struct rb_node *node) {
+    return rb_entry_safe(node, struct vm_area, node);
+}
+
+static void update_subtree_max_size(struct rb_node *node,
+                                    void *data __unused) {
+    struct vm_area *area = to_vm_area(node);
+    u64 max_size = area->size;
+    if (node->left && to_vm_area(node->left)->subtree_max_size > max_size)
+        max_size = to_vm_area(node->left)->subtree_max_size;
+    if (node->right && to_vm_area(node->right)->subtree_max_size > max_size)
+        max_size = to_vm_area(node->right)->subtree_max_size;
+    area->subtree_max_size = max_size;
+}
+
+static void insert_area(struct vm_area *area, struct rb_node **root) {
+    struct rb_node **link = root;
+    struct rb_node *parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (area->base < to_vm_area(parent)->base)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    rb_link_node(&area->node, parent);
+    *link = &area->node;
+    rb_insert_color(&area->node, root);
+}
+
+static void insert_free_area(struct vm_area *area) {
+    area->subtree_max_size = area->size;
+    insert_area(area, &vmalloc_state.free_root);
+    rb_augment_insert(&area->node, update_subtree_max_size, NULL);
+}
+
+static void erase_free_area(struct vm_area *area) {
+    struct rb_node *deepest = rb_augment_erase_begin(&area->node);
+    rb_erase(&area->node, &vmalloc_state.free_root);
+    rb_augment_erase_end(deepest, update_subtree_max_size, NULL);
+}
+
+// propagates size change of free area up to the root
+static void resize_free_area(struct vm_area *area, u64 base, u64 size) {
+    area->base = base;
+    area->size = size;
+    rb_augment_insert(&area->node, update_subtree_max_size, NULL);
+}
+
+// finds free area with the lowest address that is at least size bytes
+static struct vm_area *find_free_area(u64 size) {
+    struct rb_node *node = vmalloc_state.free_root;
+    if (node == NULL || to_vm_area(node)->subtree_max_size < size)
+        return NULL;
+
+    for (;;) {
+        if (node->left && to_vm_area(node->left)->subtree_max_size >= size) {
+            node = node->left;
+            continue;
+        }
+
+        struct vm_area *area = to_vm_area(node);
+        if (area->size >= size)
+            return area;
+
+        node = node->right;
+        expects(node);
+    }
+}
+
+static struct vm_area *find_busy_area(u64 base) {
+    struct rb_node *node = vmalloc_state.busy_root;
+    while (node) {
+        struct vm_area *area = to_vm_area(node);
+        if (base < area->base)
+            node = node->left;
+        else if (base > area->base)
+            node = node->right;
+        else
+            return area;
+    }
+
+    return NULL;
+}
+
+// returns free areas directly before and after base
+static void find_free_neighbours(u64 base, struct vm_area **prev,
+                                 struct vm_area **next) {
+    *prev = *next = NULL;
+    struct rb_node *node = vmalloc_state.free_root;
+    while (node) {
+        struct vm_area *area = to_vm_area(node);
+        if (base < area->base) {
+            *next = area;
+            node = node->left;
+        } else {
+            *prev = area;
+            node = node->right;
+        }
+    }
+}
+
+// returns range to free tree merging it with adjacent free areas, area
+// struct is either reused or freed
+static void release_area(struct vm_area *area) {
+    struct vm_area *prev, *next;
+    find_free_neighbours(area->base, &prev, &next);
+
+    u64 end = area->base + area->size;
+    int merge_prev = prev && prev->base + prev->size == area->base;
+    int merge_next = next && end == next->base;
+    if (merge_prev && merge_next) {
+        u64 size = prev->size + area->size + next->size;
+        erase_free_area(next);
+        resize_free_area(prev, prev->base, size);
+        kfree(next);
+        kfree(area);
+    } else if (merge_prev) {
+        resize_free_area(prev, prev->base, prev->size + area->size);
+        kfree(area);
+    } else if (merge_next) {
+        resize_free_area(next, area->base, next->size + area->size);
+        kfree(area);
+    } else {
+        insert_free_area(area);
+    }
+}
+
+int init_vmalloc(void) {
+    struct vm_area *area = kmalloc(sizeof(*area));
+    if (area == NULL)
+        return -1;
+
+    area->base = VMALLOC_VIRTUAL_BASE;
+    area->size = VMALLOC_VIRTUAL_END - VMALLOC_VIRTUAL_BASE;
+    cpuflags_t flags = spin_lock_irqsave(&vmalloc_state.lock);
+    insert_free_area(area);
+    spin_unlock_irqrestore(&vmalloc_state.lock, flags);
+
+    return 0;
+}
+
+// reserves virtual range of given size, returns NULL if address space is
+// exhausted
+static struct vm_area *alloc_vm_area(u64 size) {
+    struct vm_area *busy = kmalloc(sizeof(*busy));
+    if (busy == NULL)
+        return NULL;
+
+    cpuflags_t flags = spin_lock_irqsave(&vmalloc_state.lock);
+    struct vm_area *free = find_free_area(size);
+    if (free == NULL) {
+        spin_unlock_irqrestore(&vmalloc_state.lock, flags);
+        kfree(busy);
+        return NULL;
+    }
+
+    busy->base = free->base;
+    busy->size = size;
+    if (free->size == size) {
+        erase_free_area(free);
+        kfree(free);
+    } else {
+        resize_free_area(free, free->base + size, free->size - size);
+    }
+    insert_area(busy, &vmalloc_state.busy_root);
+    spin_unlock_irqrestore(&vmalloc_state.lock, flags);
+
+    return busy;
+}
+
+static void free_vm_area(struct vm_area *area) {
+    cpuflags_t flags = spin_lock_irqsave(&vmalloc_state.lock);
+    rb_erase(&area->node, &vmalloc_state.busy_root);
+    release_area(area);
+    spin_unlock_irqrestore(&vmalloc_state.lock, flags);
+}
+
+void *vmalloc(size_t size) {
+    if (size == 0)
+        return NULL;
+
+    size_t page_count = align_po2(size, PAGE_SIZE) >> PAGE_SIZE_BITS;
+    // extra page is left unmapped as guard
+    struct vm_area *area = alloc_vm_area((page_count + 1) << PAGE_SIZE_BITS);
+    if (area == NULL)
+        return NULL;
+
+    if (alloc_virtual_pages(area->base, page_count)) {
+        free_virtual_pages(area->base, page_count);
+        free_vm_area(area);
+        return NULL;
+    }
+
+    return (void *)area->base;
+}
+
+void *vzalloc(size_t size) {
+    void *mem = vmalloc(size);
+    if (mem)
+        memset(mem, 0, size);
+
+    return mem;
+}
+
+void vfree(void *addr) {
+    if (addr == NULL)
+        return;
+
+    cpuflags_t flags = spin_lock_irqsave(&vmalloc_state.lock);
+    struct vm_area *area = find_busy_area((u64)addr);
+    spin_unlock_irqrestore(&vmalloc_state.lock, flags);
+    expects(area);
+
+    // mapped pages are returned to buddy allocator, guard page is unmapped
+    free_virtual_pages(area->base, (area->size >> PAGE_SIZE_BITS) - 1);
+    free_vm_area(area);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <moose/param.h>
+#include <moose/types.h>
+
+int init_vmalloc(void);
+
+// Allocates virtually contiguous memory backed by individual pages. Each
+// area is followed by unmapped guard page.
+void *vmalloc(size_t size);
+void *vzalloc(size_t size);
+void vfree(void *addr);
+
+static inline int is_vmalloc_addr(const void *addr) {
+    return (u64)addr >= VMALLOC_VIRTUAL_BASE &&
+           (u64)addr < VMALLOC_VIRTUAL_END;
+}
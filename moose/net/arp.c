@@ -1,4 +1,3 @@
-#include <moose/arch/jiffies.h>
 #include <moose/endian.h>
 #include <moose/errno.h>
 #include <moose/kstdio.h>
@@ -9,10 +8,13 @@
 #include <moose/net/frame.h>
 #include <moose/net/inet.h>
 #include <moose/sched/locks.h>
+#include <moose/sched/rcu.h>
+#include <moose/sched/wait.h>
 #include <moose/string.h>
+#include <moose/time.h>
 
 #define ARP_CACHE_SIZE 256
-#define ARP_TIMEOUT_MSECS 15000
+#define ARP_TIMEOUT_NSECS (15000 * NSEC_PER_MSEC)
 
 struct arp_cache_entry {
     u8 ip_addr[4];
@@ -20,13 +22,17 @@ struct arp_cache_entry {
     struct list_head list;
 };
 
+// Entries are looked up under rcu and are never removed, lock only
+// serializes additions
 struct arp_cache {
     struct list_head entries;
-    rwlock_t lock;
+    spinlock_t lock;
 };
 
 static LIST_HEAD(free_list);
 static struct arp_cache *cache;
+// woken whenever new entry is added to cache
+static wait_queue_head_t arp_wait = INIT_WAIT_QUEUE_HEAD(arp_wait);
 
 int init_arp_cache(void) {
     cache = kmalloc(sizeof(*cache));
@@ -34,7 +40,7 @@ int init_arp_cache(void) {
         return -ENOMEM;
 
     init_list_head(&cache->entries);
-    init_rwlock(&cache->lock);
+    init_spin_lock(&cache->lock);
 
     for (size_t i = 0; i < ARP_CACHE_SIZE; i++) {
         struct arp_cache_entry *entry = kmalloc(sizeof(*entry));
@@ -65,28 +71,28 @@ void destroy_arp_cache(void) {
 }
 
 static int arp_cache_get(const u8 *ip_addr, u8 *mac_addr) {
-    cpuflags_t flags = read_lock_irqsave(&cache->lock);
+    rcu_read_lock();
 
     struct arp_cache_entry *entry;
-    list_for_each_entry(entry, &cache->entries, list) {
+    list_for_each_entry_rcu(entry, &cache->entries, list) {
         if (memcmp(entry->ip_addr, ip_addr, 4) == 0) {
             memcpy(mac_addr, entry->mac_addr, 6);
-            read_unlock_irqrestore(&cache->lock, flags);
+            rcu_read_unlock();
             return 0;
         }
     }
 
-    read_unlock_irqrestore(&cache->lock, flags);
+    rcu_read_unlock();
     return -1;
 }
 
 static void arp_cache_add(const u8 *ip_addr, const u8 *mac_addr) {
-    cpuflags_t flags = write_lock_irqsave(&cache->lock);
+    cpuflags_t flags = spin_lock_irqsave(&cache->lock);
 
     struct arp_cache_entry *entry;
     list_for_each_entry(entry, &cache->entries, list) {
         if (memcmp(entry->ip_addr, ip_addr, 4) == 0) {
-            write_unlock_irqrestore(&cache->lock, flags);
+            spin_unlock_irqrestore(&cache->lock, flags);
             return;
         }
     }
@@ -94,16 +100,17 @@ static void arp_cache_add(const u8 *ip_addr, const u8 *mac_addr) {
     entry = list_first_or_null(&free_list, struct arp_cache_entry, list);
     if (entry == NULL) {
         kprintf("failed to add arp cache entry\n");
-        write_unlock_irqrestore(&cache->lock, flags);
+        spin_unlock_irqrestore(&cache->lock, flags);
         return;
     }
+    // entry is filled before it becomes visible to readers
     list_remove(&entry->list);
-    list_add(&entry->list, &cache->entries);
-
-    write_unlock_irqrestore(&cache->lock, flags);
-
     memcpy(entry->ip_addr, ip_addr, 4);
     memcpy(entry->mac_addr, mac_addr, 6);
+    list_add_rcu(&entry->list, &cache->entries);
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+    wake_up(&arp_wait);
 }
 
 int arp_get_mac(const u8 *ip_addr, u8 *mac_addr) {
@@ -116,13 +123,9 @@ int arp_get_mac(const u8 *ip_addr, u8 *mac_addr) {
 
     arp_send_request(frame, ip_addr);
 
-    int found = 0;
-    memcpy(mac_addr, broadcast_mac_addr, 6);
-    u64 end = jiffies_to_msecs(get_jiffies()) + ARP_TIMEOUT_MSECS;
-    while (!(found && memcmp(mac_addr, broadcast_mac_addr, 6) != 0) &&
-           jiffies_to_msecs(get_jiffies()) < end) {
-        found = (arp_cache_get(ip_addr, mac_addr) == 0);
-    }
+    int found = wait_event_timeout(&arp_wait,
+                                   arp_cache_get(ip_addr, mac_addr) == 0,
+                                   ARP_TIMEOUT_NSECS) != 0;
 
     release_net_frame(frame);
     return found ? 0 : -1;
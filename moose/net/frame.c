@@ -1,6 +1,6 @@
 #include <moose/assert.h>
 #include <moose/errno.h>
-#include <moose/mm/kmalloc.h>
+#include <moose/mm/slab.h>
 #include <moose/net/frame.h>
 #include <moose/net/inet.h>
 #include <moose/sched/locks.h>
@@ -12,41 +12,51 @@ static LIST_HEAD(free_list);
 
 static spinlock_t lock = INIT_SPIN_LOCK();
 
-static struct net_frame *alloc_net_frame(void) {
-    struct net_frame *frame = kmalloc(sizeof(*frame) + FRAME_BUFFER_SIZE);
-    if (frame == NULL)
-        return NULL;
+static struct slab_cache *frame_cache;
 
+static void net_frame_ctor(void *obj) {
+    struct net_frame *frame = obj;
     frame->buffer = frame + 1;
-
-    return frame;
-}
-
-static void free_net_frame(struct net_frame *frame) {
-    kfree(frame);
 }
 
 int init_net_frames(void) {
-    for (size_t i = 0; i < FREE_FRAMES_COUNT; i++) {
-        struct net_frame *frame = alloc_net_frame();
-        if (frame == NULL) {
-            destroy_net_frames();
-            return -ENOMEM;
-        }
-
-        list_add(&frame->list, &free_list);
+    frame_cache = create_cache("net_frame",
+                               sizeof(struct net_frame) + FRAME_BUFFER_SIZE,
+                               net_frame_ctor);
+    if (frame_cache == NULL)
+        return -ENOMEM;
+
+    struct net_frame *frames[FREE_FRAMES_COUNT];
+    if (cache_alloc_bulk(frame_cache, FREE_FRAMES_COUNT, (void **)frames)) {
+        free_cache(frame_cache);
+        frame_cache = NULL;
+        return -ENOMEM;
     }
 
+    for (size_t i = 0; i < FREE_FRAMES_COUNT; i++)
+        list_add(&frames[i]->list, &free_list);
+
     return 0;
 }
 
 void destroy_net_frames(void) {
+    struct net_frame *frames[FREE_FRAMES_COUNT];
+    size_t count = 0;
+
     struct net_frame *frame;
     struct net_frame *temp;
     list_for_each_entry_safe(frame, temp, &free_list, list) {
         list_remove(&frame->list);
-        free_net_frame(frame);
+        frames[count++] = frame;
+        if (count == FREE_FRAMES_COUNT) {
+            cache_free_bulk(frame_cache, count, (void **)frames);
+            count = 0;
+        }
     }
+
+    cache_free_bulk(frame_cache, count, (void **)frames);
+    free_cache(frame_cache);
+    frame_cache = NULL;
 }
 
 static struct net_frame *get_empty_net_frame(void) {
@@ -56,6 +56,7 @@ struct net_frame {
 };
 
 int init_net_frames(void);
+// frames still in use must have been released before
 void destroy_net_frames(void);
 
 struct net_frame *get_empty_send_net_frame(void);
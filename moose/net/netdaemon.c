@@ -5,31 +5,47 @@
 #include <moose/net/frame.h>
 #include <moose/net/inet.h>
 #include <moose/net/netdaemon.h>
+#include <moose/sched/lock_stat.h>
 #include <moose/sched/locks.h>
 #include <moose/sched/sched.h>
+#include <moose/sched/wait.h>
 #include <moose/string.h>
 
 #define QUEUE_SIZE 32
 
 struct daemon_queue {
     struct net_frame **frames;
-    rwlock_t lock;
+    // count of queued frames
+    int pending;
+    spinlock_t lock;
+    wait_queue_head_t wait;
 };
 
 static struct daemon_queue *queue;
 
 __noreturn static void net_daemon_task(void *arg __unused) {
-    cpuflags_t flags;
+    struct net_frame *frames[QUEUE_SIZE];
     for (;;) {
-        flags = write_lock_irqsave(&queue->lock);
+        wait_event(&queue->wait,
+                   __atomic_load_n(&queue->pending, __ATOMIC_ACQUIRE));
+
+        // frames are processed without lock held, as replying to them may
+        // sleep waiting for arp reply that is added to this queue
+        int count = 0;
+        cpuflags_t flags = spin_lock_irqsave(&queue->lock);
         for (int i = 0; i < QUEUE_SIZE; i++) {
             if (queue->frames[i]) {
-                eth_receive_frame(queue->frames[i]);
-                release_net_frame(queue->frames[i]);
+                frames[count++] = queue->frames[i];
                 queue->frames[i] = NULL;
             }
         }
-        write_unlock_irqrestore(&queue->lock, flags);
+        queue->pending = 0;
+        spin_unlock_irqrestore(&queue->lock, flags);
+
+        for (int i = 0; i < count; i++) {
+            eth_receive_frame(frames[i]);
+            release_net_frame(frames[i]);
+        }
     }
 
     exit_current();
@@ -41,7 +57,9 @@ int init_net_daemon(void) {
         return -ENOMEM;
 
     queue->frames = (struct net_frame **)(queue + 1);
-    init_rwlock(&queue->lock);
+    init_spin_lock(&queue->lock);
+    set_spin_lock_class(&queue->lock, "net queue");
+    init_wait_queue_head(&queue->wait);
 
     launch_process("net", net_daemon_task, NULL);
     return 0;
@@ -62,17 +80,19 @@ void net_daemon_add_frame(const void *data, size_t size) {
     memcpy(frame->buffer, data, size);
     frame->size = size;
 
-    cpuflags_t flags = write_lock_irqsave(&queue->lock);
+    cpuflags_t flags = spin_lock_irqsave(&queue->lock);
 
     for (int i = 0; i < QUEUE_SIZE; i++) {
         if (queue->frames[i] == NULL) {
             queue->frames[i] = frame;
-            write_unlock_irqrestore(&queue->lock, flags);
+            ++queue->pending;
+            spin_unlock_irqrestore(&queue->lock, flags);
+            wake_up(&queue->wait);
             return;
         }
     }
 
-    write_unlock_irqrestore(&queue->lock, flags);
+    spin_unlock_irqrestore(&queue->lock, flags);
 
     release_net_frame(frame);
     kprintf("failed to add net frame to daemon queue\n");
@@ -6,6 +6,8 @@
 #define PAGE_SIZE 4096
 #define PAGE_SIZE_BITS 12
 
+#define CACHE_LINE_SIZE 64
+
 #define PHYSMEM_VIRTUAL_BASE 0xffff880000000000
 #define KERNEL_PHYSICAL_BASE 0x100000
 #define KERNEL_VIRTUAL_BASE (PHYSMEM_VIRTUAL_BASE + KERNEL_PHYSICAL_BASE)
@@ -17,6 +19,17 @@
 #define ADDR_TO_PHYS(_mem) ((_mem)-PHYSMEM_VIRTUAL_BASE)
 #define PTR_TO_PHYS(_ptr) (((void *)(_ptr)-PHYSMEM_VIRTUAL_BASE))
 
+/*
+ * kmalloc brk heap grows up from KMALLOC_VIRTUAL_BASE, vmalloc areas are
+ * allocated in [VMALLOC_VIRTUAL_BASE, VMALLOC_VIRTUAL_END), kernel stacks
+ * are allocated in [STACK_VIRTUAL_BASE, STACK_VIRTUAL_END)
+ */
+#define KMALLOC_VIRTUAL_BASE 0xffffc90000000000
+#define VMALLOC_VIRTUAL_BASE 0xffffd90000000000
+#define VMALLOC_VIRTUAL_END 0xffffe80000000000
+#define STACK_VIRTUAL_BASE 0xffffe80000000000
+#define STACK_VIRTUAL_END 0xffffe90000000000
+
 #define MMIO_VIRTUAL_BASE 0xffffe90000000000
 
 #define KERNEL_CS 0x08
@@ -27,3 +40,5 @@
 #define TSS_SEL1 0x30
 
 #define KERNEL_INITIAL_STACK 0x90000
+/* physical page application processors start executing from */
+#define SMP_TRAMPOLINE_ADDR 0x8000
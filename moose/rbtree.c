@@ -4,8 +4,8 @@ static struct rb_node *rb_parent(const struct rb_node *node) {
     return (void *)(node->parent__color & ~1);
 }
 
-#define rb_is_black(_node) (!rb_color(_node))
-#define rb_is_red(_node) (rb_color(_node))
+#define rb_is_black(_node) (rb_color(_node) == RB_BLACK)
+#define rb_is_red(_node) (rb_color(_node) == RB_RED)
 static int rb_color(const struct rb_node *node) {
     return node->parent__color & 1;
 }
@@ -302,3 +302,54 @@ color:
     if (color == RB_BLACK)
         rb_erase_color(child, parent, root);
 }
+
+static void rb_augment_path(struct rb_node *node, rb_augment_f func,
+                            void *data) {
+    struct rb_node *parent;
+    for (;;) {
+        func(node, data);
+        parent = rb_parent(node);
+        if (!parent)
+            return;
+
+        // rotations may have changed sibling subtree as well
+        if (node == parent->left && parent->right)
+            func(parent->right, data);
+        else if (parent->left)
+            func(parent->left, data);
+        node = parent;
+    }
+}
+
+void rb_augment_insert(struct rb_node *node, rb_augment_f func, void *data) {
+    if (node->left)
+        node = node->left;
+    else if (node->right)
+        node = node->right;
+    rb_augment_path(node, func, data);
+}
+
+struct rb_node *rb_augment_erase_begin(struct rb_node *node) {
+    struct rb_node *deepest;
+    if (!node->right && !node->left) {
+        deepest = rb_parent(node);
+    } else if (!node->right) {
+        deepest = node->left;
+    } else if (!node->left) {
+        deepest = node->right;
+    } else {
+        deepest = rb_next(node);
+        if (deepest->right)
+            deepest = deepest->right;
+        else if (rb_parent(deepest) != node)
+            deepest = rb_parent(deepest);
+    }
+
+    return deepest;
+}
+
+void rb_augment_erase_end(struct rb_node *node, rb_augment_f func,
+                          void *data) {
+    if (node)
+        rb_augment_path(node, func, data);
+}
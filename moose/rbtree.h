@@ -2,8 +2,9 @@
 
 #include <moose/types.h>
 
-#define RB_BLACK 0
-#define RB_RED 1
+// newly linked nodes have zero color bit, so they are red
+#define RB_RED 0
+#define RB_BLACK 1
 
 struct rb_node {
     // store pointer to parent or'ed with color
@@ -34,3 +35,17 @@ static __forceinline void rb_link_node(struct rb_node *node,
 
 void rb_insert_color(struct rb_node *node, struct rb_node **root);
 void rb_erase(struct rb_node *node, struct rb_node **root);
+
+// Augmented trees keep per-node data computed from node and its children.
+// Callback recomputes that data for given node from its children.
+typedef void (*rb_augment_f)(struct rb_node *node, void *data);
+
+// Updates augmented data after node is inserted and tree is rebalanced.
+// Also used to propagate change of node's own data to the root.
+void rb_augment_insert(struct rb_node *node, rb_augment_f func, void *data);
+// Returns deepest node whose augmented data changes when node is erased,
+// has to be called before rb_erase
+struct rb_node *rb_augment_erase_begin(struct rb_node *node);
+// Updates augmented data after erase, node is value returned by
+// rb_augment_erase_begin
+void rb_augment_erase_end(struct rb_node *node, rb_augment_f func, void *data);
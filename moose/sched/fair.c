@@ -0,0 +1,248 @@
+#include <moose/errno.h>
+#include <moose/rbtree.h>
+#include <moose/sched/sched.h>
+#include <moose/sched/sched_class.h>
+
+#define NICE_0_WEIGHT 1024
+
+// each nice level changes cpu share by about 10%
+static const u32 nice_weights[NICE_WIDTH] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15,
+};
+
+static struct {
+    u64 latency;
+    u64 min_granularity;
+    u64 wakeup_granularity;
+} tunables = {
+    .latency = SCHED_LATENCY_NS,
+    .min_granularity = SCHED_MIN_GRANULARITY_NS,
+    .wakeup_granularity = SCHED_WAKEUP_GRANULARITY_NS,
+};
+
+u32 nice_to_weight(int nice) {
+    return nice_weights[nice - MIN_NICE];
+}
+
+int set_sched_latency(u64 latency_ns, u64 min_granularity_ns,
+                      u64 wakeup_granularity_ns) {
+    if (min_granularity_ns == 0 || min_granularity_ns > latency_ns ||
+        wakeup_granularity_ns > latency_ns)
+        return -EINVAL;
+
+    tunables.latency = latency_ns;
+    tunables.min_granularity = min_granularity_ns;
+    tunables.wakeup_granularity = wakeup_granularity_ns;
+    return 0;
+}
+
+static struct process *node_to_process(struct rb_node *node) {
+    return rb_entry_safe(node, struct process, sched_node);
+}
+
+static int is_fair_curr(const struct runqueue *rq) {
+    return rq->curr != rq->idle && rq->curr->class == &fair_sched_class;
+}
+
+static u64 calc_delta_fair(u64 delta, const struct process *process) {
+    if (process->weight == NICE_0_WEIGHT)
+        return delta;
+    return delta * NICE_0_WEIGHT / process->weight;
+}
+
+// Period is latency unless there are more processes than fit in it with
+// minimal granularity each, slice is share of the period by weight
+static u64 sched_slice(const struct runqueue *rq,
+                       const struct process *process) {
+    u32 nr = rq->fair.nr_queued + !process->on_rq;
+    u64 load = rq->fair.load + (process->on_rq ? 0 : process->weight);
+    u64 period = tunables.latency;
+    if (nr > tunables.latency / tunables.min_granularity)
+        period = nr * tunables.min_granularity;
+
+    return period * process->weight / load;
+}
+
+static void update_min_vruntime(struct runqueue *rq) {
+    struct fair_rq *fair = &rq->fair;
+    struct process *leftmost = node_to_process(fair->leftmost);
+    u64 vruntime = fair->min_vruntime;
+    if (is_fair_curr(rq))
+        vruntime = rq->curr->vruntime;
+    if (leftmost &&
+        (!is_fair_curr(rq) || (i64)(leftmost->vruntime - vruntime) < 0))
+        vruntime = leftmost->vruntime;
+
+    if ((i64)(vruntime - fair->min_vruntime) > 0)
+        fair->min_vruntime = vruntime;
+}
+
+static void insert_process(struct fair_rq *fair, struct process *process) {
+    struct rb_node **link = &fair->root;
+    struct rb_node *parent = NULL;
+    int leftmost = 1;
+    while (*link) {
+        parent = *link;
+        struct process *entry = node_to_process(parent);
+        if ((i64)(process->vruntime - entry->vruntime) < 0) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+
+    if (leftmost)
+        fair->leftmost = &process->sched_node;
+    rb_link_node(&process->sched_node, parent);
+    *link = &process->sched_node;
+    rb_insert_color(&process->sched_node, &fair->root);
+    fair->load += process->weight;
+    ++fair->nr_queued;
+}
+
+static void remove_process(struct fair_rq *fair, struct process *process) {
+    if (fair->leftmost == &process->sched_node)
+        fair->leftmost = rb_next(&process->sched_node);
+    rb_erase(&process->sched_node, &fair->root);
+    fair->load -= process->weight;
+    --fair->nr_queued;
+    if (fair->skip == process)
+        fair->skip = NULL;
+}
+
+static void init_rq_fair(struct runqueue *rq) {
+    rq->fair.root = NULL;
+    rq->fair.leftmost = NULL;
+}
+
+static void update_curr_fair(struct runqueue *rq, struct process *curr) {
+    i64 delta = rq->clock - curr->exec_start;
+    if (delta <= 0)
+        return;
+
+    curr->exec_start = rq->clock;
+    curr->sum_exec_runtime += delta;
+    curr->vruntime += calc_delta_fair(delta, curr);
+    update_min_vruntime(rq);
+}
+
+// Sleeping process gets at most half of latency as credit, so that it
+// runs soon after wakeup but can not monopolize cpu after long sleep
+static void enqueue_fair(struct runqueue *rq, struct process *process,
+                         int flags) {
+    process->vruntime += rq->fair.min_vruntime;
+    if (flags & ENQUEUE_WAKEUP) {
+        u64 min = rq->fair.min_vruntime - tunables.latency / 2;
+        if ((i64)(process->vruntime - min) < 0)
+            process->vruntime = min;
+    }
+
+    insert_process(&rq->fair, process);
+}
+
+static void dequeue_fair(struct runqueue *rq, struct process *process) {
+    remove_process(&rq->fair, process);
+    update_min_vruntime(rq);
+    process->vruntime -= rq->fair.min_vruntime;
+}
+
+static struct process *pick_next_fair(struct runqueue *rq) {
+    struct fair_rq *fair = &rq->fair;
+    struct process *next = node_to_process(fair->leftmost);
+    if (next == NULL)
+        return NULL;
+
+    // yielding process gives way to the next one unless that one is too
+    // far behind
+    if (next == fair->skip) {
+        struct process *second =
+            node_to_process(rb_next(&next->sched_node));
+        if (second && (i64)(second->vruntime - next->vruntime) <
+                          (i64)tunables.wakeup_granularity)
+            next = second;
+    }
+    fair->skip = NULL;
+
+    remove_process(fair, next);
+    next->exec_start = rq->clock;
+    next->prev_sum_exec_runtime = next->sum_exec_runtime;
+    return next;
+}
+
+static void put_prev_fair(struct runqueue *rq, struct process *process,
+                          int flags) {
+    if (process->state != PROCESS_RUNNING) {
+        process->vruntime -= rq->fair.min_vruntime;
+        return;
+    }
+
+    insert_process(&rq->fair, process);
+    if (flags & PUT_YIELD)
+        rq->fair.skip = process;
+}
+
+// Current process runs for its slice, after at least minimal granularity
+// it is also preempted once it is more than a slice ahead of leftmost one
+static int check_preempt_fair(struct runqueue *rq, struct process *curr) {
+    u64 ideal = sched_slice(rq, curr);
+    u64 ran = curr->sum_exec_runtime - curr->prev_sum_exec_runtime;
+    if (ran > ideal)
+        return 1;
+    if (ran < tunables.min_granularity)
+        return 0;
+
+    struct process *leftmost = node_to_process(rq->fair.leftmost);
+    return leftmost && (i64)(curr->vruntime - leftmost->vruntime) > (i64)ideal;
+}
+
+static int wakeup_preempt_fair(struct runqueue *rq __unused,
+                               struct process *curr, struct process *woken) {
+    i64 gran = calc_delta_fair(tunables.wakeup_granularity, woken);
+    return (i64)(curr->vruntime - woken->vruntime) > gran;
+}
+
+// processes with the largest vruntime are the least urgent and their cache
+// footprint is most likely gone already
+static struct process *find_stealable_fair(struct runqueue *rq) {
+    for (struct rb_node *node = rb_last(rq->fair.root); node;
+         node = rb_prev(node)) {
+        struct process *process = node_to_process(node);
+        if (!__atomic_load_n(&process->on_cpu, __ATOMIC_ACQUIRE))
+            return process;
+    }
+
+    return NULL;
+}
+
+static void attach_curr_fair(struct runqueue *rq, struct process *curr) {
+    curr->vruntime += rq->fair.min_vruntime;
+    curr->exec_start = rq->clock;
+    curr->prev_sum_exec_runtime = curr->sum_exec_runtime;
+}
+
+static void detach_curr_fair(struct runqueue *rq, struct process *curr) {
+    update_curr_fair(rq, curr);
+    curr->vruntime -= rq->fair.min_vruntime;
+}
+
+const struct sched_class fair_sched_class = {
+    .init_rq = init_rq_fair,
+    .enqueue = enqueue_fair,
+    .dequeue = dequeue_fair,
+    .pick_next = pick_next_fair,
+    .put_prev = put_prev_fair,
+    .update_curr = update_curr_fair,
+    .check_preempt = check_preempt_fair,
+    .wakeup_preempt = wakeup_preempt_fair,
+    .find_stealable = find_stealable_fair,
+    .attach_curr = attach_curr_fair,
+    .detach_curr = detach_curr_fair,
+};
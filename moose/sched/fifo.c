@@ -0,0 +1,118 @@
+#include <moose/bitops.h>
+#include <moose/sched/sched.h>
+#include <moose/sched/sched_class.h>
+
+static void init_rq_fifo(struct runqueue *rq) {
+    for (size_t i = 0; i < ARRAY_SIZE(rq->fifo.ranks); ++i)
+        init_list_head(rq->fifo.ranks + i);
+}
+
+static u32 highest_prio(const struct fifo_rq *fifo) {
+    return BITMAP_STRIDE - 1 - __count_leading_zeroes(fifo->bitmap);
+}
+
+// inherited priority may put fair process here, so effective priority is
+// used instead of rt_prio
+static u32 fifo_prio(const struct process *process) {
+    return process->prio - NICE_WIDTH;
+}
+
+static void remove_process(struct fifo_rq *fifo, struct process *process) {
+    list_remove(&process->sched_list);
+    u32 prio = fifo_prio(process);
+    if (list_is_empty(fifo->ranks + prio))
+        fifo->bitmap &= ~(1ul << prio);
+}
+
+static void enqueue_fifo(struct runqueue *rq, struct process *process,
+                         int flags __unused) {
+    u32 prio = fifo_prio(process);
+    list_add_tail(&process->sched_list, rq->fifo.ranks + prio);
+    rq->fifo.bitmap |= 1ul << prio;
+}
+
+static void dequeue_fifo(struct runqueue *rq, struct process *process) {
+    remove_process(&rq->fifo, process);
+}
+
+static struct process *pick_next_fifo(struct runqueue *rq) {
+    if (rq->fifo.bitmap == 0)
+        return NULL;
+
+    struct process *next = list_first_entry(
+        rq->fifo.ranks + highest_prio(&rq->fifo), struct process, sched_list);
+    remove_process(&rq->fifo, next);
+    next->exec_start = rq->clock;
+    return next;
+}
+
+// preempted process keeps its place at the head of its priority, yielding
+// one goes to the back
+static void put_prev_fifo(struct runqueue *rq, struct process *process,
+                          int flags) {
+    if (process->state != PROCESS_RUNNING)
+        return;
+
+    u32 prio = fifo_prio(process);
+    struct list_head *rank = rq->fifo.ranks + prio;
+    if (flags & PUT_YIELD)
+        list_add_tail(&process->sched_list, rank);
+    else
+        list_add(&process->sched_list, rank);
+    rq->fifo.bitmap |= 1ul << prio;
+}
+
+static void update_curr_fifo(struct runqueue *rq, struct process *curr) {
+    i64 delta = rq->clock - curr->exec_start;
+    if (delta <= 0)
+        return;
+
+    curr->exec_start = rq->clock;
+    curr->sum_exec_runtime += delta;
+}
+
+static int check_preempt_fifo(struct runqueue *rq, struct process *curr) {
+    return rq->fifo.bitmap && highest_prio(&rq->fifo) > fifo_prio(curr);
+}
+
+static int wakeup_preempt_fifo(struct runqueue *rq __unused,
+                               struct process *curr, struct process *woken) {
+    return woken->prio > curr->prio;
+}
+
+static struct process *find_stealable_fifo(struct runqueue *rq) {
+    for (u32 prio = 0; prio < MAX_RT_PRIO; ++prio) {
+        if (!(rq->fifo.bitmap & (1ul << prio)))
+            continue;
+
+        struct process *process;
+        list_for_each_entry(process, rq->fifo.ranks + prio, sched_list) {
+            if (!__atomic_load_n(&process->on_cpu, __ATOMIC_ACQUIRE))
+                return process;
+        }
+    }
+
+    return NULL;
+}
+
+static void attach_curr_fifo(struct runqueue *rq, struct process *curr) {
+    curr->exec_start = rq->clock;
+}
+
+static void detach_curr_fifo(struct runqueue *rq, struct process *curr) {
+    update_curr_fifo(rq, curr);
+}
+
+const struct sched_class fifo_sched_class = {
+    .init_rq = init_rq_fifo,
+    .enqueue = enqueue_fifo,
+    .dequeue = dequeue_fifo,
+    .pick_next = pick_next_fifo,
+    .put_prev = put_prev_fifo,
+    .update_curr = update_curr_fifo,
+    .check_preempt = check_preempt_fifo,
+    .wakeup_preempt = wakeup_preempt_fifo,
+    .find_stealable = find_stealable_fifo,
+    .attach_curr = attach_curr_fifo,
+    .detach_curr = detach_curr_fifo,
+};
@@ -0,0 +1,127 @@
+#ifdef CONFIG_LOCK_STAT
+
+#include <moose/arch/amd64/asm.h>
+#include <moose/kstdio.h>
+#include <moose/sched/lock_stat.h>
+#include <moose/sched/mutex.h>
+#include <moose/string.h>
+
+// Registry lock has no class itself, so taking it never recurses into
+// statistics. Classes are never unregistered, so they are read without it
+static struct {
+    struct lock_class classes[LOCK_CLASS_COUNT];
+    u32 count;
+    spinlock_t lock;
+} lock_stat = {.lock = INIT_SPIN_LOCK()};
+
+struct lock_class *get_lock_class(const char *name) {
+    struct lock_class *class = NULL;
+    cpuflags_t flags = spin_lock_irqsave(&lock_stat.lock);
+    for (u32 i = 0; i < lock_stat.count; ++i) {
+        if (strcmp(lock_stat.classes[i].name, name) == 0) {
+            class = lock_stat.classes + i;
+            goto out;
+        }
+    }
+
+    if (lock_stat.count == LOCK_CLASS_COUNT)
+        goto out;
+
+    class = lock_stat.classes + lock_stat.count;
+    class->name = name;
+    __atomic_store_n(&lock_stat.count, lock_stat.count + 1, __ATOMIC_RELEASE);
+out:
+    spin_unlock_irqrestore(&lock_stat.lock, flags);
+    return class;
+}
+
+void set_spin_lock_class(spinlock_t *lock, const char *name) {
+    lock->class = get_lock_class(name);
+}
+
+void set_rwlock_class(rwlock_t *lock, const char *name) {
+    lock->class = get_lock_class(name);
+}
+
+void set_mutex_class(mutex_t *lock, const char *name) {
+    lock->class = get_lock_class(name);
+}
+
+void lock_stat_acquired(struct lock_class *class) {
+    if (class)
+        __atomic_fetch_add(&class->acquisitions, 1, __ATOMIC_RELAXED);
+}
+
+u64 lock_stat_wait_begin(struct lock_class *class) {
+    return class ? read_tsc() : 0;
+}
+
+// Space-saving top list: unknown caller replaces the least counted one and
+// inherits its count, so callers that wait often stay in the list
+static void record_site(struct lock_class *class, const void *caller) {
+    if (__atomic_exchange_n(&class->sites_busy, 1, __ATOMIC_ACQUIRE))
+        return;
+
+    struct lock_stat_site *min = class->sites;
+    for (int i = 0; i < LOCK_STAT_SITES; ++i) {
+        struct lock_stat_site *site = class->sites + i;
+        if (site->caller == caller) {
+            min = site;
+            break;
+        }
+        if (site->count < min->count)
+            min = site;
+    }
+    min->caller = caller;
+    min->count++;
+
+    __atomic_store_n(&class->sites_busy, 0, __ATOMIC_RELEASE);
+}
+
+void lock_stat_contended(struct lock_class *class, u64 start,
+                         const void *caller) {
+    if (class == NULL)
+        return;
+
+    u64 cycles = read_tsc() - start;
+    __atomic_fetch_add(&class->acquisitions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&class->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&class->wait_cycles, cycles, __ATOMIC_RELAXED);
+    u64 max = __atomic_load_n(&class->max_wait_cycles, __ATOMIC_RELAXED);
+    while (cycles > max &&
+           !__atomic_compare_exchange_n(&class->max_wait_cycles, &max, cycles,
+                                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    record_site(class, caller);
+}
+
+void print_lock_stats(void) {
+    struct lock_class *sorted[LOCK_CLASS_COUNT];
+    u32 count = __atomic_load_n(&lock_stat.count, __ATOMIC_ACQUIRE);
+    for (u32 i = 0; i < count; ++i) {
+        struct lock_class *class = lock_stat.classes + i;
+        u64 wait = __atomic_load_n(&class->wait_cycles, __ATOMIC_RELAXED);
+        u32 j = i;
+        for (; j && sorted[j - 1]->wait_cycles < wait; --j)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = class;
+    }
+
+    kprintf("%-12s %10s %10s %14s %12s %10s\n", "class", "acquired",
+            "contended", "wait cycles", "max", "avg");
+    for (u32 i = 0; i < count; ++i) {
+        const struct lock_class *class = sorted[i];
+        u64 contended = class->contended;
+        kprintf("%-12s %10lu %10lu %14lu %12lu %10lu\n", class->name,
+                class->acquisitions, contended, class->wait_cycles,
+                class->max_wait_cycles,
+                contended ? class->wait_cycles / contended : 0);
+        for (int j = 0; j < LOCK_STAT_SITES; ++j) {
+            const struct lock_stat_site *site = class->sites + j;
+            if (site->caller)
+                kprintf("    %-18p %10lu\n", site->caller, site->count);
+        }
+    }
+}
+
+#endif // CONFIG_LOCK_STAT
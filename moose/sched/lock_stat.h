@@ -0,0 +1,82 @@
+#pragma once
+
+#include <moose/sched/locks.h>
+#include <moose/types.h>
+
+// Lock statistics are enabled with CONFIG_LOCK_STAT. Locks that are given
+// a class by name count acquisitions, and contended ones also count cycles
+// spent waiting and the call sites that waited. Locks sharing a name share
+// a class, so e.g. all runqueue locks are reported together.
+
+struct mutex;
+
+#ifdef CONFIG_LOCK_STAT
+
+#define lock_class_of(_lock) ((_lock)->class)
+
+// number of classes that can be registered
+#define LOCK_CLASS_COUNT 32
+// number of top contending call sites kept per class
+#define LOCK_STAT_SITES 4
+
+struct lock_stat_site {
+    const void *caller;
+    u64 count;
+};
+
+struct lock_class {
+    const char *name;
+    u64 acquisitions;
+    // acquisitions that found lock taken
+    u64 contended;
+    // rdtsc cycles spent waiting in contended acquisitions
+    u64 wait_cycles;
+    u64 max_wait_cycles;
+    // guards sites, samples are dropped instead of waiting on it
+    int sites_busy;
+    struct lock_stat_site sites[LOCK_STAT_SITES];
+};
+
+// returns class registered with name, registering it if needed, or NULL if
+// there is no space left
+struct lock_class *get_lock_class(const char *name);
+
+void set_spin_lock_class(spinlock_t *lock, const char *name);
+void set_rwlock_class(rwlock_t *lock, const char *name);
+void set_mutex_class(struct mutex *lock, const char *name);
+
+void lock_stat_acquired(struct lock_class *class);
+// returns timestamp of contended acquisition start
+u64 lock_stat_wait_begin(struct lock_class *class);
+void lock_stat_contended(struct lock_class *class, u64 start,
+                         const void *caller);
+
+// prints classes sorted by descending wait cycles
+void print_lock_stats(void);
+
+#else
+
+#define lock_class_of(_lock) ((struct lock_class *)NULL)
+
+static inline void set_spin_lock_class(spinlock_t *lock __unused,
+                                       const char *name __unused) {}
+
+static inline void set_rwlock_class(rwlock_t *lock __unused,
+                                    const char *name __unused) {}
+
+static inline void set_mutex_class(struct mutex *lock __unused,
+                                   const char *name __unused) {}
+
+static inline void lock_stat_acquired(struct lock_class *class __unused) {}
+
+static inline u64 lock_stat_wait_begin(struct lock_class *class __unused) {
+    return 0;
+}
+
+static inline void lock_stat_contended(struct lock_class *class __unused,
+                                       u64 start __unused,
+                                       const void *caller __unused) {}
+
+static inline void print_lock_stats(void) {}
+
+#endif
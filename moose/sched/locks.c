@@ -1,74 +1,298 @@
+#include <moose/arch/cpu.h>
+#include <moose/arch/jiffies.h>
 #include <moose/assert.h>
+#include <moose/kstdio.h>
+#include <moose/param.h>
+#include <moose/sched/lock_stat.h>
 #include <moose/sched/locks.h>
+#include <moose/sched/sched.h>
+
+// Spinlock word holds locked byte, pending bit and tail of queue of waiting
+// cpus. The first contender waits on the word with pending bit set, later
+// ones queue on per-cpu nodes and each spins only on its own node, so lock
+// is taken in arrival order without bouncing the lock cache line
+#define Q_LOCKED 0x1
+#define Q_LOCKED_MASK 0xff
+#define Q_PENDING 0x100
+#define Q_LOCKED_PENDING_MASK 0xffff
+#define Q_TAIL_SHIFT 16
+#define Q_TAIL_MASK (~Q_LOCKED_PENDING_MASK)
+
+struct qnode {
+    struct qnode *next;
+    // set by predecessor when this node becomes head of the queue
+    int locked;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct qnode qnodes[MAX_CPUS];
+
+// tail is cpu number plus one, so that zero means empty queue
+static int encode_tail(int cpu) {
+    return (cpu + 1) << Q_TAIL_SHIFT;
+}
+
+static struct qnode *decode_tail(int val) {
+    return qnodes + (val >> Q_TAIL_SHIFT) - 1;
+}
 
 void init_spin_lock(spinlock_t *spinlock) {
     atomic_set(&spinlock->atomic, 0);
+#ifdef CONFIG_LOCK_STAT
+    spinlock->class = NULL;
+#endif
 }
 
 int spin_trylock(spinlock_t *lock) {
     int old = 0;
-    return atomic_try_cmpxchg_acquire(&lock->atomic, &old, 1);
+    preempt_disable();
+    if (!atomic_try_cmpxchg_acquire(&lock->atomic, &old, Q_LOCKED)) {
+        preempt_enable();
+        return 0;
+    }
+
+    lock_stat_acquired(lock_class_of(lock));
+    return 1;
+}
+
+// Waiters spin with interrupts disabled, so they answer TLB shootdowns
+// themselves. Otherwise holder that flushes TLB would wait for them forever
+static void lock_spin_wait(void) {
+    poll_tlb_shootdown();
+    spinloop_hint();
 }
 
+// Interrupts stay disabled while waiting, so waiter is neither preempted
+// nor migrated while its node is queued, and interrupt handlers of this cpu
+// never need another node
+static void spin_lock_slow(spinlock_t *lock, int val) {
+    cpuflags_t flags = irq_save();
+
+    // only holder is there, so wait next to it with pending bit
+    if (!(val & ~Q_LOCKED_MASK)) {
+        val = atomic_fetch_or_acquire(&lock->atomic, Q_PENDING);
+        if (!(val & ~Q_LOCKED_MASK)) {
+            while (atomic_read_acquire(&lock->atomic) & Q_LOCKED_MASK)
+                lock_spin_wait();
+            atomic_add(&lock->atomic, Q_LOCKED - Q_PENDING);
+            goto out;
+        }
+        // pending bit was set while there is queue already
+        if (!(val & Q_PENDING))
+            atomic_and(&lock->atomic, ~Q_PENDING);
+    }
+
+    int tail = encode_tail(get_cpu_id());
+    struct qnode *node = decode_tail(tail);
+    node->next = NULL;
+    node->locked = 0;
+
+    // release makes node initialization visible to successor
+    val = atomic_read(&lock->atomic);
+    while (!atomic_try_cmpxchg_release(&lock->atomic, &val,
+                                       (val & Q_LOCKED_PENDING_MASK) | tail))
+        ;
+    if (val & Q_TAIL_MASK) {
+        __atomic_store_n(&decode_tail(val)->next, node, __ATOMIC_RELEASE);
+        while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+            lock_spin_wait();
+    }
+
+    // head of the queue waits for holder and pending waiter to leave
+    while ((val = atomic_read_acquire(&lock->atomic)) & Q_LOCKED_PENDING_MASK)
+        lock_spin_wait();
+
+    // last waiter empties the queue, otherwise successor becomes the head
+    while ((val & Q_TAIL_MASK) == tail) {
+        if (atomic_try_cmpxchg_relaxed(&lock->atomic, &val, Q_LOCKED))
+            goto out;
+    }
+    atomic_or(&lock->atomic, Q_LOCKED);
+
+    struct qnode *next;
+    while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+        lock_spin_wait();
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+
+out:
+    irq_restore(flags);
+}
+
+// Holder is not preempted, otherwise waiter that spins with interrupts
+// disabled on the same cpu would never let it run again
 void spin_lock(spinlock_t *lock) {
-    int old = 0;
-    while (!atomic_try_cmpxchg_acquire(&lock->atomic, &old, 1))
-        spinloop_hint();
+    int val = 0;
+    preempt_disable();
+    // failed cmpxchg stores current value to val
+    if (atomic_try_cmpxchg_acquire(&lock->atomic, &val, Q_LOCKED)) {
+        lock_stat_acquired(lock_class_of(lock));
+        return;
+    }
+
+    u64 start = lock_stat_wait_begin(lock_class_of(lock));
+    spin_lock_slow(lock, val);
+    lock_stat_contended(lock_class_of(lock), start,
+                        __builtin_return_address(0));
 }
 
+// pending and tail bits may change concurrently, so only locked byte is
+// cleared
 void spin_unlock(spinlock_t *lock) {
     assert(spin_is_locked(lock));
-    atomic_set_release(&lock->atomic, 0);
+    atomic_fetch_sub_release(&lock->atomic, Q_LOCKED);
+    preempt_enable();
 }
 
 int spin_is_locked(spinlock_t *spinlock) {
-    return atomic_read(&spinlock->atomic);
+    return atomic_read(&spinlock->atomic) & Q_LOCKED_MASK;
 }
 
+#define RW_WLOCKED 0xff
+#define RW_WAITING 0x100
+#define RW_WMASK 0x1ff
+#define RW_READER_BIAS 0x200
+
 void init_rwlock(rwlock_t *lock) {
-    init_spin_lock(&lock->lock);
-    lock->readers = 0;
-    lock->writers = 0;
-    lock->is_writing = 0;
+    atomic_set(&lock->cnts, 0);
+    init_spin_lock(&lock->wait_lock);
+#ifdef CONFIG_LOCK_STAT
+    lock->class = NULL;
+#endif
+}
+
+// reader that found a writer takes its turn in the queue of wait_lock
+static void read_lock_slow(rwlock_t *lock) {
+    atomic_sub(&lock->cnts, RW_READER_BIAS);
+    spin_lock(&lock->wait_lock);
+    // writer can not be waiting while wait_lock is held here, so only the
+    // active one has to leave
+    atomic_add(&lock->cnts, RW_READER_BIAS);
+    while (atomic_read_acquire(&lock->cnts) & RW_WLOCKED)
+        lock_spin_wait();
+    spin_unlock(&lock->wait_lock);
 }
 
 void read_lock(rwlock_t *lock) {
-retry:
-    spin_lock(&lock->lock);
-    if (lock->writers > 0 || lock->is_writing) {
-        spin_unlock(&lock->lock);
-        spinloop_hint();
-        goto retry;
+    preempt_disable();
+    int cnts = atomic_add_return_acquire(&lock->cnts, RW_READER_BIAS);
+    if (!(cnts & RW_WMASK)) {
+        lock_stat_acquired(lock_class_of(lock));
+        return;
     }
-    ++lock->readers;
-    spin_unlock(&lock->lock);
+
+    u64 start = lock_stat_wait_begin(lock_class_of(lock));
+    read_lock_slow(lock);
+    lock_stat_contended(lock_class_of(lock), start,
+                        __builtin_return_address(0));
 }
 
 void read_unlock(rwlock_t *lock) {
-    spin_lock(&lock->lock);
-    --lock->readers;
-    spin_unlock(&lock->lock);
+    atomic_fetch_sub_release(&lock->cnts, RW_READER_BIAS);
+    preempt_enable();
+}
+
+// Waiting bit turns new readers away, so writer waits only for readers that
+// are already inside
+static void write_lock_slow(rwlock_t *lock) {
+    spin_lock(&lock->wait_lock);
+    int cnts = 0;
+    if (atomic_try_cmpxchg_acquire(&lock->cnts, &cnts, RW_WLOCKED))
+        goto out;
+
+    atomic_or(&lock->cnts, RW_WAITING);
+    for (;;) {
+        cnts = RW_WAITING;
+        if (atomic_try_cmpxchg_acquire(&lock->cnts, &cnts, RW_WLOCKED))
+            break;
+        lock_spin_wait();
+    }
+
+out:
+    spin_unlock(&lock->wait_lock);
 }
 
 void write_lock(rwlock_t *lock) {
-    spin_lock(&lock->lock);
-    ++lock->writers;
-    spin_unlock(&lock->lock);
-
-retry:
-    spin_lock(&lock->lock);
-    if (lock->readers > 0 || lock->is_writing) {
-        spin_unlock(&lock->lock);
-        spinloop_hint();
-        goto retry;
+    preempt_disable();
+    int cnts = 0;
+    if (atomic_try_cmpxchg_acquire(&lock->cnts, &cnts, RW_WLOCKED)) {
+        lock_stat_acquired(lock_class_of(lock));
+        return;
     }
-    --lock->writers;
-    lock->is_writing = 1;
-    spin_unlock(&lock->lock);
+
+    u64 start = lock_stat_wait_begin(lock_class_of(lock));
+    write_lock_slow(lock);
+    lock_stat_contended(lock_class_of(lock), start,
+                        __builtin_return_address(0));
 }
 
 void write_unlock(rwlock_t *lock) {
-    spin_lock(&lock->lock);
-    lock->is_writing = 0;
-    spin_unlock(&lock->lock);
+    assert(atomic_read(&lock->cnts) & RW_WLOCKED);
+    atomic_fetch_sub_release(&lock->cnts, RW_WLOCKED);
+    preempt_enable();
 }
+
+#ifdef CONFIG_BENCH
+
+#define BENCH_LOCK_MSECS 250
+
+struct bench_lock_counter {
+    u64 count;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct {
+    spinlock_t lock;
+    u64 shared;
+    u64 end;
+    atomic_t finished;
+    struct bench_lock_counter counters[MAX_CPUS];
+} bench_lock;
+
+static void bench_lock_task(void *arg) {
+    struct bench_lock_counter *counter = arg;
+    while (get_jiffies() < bench_lock.end) {
+        spin_lock_irq(&bench_lock.lock);
+        ++bench_lock.shared;
+        spin_unlock_irq(&bench_lock.lock);
+        ++counter->count;
+    }
+
+    // processes can not exit yet, so finished ones sleep forever
+    atomic_inc(&bench_lock.finished);
+    set_current_state(PROCESS_UNINTERRUPTIBLE);
+    schedule();
+}
+
+// Hammers one spinlock from 1 to cpu count processes and reports total
+// acquisition rate and spread between the most and the least lucky one
+void bench_spinlock(void) {
+    init_spin_lock(&bench_lock.lock);
+    for (int nr = 1; nr <= get_cpu_count(); ++nr) {
+        for (int i = 0; i < nr; ++i)
+            bench_lock.counters[i].count = 0;
+        atomic_set(&bench_lock.finished, 0);
+        u64 start = get_jiffies();
+        bench_lock.end = start + msecs_to_jiffies(BENCH_LOCK_MSECS);
+        for (int i = 0; i < nr; ++i)
+            launch_process("bench/lock", bench_lock_task,
+                           bench_lock.counters + i);
+
+        // this runs in idle process, so it gets cpu back only after
+        // benchmark processes are done
+        while (atomic_read(&bench_lock.finished) != nr)
+            wait_for_int();
+        u64 msecs = jiffies_to_msecs(get_jiffies() - start);
+
+        u64 total = 0;
+        u64 min = ~0ul;
+        u64 max = 0;
+        for (int i = 0; i < nr; ++i) {
+            u64 count = bench_lock.counters[i].count;
+            total += count;
+            min = count < min ? count : min;
+            max = count > max ? count : max;
+        }
+        kprintf("spinlock %d cpus: %lu acquisitions/s, spread %lu%%\n", nr,
+                total * 1000 / msecs, max ? (max - min) * 100 / max : 0);
+    }
+}
+
+#endif
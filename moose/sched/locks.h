@@ -47,14 +47,25 @@
         return 0;                                                              \
     }
 
+struct lock_class;
+
 // clang-format off
 
+// queued spinlock, waiters get it in arrival order
 typedef struct spinlock {
     atomic_t atomic;
+#ifdef CONFIG_LOCK_STAT
+    struct lock_class *class;
+#endif
 } spinlock_t;
 
+#ifdef CONFIG_LOCK_STAT
+#define INIT_SPIN_LOCK()                                                       \
+    { INIT_ATOMIC(0), NULL }
+#else
 #define INIT_SPIN_LOCK()                                                       \
     { INIT_ATOMIC(0) }
+#endif
 
 void init_spin_lock(spinlock_t *lock);
 int spin_trylock(spinlock_t *lock);
@@ -69,15 +80,25 @@ __define_unlock_irqrestore(spin_unlock, spinlock_t)
 __define_trylock_irq(spin_trylock, spinlock_t)
 __define_trylock_irqsave(spin_trylock, spinlock_t)
 
+// Reader-writer lock, read side is single atomic add when there is no
+// writer. Once writer waits, new readers queue behind it on wait_lock, so
+// read lock must not be taken recursively
 typedef struct rwlock {
-    spinlock_t lock;
-    int readers;
-    int writers;
-    int is_writing;
+    // writer locked byte, writer waiting bit and reader count above them
+    atomic_t cnts;
+    spinlock_t wait_lock;
+#ifdef CONFIG_LOCK_STAT
+    struct lock_class *class;
+#endif
 } rwlock_t;
 
+#ifdef CONFIG_LOCK_STAT
+#define INIT_RWLOCK()                                                          \
+    { INIT_ATOMIC(0), INIT_SPIN_LOCK(), NULL }
+#else
 #define INIT_RWLOCK()                                                          \
-    { INIT_SPIN_LOCK(), 0, 0, 0 }
+    { INIT_ATOMIC(0), INIT_SPIN_LOCK() }
+#endif
 
 void init_rwlock(rwlock_t *lock);
 
@@ -97,4 +118,81 @@ __define_lock_irqsave(write_lock, rwlock_t)
 __define_unlock_irq(write_unlock, rwlock_t)
 __define_unlock_irqrestore(write_unlock, rwlock_t)
 
+// Sequence counter, odd while write is in progress. Readers never block
+// writer, they retry if they raced with it. Writers have to be serialized
+// by other means
+typedef struct seqcount {
+    u32 sequence;
+} seqcount_t;
+
+#define INIT_SEQCOUNT()                                                        \
+    { 0 }
+
+static inline void init_seqcount(seqcount_t *s) {
+    s->sequence = 0;
+}
+
+static inline u32 read_seqcount_begin(const seqcount_t *s) {
+    u32 seq;
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+        spinloop_hint();
+    return seq;
+}
+
+// returns nonzero if data read since begin may be inconsistent
+static inline int read_seqcount_retry(const seqcount_t *s, u32 start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t *s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+// sequence counter with its own writer lock
+typedef struct seqlock {
+    seqcount_t seqcount;
+    spinlock_t lock;
+} seqlock_t;
+
+#define INIT_SEQLOCK()                                                         \
+    { INIT_SEQCOUNT(), INIT_SPIN_LOCK() }
+
+static inline void init_seqlock(seqlock_t *sl) {
+    init_seqcount(&sl->seqcount);
+    init_spin_lock(&sl->lock);
+}
+
+static inline u32 read_seqbegin(const seqlock_t *sl) {
+    return read_seqcount_begin(&sl->seqcount);
+}
+
+static inline int read_seqretry(const seqlock_t *sl, u32 start) {
+    return read_seqcount_retry(&sl->seqcount, start);
+}
+
+static inline void write_seqlock(seqlock_t *sl) {
+    spin_lock(&sl->lock);
+    write_seqcount_begin(&sl->seqcount);
+}
+
+static inline void write_sequnlock(seqlock_t *sl) {
+    write_seqcount_end(&sl->seqcount);
+    spin_unlock(&sl->lock);
+}
+
+__define_lock_irq(write_seqlock, seqlock_t)
+__define_lock_irqsave(write_seqlock, seqlock_t)
+__define_unlock_irq(write_sequnlock, seqlock_t)
+__define_unlock_irqrestore(write_sequnlock, seqlock_t)
+
     // clang-format on
+
+#ifdef CONFIG_BENCH
+void bench_spinlock(void);
+#endif
@@ -1,34 +1,372 @@
+#include <moose/arch/jiffies.h>
+#include <moose/assert.h>
+#include <moose/kstdio.h>
+#include <moose/sched/lock_stat.h>
 #include <moose/sched/mutex.h>
 #include <moose/sched/sched.h>
+#include <moose/sched/timer.h>
+
+// bound of blocked owner chain that priority is propagated along
+#define MUTEX_PI_MAX_DEPTH 8
+
+struct mutex_waiter {
+    struct process *process;
+    struct list_head list;
+    // set by unlock once mutex is handed to waiter
+    int handed;
+};
 
 void init_mutex(mutex_t *lock) {
-    lock->holder = NULL;
+    lock->owner = 0;
+    init_spin_lock(&lock->wait_lock);
+    init_list_head(&lock->waiters);
+    lock->waiters_prio = NO_PI_PRIO;
+    init_list_head(&lock->pi_list);
+    lock->stats = (struct mutex_stats){0};
+#ifdef CONFIG_LOCK_STAT
+    lock->class = NULL;
+#endif
+}
+
+static struct process *owner_process(uintptr_t owner) {
+    return (struct process *)(owner & ~MUTEX_FLAG_MASK);
+}
+
+struct process *mutex_owner(mutex_t *lock) {
+    return owner_process(__atomic_load_n(&lock->owner, __ATOMIC_RELAXED));
+}
+
+int mutex_is_locked(mutex_t *lock) {
+    return mutex_owner(lock) != NULL;
+}
+
+static int try_acquire(mutex_t *lock) {
+    uintptr_t expected = 0;
+    return __atomic_compare_exchange_n(&lock->owner, &expected,
+                                       (uintptr_t)get_current(), 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void account(mutex_t *lock, u64 wait_start) {
+    __atomic_fetch_add(&lock->stats.acquisitions, 1, __ATOMIC_RELAXED);
+    if (wait_start == 0)
+        return;
+
+    __atomic_fetch_add(&lock->stats.contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lock->stats.wait_ns, sched_clock() - wait_start,
+                       __ATOMIC_RELAXED);
+}
+
+int mutex_trylock(mutex_t *lock) {
+    if (!try_acquire(lock))
+        return 0;
+
+    account(lock, 0);
+    lock_stat_acquired(lock_class_of(lock));
+    return 1;
+}
+
+// Spinning pays off only while owner is running. It stops once there are
+// sleeping waiters, because mutex is handed to them and not released
+static int spin_on_owner(mutex_t *lock) {
+    for (;;) {
+        uintptr_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+        if (owner & MUTEX_FLAG_WAITERS)
+            return 0;
+        if (owner == 0) {
+            if (try_acquire(lock))
+                return 1;
+            continue;
+        }
+        if (!__atomic_load_n(&owner_process(owner)->on_cpu, __ATOMIC_RELAXED))
+            return 0;
+        spinloop_hint();
+    }
+}
+
+// process lock must be held, returns 1 if priority was raised
+static int boost_process(struct process *process, int prio) {
+    if (prio <= process->pi_prio)
+        return 0;
+
+    set_process_pi_prio(process, prio);
+    return 1;
+}
+
+// Owner that is itself blocked passes inherited priority to owner of the
+// mutex it waits for. Locks are taken one mutex at a time, so the chain may
+// change under the walk and boost may reach process that does not need it
+// anymore. Such boost is dropped when that process unlocks the mutex
+static void propagate_prio(struct process *owner, int prio) {
+    for (int depth = 0; depth < MUTEX_PI_MAX_DEPTH; ++depth) {
+        mutex_t *lock = __atomic_load_n(&owner->blocked_on, __ATOMIC_RELAXED);
+        if (lock == NULL)
+            return;
+
+        cpuflags_t flags = spin_lock_irqsave(&lock->wait_lock);
+        if (owner->blocked_on != lock || prio <= lock->waiters_prio) {
+            spin_unlock_irqrestore(&lock->wait_lock, flags);
+            return;
+        }
+
+        lock->waiters_prio = prio;
+        owner = mutex_owner(lock);
+        spin_lock(&owner->lock);
+        int boosted = boost_process(owner, prio);
+        spin_unlock(&owner->lock);
+        spin_unlock_irqrestore(&lock->wait_lock, flags);
+        if (!boosted)
+            return;
+    }
+}
+
+// wait lock must be held, sets waiters flag unless mutex got free
+static struct process *mark_waiters(mutex_t *lock) {
+    uintptr_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    for (;;) {
+        if (owner == 0) {
+            if (try_acquire(lock))
+                return NULL;
+            owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&lock->owner, &owner,
+                                        owner | MUTEX_FLAG_WAITERS, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return owner_process(owner);
+    }
+}
+
+static void mutex_lock_slow(mutex_t *lock) {
+    struct process *current = get_current();
+    struct mutex_waiter waiter = {.process = current};
+    cpuflags_t flags = spin_lock_irqsave(&lock->wait_lock);
+    // owner does not change while waiters flag is set and wait lock is held
+    struct process *owner = mark_waiters(lock);
+    if (owner == NULL) {
+        spin_unlock_irqrestore(&lock->wait_lock, flags);
+        return;
+    }
+
+    list_add_tail(&waiter.list, &lock->waiters);
+    current->blocked_on = lock;
+    int prio = current->prio;
+    int boosted = 0;
+    spin_lock(&owner->lock);
+    if (list_is_empty(&lock->pi_list))
+        list_add_tail(&lock->pi_list, &owner->pi_mutexes);
+    if (prio > lock->waiters_prio) {
+        lock->waiters_prio = prio;
+        boosted = boost_process(owner, prio);
+    }
+    spin_unlock(&owner->lock);
+    spin_unlock_irqrestore(&lock->wait_lock, flags);
+
+    if (boosted)
+        propagate_prio(owner, prio);
+
+    flags = spin_lock_irqsave(&lock->wait_lock);
+    for (;;) {
+        set_current_state(PROCESS_UNINTERRUPTIBLE);
+        if (waiter.handed)
+            break;
+        spin_unlock_irqrestore(&lock->wait_lock, flags);
+        schedule();
+        flags = spin_lock_irqsave(&lock->wait_lock);
+    }
+    set_current_state(PROCESS_RUNNING);
+    current->blocked_on = NULL;
+    spin_unlock_irqrestore(&lock->wait_lock, flags);
 }
 
 void mutex_lock(mutex_t *lock) {
-    struct process *expected_holder = NULL;
-retry:
-    if (__atomic_compare_exchange_n(&lock->holder, &expected_holder,
-                                    get_current(), 0, __ATOMIC_ACQUIRE,
-                                    __ATOMIC_RELAXED)) {
+    if (try_acquire(lock)) {
+        account(lock, 0);
+        lock_stat_acquired(lock_class_of(lock));
         return;
     }
 
-    struct process *holder = lock->holder;
-    if (holder->state == PROCESS_RUNNING) {
-        spinloop_hint();
-        goto retry;
+    // lock class counts spinning and sleeping as wait cycles, so that
+    // mutexes are ranked together with spinlocks
+    u64 start = lock_stat_wait_begin(lock_class_of(lock));
+    u64 wait_start = sched_clock();
+    if (!spin_on_owner(lock))
+        mutex_lock_slow(lock);
+    account(lock, wait_start);
+    lock_stat_contended(lock_class_of(lock), start,
+                        __builtin_return_address(0));
+}
+
+// wait lock must be held
+static int highest_waiter_prio(mutex_t *lock) {
+    int prio = NO_PI_PRIO;
+    struct mutex_waiter *waiter;
+    list_for_each_entry(waiter, &lock->waiters, list) {
+        if (waiter->process->prio > prio)
+            prio = waiter->process->prio;
     }
 
-    schedule();
-    goto retry;
+    return prio;
+}
+
+// inherited priority is recomputed from mutexes that are still contended
+static void restore_prio(struct process *process) {
+    cpuflags_t flags = spin_lock_irqsave(&process->lock);
+    int prio = NO_PI_PRIO;
+    mutex_t *lock;
+    list_for_each_entry(lock, &process->pi_mutexes, pi_list) {
+        int waiters_prio =
+            __atomic_load_n(&lock->waiters_prio, __ATOMIC_RELAXED);
+        if (waiters_prio > prio)
+            prio = waiters_prio;
+    }
+    if (prio != process->pi_prio)
+        set_process_pi_prio(process, prio);
+    spin_unlock_irqrestore(&process->lock, flags);
 }
 
 void mutex_unlock(mutex_t *lock) {
-    __atomic_compare_exchange_n(&lock->holder, &lock->holder, NULL, 0,
-                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    struct process *current = get_current();
+    expects(mutex_owner(lock) == current);
+
+    uintptr_t owner = (uintptr_t)current;
+    if (__atomic_compare_exchange_n(&lock->owner, &owner, 0, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+
+    cpuflags_t flags = spin_lock_irqsave(&lock->wait_lock);
+    struct mutex_waiter *waiter =
+        list_first_entry(&lock->waiters, struct mutex_waiter, list);
+    struct process *next = waiter->process;
+    list_remove(&waiter->list);
+    lock->waiters_prio = highest_waiter_prio(lock);
+
+    spin_lock(&current->lock);
+    list_remove(&lock->pi_list);
+    init_list_head(&lock->pi_list);
+    spin_unlock(&current->lock);
+
+    uintptr_t next_owner = (uintptr_t)next;
+    if (!list_is_empty(&lock->waiters)) {
+        next_owner |= MUTEX_FLAG_WAITERS;
+        spin_lock(&next->lock);
+        list_add_tail(&lock->pi_list, &next->pi_mutexes);
+        boost_process(next, lock->waiters_prio);
+        spin_unlock(&next->lock);
+    }
+
+    __atomic_store_n(&lock->owner, next_owner, __ATOMIC_RELEASE);
+    waiter->handed = 1;
+    wake_up_process(next);
+    spin_unlock_irqrestore(&lock->wait_lock, flags);
+
+    restore_prio(current);
 }
 
-int mutex_is_locked(mutex_t *lock) {
-    return __atomic_load_n(&lock->holder, __ATOMIC_RELAXED) != NULL;
+void print_mutex_stats(const char *name, const mutex_t *lock) {
+    u64 contended = lock->stats.contended;
+    kprintf("mutex %s: %lu acquisitions, %lu contended, %lu ns average "
+            "wait\n",
+            name, lock->stats.acquisitions, contended,
+            contended ? lock->stats.wait_ns / contended : 0);
+}
+
+#ifdef CONFIG_BENCH
+
+#define BENCH_MUTEX_MSECS 250
+
+static struct {
+    mutex_t lock;
+    u64 shared;
+    u64 end;
+    atomic_t finished;
+    // set once low priority process holds the mutex
+    atomic_t owner_ready;
+    int boosted;
+} bench_mutex_state;
+
+// processes can not exit yet, so finished ones sleep forever
+static void bench_mutex_finish(void) {
+    atomic_inc(&bench_mutex_state.finished);
+    set_current_state(PROCESS_UNINTERRUPTIBLE);
+    schedule();
+}
+
+static void bench_mutex_task(void *arg __unused) {
+    while (get_jiffies() < bench_mutex_state.end) {
+        mutex_lock(&bench_mutex_state.lock);
+        ++bench_mutex_state.shared;
+        mutex_unlock(&bench_mutex_state.lock);
+    }
+    bench_mutex_finish();
+}
+
+// Holds mutex sleeping, so that waiter stops spinning and blocks, until
+// waiter boosts it or benchmark time runs out
+static void bench_pi_owner(void *arg __unused) {
+    struct process *current = get_current();
+    mutex_lock(&bench_mutex_state.lock);
+    atomic_set_release(&bench_mutex_state.owner_ready, 1);
+    while (__atomic_load_n(&current->pi_prio, __ATOMIC_RELAXED) ==
+               NO_PI_PRIO &&
+           get_jiffies() < bench_mutex_state.end)
+        msleep(1);
+    bench_mutex_state.boosted =
+        __atomic_load_n(&current->pi_prio, __ATOMIC_RELAXED) != NO_PI_PRIO;
+    mutex_unlock(&bench_mutex_state.lock);
+    bench_mutex_finish();
+}
+
+static void bench_pi_waiter(void *arg __unused) {
+    mutex_lock(&bench_mutex_state.lock);
+    mutex_unlock(&bench_mutex_state.lock);
+    bench_mutex_finish();
+}
+
+// this runs in idle process, so it gets cpu back only after benchmark
+// processes are done
+static void bench_mutex_wait(int nr) {
+    while (atomic_read(&bench_mutex_state.finished) != nr)
+        wait_for_int();
+}
+
+// Contends one mutex from twice as many processes as there are cpus, then
+// checks that fifo waiter boosts fair owner of the mutex
+void bench_mutex(void) {
+    init_mutex(&bench_mutex_state.lock);
+    set_mutex_class(&bench_mutex_state.lock, "bench mutex");
+    int nr = 2 * get_cpu_count();
+    atomic_set(&bench_mutex_state.finished, 0);
+    u64 start = get_jiffies();
+    bench_mutex_state.end = start + msecs_to_jiffies(BENCH_MUTEX_MSECS);
+    for (int i = 0; i < nr; ++i)
+        launch_process("bench/mutex", bench_mutex_task, NULL);
+    bench_mutex_wait(nr);
+    u64 msecs = jiffies_to_msecs(get_jiffies() - start);
+    kprintf("mutex %d processes: %lu acquisitions/s\n", nr,
+            bench_mutex_state.shared * 1000 / msecs);
+    print_mutex_stats("bench", &bench_mutex_state.lock);
+
+    atomic_set(&bench_mutex_state.finished, 0);
+    atomic_set(&bench_mutex_state.owner_ready, 0);
+    bench_mutex_state.end =
+        get_jiffies() + msecs_to_jiffies(BENCH_MUTEX_MSECS);
+    struct process *owner =
+        launch_process("bench/pi-owner", bench_pi_owner, NULL);
+    if (owner == NULL)
+        return;
+    set_process_policy(owner, SCHED_NORMAL, MAX_NICE);
+    while (!atomic_read_acquire(&bench_mutex_state.owner_ready))
+        wait_for_int();
+
+    struct process *waiter =
+        launch_process("bench/pi-waiter", bench_pi_waiter, NULL);
+    if (waiter == NULL)
+        return;
+    set_process_policy(waiter, SCHED_FIFO, MAX_RT_PRIO - 1);
+    bench_mutex_wait(2);
+    kprintf("mutex priority inheritance: %s\n",
+            bench_mutex_state.boosted ? "owner boosted" : "NOT BOOSTED");
 }
+
+#endif
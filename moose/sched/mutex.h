@@ -1,17 +1,62 @@
+//
+// Sleeping mutex with priority inheritance
+//
 #pragma once
 
-#include <moose/arch/atomic.h>
+#include <moose/list.h>
+#include <moose/sched/locks.h>
+#include <moose/sched/sched.h>
+#include <moose/types.h>
 
-struct process;
+// set in owner word while waiter list is not empty
+#define MUTEX_FLAG_WAITERS 0x1ul
+#define MUTEX_FLAG_MASK 0x1ul
 
+struct mutex_stats {
+    u64 acquisitions;
+    // acquisitions that found mutex locked
+    u64 contended;
+    // nanoseconds spent spinning and sleeping in contended acquisitions
+    u64 wait_ns;
+};
+
+// Locking process spins while owner is running and sleeps otherwise.
+// Sleeping waiters are queued in arrival order and unlock hands mutex
+// directly to the first one, so that it can not be overtaken by spinners.
+// Owner runs with the highest priority of waiters
 typedef struct mutex {
-    struct process *holder;
+    // owning process with MUTEX_FLAG_* in low bits
+    uintptr_t owner;
+    spinlock_t wait_lock;
+    struct list_head waiters;
+    // highest effective priority of waiters, NO_PI_PRIO if there are none
+    int waiters_prio;
+    // entry in list of contended mutexes of owner
+    struct list_head pi_list;
+    struct mutex_stats stats;
+#ifdef CONFIG_LOCK_STAT
+    struct lock_class *class;
+#endif
 } mutex_t;
 
-#define INIT_MUTEX()                                                           \
-    { NULL }
+#define INIT_MUTEX(_name)                                                      \
+    {                                                                          \
+        .wait_lock = INIT_SPIN_LOCK(),                                         \
+        .waiters = INIT_LIST_HEAD((_name).waiters),                            \
+        .waiters_prio = NO_PI_PRIO, .pi_list = INIT_LIST_HEAD((_name).pi_list) \
+    }
 
 void init_mutex(mutex_t *lock);
 void mutex_lock(mutex_t *lock);
+// returns 1 if mutex was taken
+int mutex_trylock(mutex_t *lock);
+// only owner may unlock mutex
 void mutex_unlock(mutex_t *lock);
-int mutex_is_locked(mutex_t *lock);
\ No newline at end of file
+int mutex_is_locked(mutex_t *lock);
+struct process *mutex_owner(mutex_t *lock);
+
+void print_mutex_stats(const char *name, const mutex_t *lock);
+
+#ifdef CONFIG_BENCH
+void bench_mutex(void);
+#endif
@@ -0,0 +1,168 @@
+#include <moose/arch/cpu.h>
+#include <moose/sched/locks.h>
+#include <moose/sched/rcu.h>
+#include <moose/sched/sched.h>
+#include <moose/sched/wait.h>
+
+// callbacks in order of registration, tail points to next field of the
+// last one
+struct rcu_cblist {
+    struct rcu_head *head;
+    struct rcu_head **tail;
+};
+
+#define INIT_RCU_CBLIST(_name)                                                 \
+    { NULL, &(_name).head }
+
+// One grace period is in progress at a time, callbacks registered during
+// it wait for the next one
+static struct {
+    spinlock_t lock;
+    // cpus that did not pass quiescent state in current grace period
+    u64 qs_mask;
+    // cpus sleeping in idle, they are not waited for
+    u64 idle_mask;
+    int gp_active;
+    // waiting for grace period to start
+    struct rcu_cblist next;
+    // waiting for current grace period to end
+    struct rcu_cblist wait;
+    // ready to be called by daemon
+    struct rcu_cblist done;
+    wait_queue_head_t daemon_wait;
+    wait_queue_head_t sync_wait;
+} rcu = {
+    .lock = INIT_SPIN_LOCK(),
+    .next = INIT_RCU_CBLIST(rcu.next),
+    .wait = INIT_RCU_CBLIST(rcu.wait),
+    .done = INIT_RCU_CBLIST(rcu.done),
+    .daemon_wait = INIT_WAIT_QUEUE_HEAD(rcu.daemon_wait),
+    .sync_wait = INIT_WAIT_QUEUE_HEAD(rcu.sync_wait),
+};
+
+static void cblist_append(struct rcu_cblist *list, struct rcu_head *head) {
+    head->next = NULL;
+    *list->tail = head;
+    list->tail = &head->next;
+}
+
+static void cblist_splice(struct rcu_cblist *dst, struct rcu_cblist *src) {
+    if (src->head == NULL)
+        return;
+
+    *dst->tail = src->head;
+    dst->tail = src->tail;
+    src->head = NULL;
+    src->tail = &src->head;
+}
+
+static u64 online_cpus_mask(void) {
+    int count = get_cpu_count();
+    return count == 64 ? ~0ul : (1ul << count) - 1;
+}
+
+static void end_gp(void);
+
+// rcu lock must be held
+static void start_gp(void) {
+    cblist_splice(&rcu.wait, &rcu.next);
+    rcu.gp_active = 1;
+    u64 mask = online_cpus_mask() & ~rcu.idle_mask;
+    __atomic_store_n(&rcu.qs_mask, mask, __ATOMIC_RELAXED);
+    if (mask == 0)
+        end_gp();
+}
+
+// rcu lock must be held
+static void end_gp(void) {
+    rcu.gp_active = 0;
+    cblist_splice(&rcu.done, &rcu.wait);
+    wake_up(&rcu.daemon_wait);
+    if (rcu.next.head)
+        start_gp();
+}
+
+// rcu lock must be held
+static void report_qs(u64 bit) {
+    u64 mask = rcu.qs_mask;
+    if (mask & bit) {
+        __atomic_store_n(&rcu.qs_mask, mask & ~bit, __ATOMIC_RELAXED);
+        if ((mask & ~bit) == 0)
+            end_gp();
+    }
+}
+
+void rcu_note_qs(void) {
+    u64 bit = 1ul << get_cpu_id();
+    if (!(__atomic_load_n(&rcu.qs_mask, __ATOMIC_RELAXED) & bit))
+        return;
+
+    cpuflags_t flags = spin_lock_irqsave(&rcu.lock);
+    report_qs(bit);
+    spin_unlock_irqrestore(&rcu.lock, flags);
+}
+
+void rcu_idle_enter(void) {
+    u64 bit = 1ul << get_cpu_id();
+    cpuflags_t flags = spin_lock_irqsave(&rcu.lock);
+    rcu.idle_mask |= bit;
+    report_qs(bit);
+    spin_unlock_irqrestore(&rcu.lock, flags);
+}
+
+void rcu_idle_exit(void) {
+    u64 bit = 1ul << get_cpu_id();
+    cpuflags_t flags = spin_lock_irqsave(&rcu.lock);
+    rcu.idle_mask &= ~bit;
+    spin_unlock_irqrestore(&rcu.lock, flags);
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    head->func = func;
+    cpuflags_t flags = spin_lock_irqsave(&rcu.lock);
+    cblist_append(&rcu.next, head);
+    if (!rcu.gp_active)
+        start_gp();
+    spin_unlock_irqrestore(&rcu.lock, flags);
+}
+
+struct rcu_sync {
+    struct rcu_head head;
+    int done;
+};
+
+// waiter may return as soon as done is set, so shared queue is woken
+static void finish_sync(struct rcu_head *head) {
+    struct rcu_sync *sync = container_of(head, struct rcu_sync, head);
+    __atomic_store_n(&sync->done, 1, __ATOMIC_RELEASE);
+    wake_up(&rcu.sync_wait);
+}
+
+void synchronize_rcu(void) {
+    struct rcu_sync sync = {.done = 0};
+    call_rcu(&sync.head, finish_sync);
+    wait_event(&rcu.sync_wait, __atomic_load_n(&sync.done, __ATOMIC_ACQUIRE));
+}
+
+static __noreturn void rcu_daemon(void *arg __unused) {
+    for (;;) {
+        wait_event(&rcu.daemon_wait,
+                   __atomic_load_n(&rcu.done.head, __ATOMIC_RELAXED) != NULL);
+
+        cpuflags_t flags = spin_lock_irqsave(&rcu.lock);
+        struct rcu_head *head = rcu.done.head;
+        rcu.done.head = NULL;
+        rcu.done.tail = &rcu.done.head;
+        spin_unlock_irqrestore(&rcu.lock, flags);
+
+        while (head) {
+            struct rcu_head *next = head->next;
+            head->func(head);
+            head = next;
+        }
+    }
+}
+
+void init_rcu(void) {
+    launch_process("rcu", rcu_daemon, NULL);
+}
@@ -0,0 +1,79 @@
+//
+// Read-copy-update
+//
+#pragma once
+
+#include <moose/arch/cpu.h>
+#include <moose/list.h>
+
+// Readers do not take locks, they only must not sleep or be preempted
+// inside of read-side critical section. Memory unlinked by writer is freed
+// after grace period, which ends once every cpu passed quiescent state:
+// context switch or interrupt that came outside of read-side section
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+static inline void rcu_read_lock(void) {
+    preempt_disable();
+    barrier();
+}
+
+static inline void rcu_read_unlock(void) {
+    barrier();
+    preempt_enable();
+}
+
+#define rcu_dereference(_p) __atomic_load_n(&(_p), __ATOMIC_ACQUIRE)
+// initialization of pointed object is visible before the pointer
+#define rcu_assign_pointer(_p, _v)                                             \
+    __atomic_store_n(&(_p), (_v), __ATOMIC_RELEASE)
+
+void init_rcu(void);
+// func is called from process context after grace period
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+// waits for readers that may still see unlinked data, must not be called
+// from read-side section or with interrupts disabled
+void synchronize_rcu(void);
+// called by cpu at points where it can not be in read-side section
+void rcu_note_qs(void);
+// Cpu that sleeps in idle with tick stopped can not report quiescent
+// states, so grace periods do not wait for it until it exits idle. Exit
+// has to come before any read-side section
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
+
+// List operations below may run concurrently with readers that traverse
+// list with list_for_each_entry_rcu, writers still serialize among
+// themselves
+static inline void __list_add_rcu(struct list_head *new,
+                                  struct list_head *prev,
+                                  struct list_head *next) {
+    new->next = next;
+    new->prev = prev;
+    rcu_assign_pointer(prev->next, new);
+    next->prev = new;
+}
+
+static inline void list_add_rcu(struct list_head *new, struct list_head *head) {
+    __list_add_rcu(new, head, head->next);
+}
+
+static inline void list_add_tail_rcu(struct list_head *new,
+                                     struct list_head *head) {
+    __list_add_rcu(new, head->prev, head);
+}
+
+// removed entry keeps its next pointer so that readers standing on it can
+// continue, it can be reused only after grace period
+static inline void list_remove_rcu(struct list_head *it) {
+    list_remove(it);
+}
+
+#define list_for_each_entry_rcu(_iter, _head, _member)                         \
+    for ((_iter) = list_entry(rcu_dereference((_head)->next),                  \
+                              typeof(*(_iter)), _member);                      \
+         !list_entry_is_head(_iter, _head, _member);                           \
+         (_iter) = list_entry(rcu_dereference((_iter)->_member.next),          \
+                              typeof(*(_iter)), _member))
@@ -2,34 +2,87 @@
 
 #include <moose/bitops.h>
 #include <moose/list.h>
+#include <moose/param.h>
+#include <moose/rbtree.h>
 #include <moose/sched/locks.h>
 
 #define MAX_PROCESSES 256
 #define PROCESS_MAX_FILES 256
 #define PROCESS_STACK_SIZE (4096 * 4)
-#define DEFAULT_TIMESLICE 1
 
 #define MAX_NICE 19
 #define MIN_NICE (-20)
-#define MAX_PRIO 39
 #define DEFAULT_NICE 0
+#define NICE_WIDTH (MAX_NICE - MIN_NICE + 1)
+// fifo priorities are in range [0, MAX_RT_PRIO), higher runs first
+#define MAX_RT_PRIO 64
+// Effective priorities are comparable across classes, higher runs first.
+// Fair processes take [0, NICE_WIDTH) by nice value, fifo ones follow them
+#define NICE_TO_PRIO(_nice) (MAX_NICE - (_nice))
+#define RT_TO_PRIO(_rt_prio) (NICE_WIDTH + (_rt_prio))
+#define NO_PI_PRIO (-1)
+
+// default fair class tunables
+#define SCHED_LATENCY_NS 6000000ul
+#define SCHED_MIN_GRANULARITY_NS 750000ul
+#define SCHED_WAKEUP_GRANULARITY_NS 1000000ul
+
+enum sched_policy {
+    // fair share of cpu weighted by nice value
+    SCHED_NORMAL,
+    // runs until it sleeps or yields, preempted only by higher priority
+    SCHED_FIFO
+};
 
-#define prio_to_nice(_prio) ((int)(_prio)-20)
-#define nice_to_prio(_nice) (u32)((int)(_nice) + 20)
+// Runnable fair processes ordered by virtual runtime
+struct fair_rq {
+    struct rb_node *root;
+    struct rb_node *leftmost;
+    // monotonic lower bound of vruntime of queued and running processes
+    u64 min_vruntime;
+    // sum of weights of queued processes
+    u64 load;
+    u32 nr_queued;
+    // yielding process that should not be picked next if possible
+    struct process *skip;
+};
 
-struct runqueue {
-    bitmap_t bitmap[BITS_TO_BITMAP(MAX_PRIO)];
-    struct list_head ranks[MAX_PRIO];
+struct fifo_rq {
+    // bit is set for every non-empty priority
+    u64 bitmap;
+    struct list_head ranks[MAX_RT_PRIO];
 };
 
+static_assert(MAX_RT_PRIO <= BITMAP_STRIDE);
+
+// Every cpu has its own runqueue that holds only runnable processes waiting
+// for the cpu. Running process and idle process of the cpu are not queued,
+// sleeping processes are not in any runqueue
+struct runqueue {
+    spinlock_t lock;
+    // queued processes, read without lock by other cpus when choosing where
+    // to place or steal from
+    atomic_t nr_running;
+    u64 nr_switches;
+    // sched_clock value at last update
+    u64 clock;
+    struct process *curr;
+    struct process *idle;
+
+    struct fifo_rq fifo;
+    struct fair_rq fair;
+} __aligned(CACHE_LINE_SIZE);
+
+// lock protects pid bitmap and process list, runqueues have their own locks
 struct scheduler {
     bitmap_t pid_bitmap[BITS_TO_BITMAP(MAX_PROCESSES)];
-    struct runqueue rq;
 
     struct list_head process_list;
     spinlock_t lock;
 };
 
+// running state means that process is runnable, it is either on cpu or
+// queued. Interruptible and uninterruptible processes are sleeping
 enum process_state {
     PROCESS_RUNNING,
     PROCESS_INTERRUPTIBLE,
@@ -38,6 +91,11 @@ enum process_state {
     PROCESS_ZOMBIE
 };
 
+// process is idle loop of its cpu, it is never migrated
+#define PROCESS_IDLE 0x1
+
+struct mutex;
+
 struct process_info {
     struct process *p;
 };
@@ -50,14 +108,36 @@ union process_stack {
 struct process {
     struct registers_state execution_state;
     int nice;
-    u32 timeslice;
-    u32 prio;
-
-    u64 timeslice_start_jiffies;
+    enum sched_policy policy;
+    // priority of fifo process
+    u32 rt_prio;
+    // Effective priority, it is the one given by policy unless process
+    // inherited higher one from waiters of mutexes it holds. Class and
+    // weight follow it
+    int prio;
+    int pi_prio;
+    const struct sched_class *class;
+
+    // weight derived from effective priority
+    u32 weight;
+    // runtime scaled by inverse of weight, while process is outside of
+    // fair runqueue it is relative to min_vruntime of the queue it left
+    u64 vruntime;
+    u64 exec_start;
+    u64 sum_exec_runtime;
+    // sum_exec_runtime when process was picked to run
+    u64 prev_sum_exec_runtime;
 
     const char *name;
 
     enum process_state state;
+    u32 flags;
+    // cpu process was last placed on, -1 if it was not placed yet
+    int cpu;
+    // set while process executes or its context is not saved yet
+    int on_cpu;
+    // set while process is queued in runqueue
+    int on_rq;
     pid_t pid;
     pid_t ppid;
     mode_t umask;
@@ -65,13 +145,57 @@ struct process {
 
     struct list_head list;
     struct list_head sched_list;
+    struct rb_node sched_node;
+
+    // contended mutexes held by process, protected by process lock
+    struct list_head pi_mutexes;
+    // mutex process sleeps on
+    struct mutex *blocked_on;
 
     union process_stack *stack;
     spinlock_t lock;
 };
 
 void init_scheduler(void);
-void launch_process(const char *name, void (*function)(void *), void *arg);
+// creates process that represents idle loop of application processor, its
+// stack is used as initial stack of the cpu
+struct process *create_idle_process(int cpu);
+struct process *launch_process(const char *name, void (*function)(void *),
+                               void *arg);
 void switch_process(struct process *from, struct process *to);
+// switches to next process if current one used its slice, is preempted by
+// another one or is no longer in running state
 void schedule(void);
+// lets other processes of the same class run before current one
+void yield(void);
+// called on every tick, wakes idle cpu if processes wait on this one
+void balance_tick(void);
+// makes sleeping process runnable, returns 0 if it was runnable already
+int wake_up_process(struct process *process);
+
+// state is stored with full barrier so that condition checked afterwards
+// is not read before the state is visible to wakers
+static inline void set_current_state(enum process_state state) {
+    __atomic_store_n(&get_current()->state, state, __ATOMIC_SEQ_CST);
+}
 void exit_current(void);
+
+// prio is nice value for SCHED_NORMAL and priority for SCHED_FIFO, returns
+// -EINVAL if it is out of range
+int set_process_policy(struct process *process, enum sched_policy policy,
+                       int prio);
+// sets priority inherited by process, it runs with the higher of inherited
+// and its own one. NO_PI_PRIO drops inherited priority
+void set_process_pi_prio(struct process *process, int prio);
+// latency is period in which every runnable fair process should run once,
+// it is stretched when more than latency / min_granularity processes are
+// runnable. Returns -EINVAL if values are inconsistent
+int set_sched_latency(u64 latency_ns, u64 min_granularity_ns,
+                      u64 wakeup_granularity_ns);
+
+// prints stack high-water mark of every process
+void print_process_stacks(void);
+
+#ifdef CONFIG_BENCH
+void bench_scheduler(void);
+#endif
@@ -0,0 +1,43 @@
+//
+// Scheduling classes, used only by the scheduler core
+//
+#pragma once
+
+#include <moose/sched/sched.h>
+
+// process was sleeping, enqueue may credit it for time it slept
+#define ENQUEUE_WAKEUP 0x1
+// current process gives cpu away voluntarily
+#define PUT_YIELD 0x1
+
+// All callbacks are called with runqueue lock held. Processes outside of
+// class queue keep their class state in a form that does not depend on
+// runqueue, so that they can be enqueued on any cpu
+struct sched_class {
+    void (*init_rq)(struct runqueue *rq);
+    void (*enqueue)(struct runqueue *rq, struct process *process, int flags);
+    void (*dequeue)(struct runqueue *rq, struct process *process);
+    // removes process that should run next from the queue, returns NULL if
+    // queue is empty
+    struct process *(*pick_next)(struct runqueue *rq);
+    // current process stops running, it is requeued if it is runnable
+    void (*put_prev)(struct runqueue *rq, struct process *process, int flags);
+    // charges current process for time it ran since the last update
+    void (*update_curr)(struct runqueue *rq, struct process *curr);
+    // returns nonzero if current process should give cpu to queued one
+    int (*check_preempt)(struct runqueue *rq, struct process *curr);
+    // returns nonzero if woken process should preempt current one of the
+    // same class
+    int (*wakeup_preempt)(struct runqueue *rq, struct process *curr,
+                          struct process *woken);
+    // returns queued process that may be migrated to another cpu
+    struct process *(*find_stealable)(struct runqueue *rq);
+    // process starts or stops belonging to this class while running
+    void (*attach_curr)(struct runqueue *rq, struct process *curr);
+    void (*detach_curr)(struct runqueue *rq, struct process *curr);
+};
+
+extern const struct sched_class fifo_sched_class;
+extern const struct sched_class fair_sched_class;
+
+u32 nice_to_weight(int nice);
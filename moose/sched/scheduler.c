@@ -1,16 +1,29 @@
+#include <moose/arch/cpu.h>
 #include <moose/arch/jiffies.h>
 #include <moose/assert.h>
+#include <moose/errno.h>
+#include <moose/kstdio.h>
 #include <moose/mm/kmalloc.h>
 #include <moose/param.h>
+#include <moose/sched/lock_stat.h>
+#include <moose/sched/rcu.h>
 #include <moose/sched/sched.h>
+#include <moose/sched/sched_class.h>
+#include <moose/sched/stack.h>
 #include <moose/string.h>
 
 struct process idle_process = {
-    .name = "idle", .umask = 0666, .lock = INIT_SPIN_LOCK()};
+    .name = "idle",
+    .umask = 0666,
+    .flags = PROCESS_IDLE,
+    .pi_prio = NO_PI_PRIO,
+    .pi_mutexes = INIT_LIST_HEAD(idle_process.pi_mutexes),
+    .lock = INIT_SPIN_LOCK()};
 static struct scheduler scheduler_ = {
     .lock = INIT_SPIN_LOCK(),
     .process_list = INIT_LIST_HEAD(scheduler_.process_list)};
 static struct scheduler *__scheduler = &scheduler_;
+static struct runqueue runqueues[MAX_CPUS];
 
 static pid_t alloc_pid(struct scheduler *scheduler) {
     u64 bit = bitmap_first_set(scheduler->pid_bitmap, MAX_PROCESSES);
@@ -29,52 +42,295 @@ __used static void free_pid(struct scheduler *scheduler, pid_t pid) {
     clear_bit(pid, scheduler->pid_bitmap);
 }
 
+static struct runqueue *this_rq(void) {
+    return runqueues + get_cpu_id();
+}
+
+// classes in order of precedence
+static const struct sched_class *const sched_classes[] = {
+    &fifo_sched_class,
+    &fair_sched_class,
+};
+
+static void update_rq_clock(struct runqueue *rq) {
+    rq->clock = sched_clock();
+}
+
+// Process cpu changes only under lock of the runqueue it leaves, so once
+// lock of its current runqueue is taken process stays there
+static struct runqueue *lock_process_rq(struct process *process) {
+    for (;;) {
+        int cpu = __atomic_load_n(&process->cpu, __ATOMIC_RELAXED);
+        struct runqueue *rq = runqueues + cpu;
+        spin_lock(&rq->lock);
+        if (process->cpu == cpu)
+            return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+// rq lock must be held
+static void enqueue_process(struct runqueue *rq, struct process *process,
+                            int flags) {
+    process->class->enqueue(rq, process, flags);
+    process->cpu = rq - runqueues;
+    process->on_rq = 1;
+    atomic_inc(&rq->nr_running);
+}
+
+// rq lock must be held
+static void dequeue_process(struct runqueue *rq, struct process *process) {
+    process->class->dequeue(rq, process);
+    process->on_rq = 0;
+    atomic_dec(&rq->nr_running);
+}
+
+static u32 rq_load(int cpu) {
+    struct runqueue *rq = runqueues + cpu;
+    return atomic_read(&rq->nr_running) + (rq->curr != rq->idle);
+}
+
+// Least loaded cpu is chosen, but cpu process ran on last time is kept
+// unless it has noticeably more work because caches are likely still warm
+static int select_cpu(const struct process *process) {
+    int best = get_cpu_id();
+    u32 best_load = rq_load(best);
+    for (int cpu = 0; cpu < get_cpu_count(); ++cpu) {
+        u32 load = rq_load(cpu);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+
+    if (process->cpu >= 0 && rq_load(process->cpu) <= best_load + 1)
+        return process->cpu;
+
+    return best;
+}
+
+static void resched_rq(struct runqueue *rq) {
+    if (rq == this_rq())
+        set_invoke_scheduler_async();
+    else
+        send_reschedule(rq - runqueues);
+}
+
+// fifo class is the only one above another class
+static int class_above(const struct sched_class *a,
+                       const struct sched_class *b) {
+    return a == &fifo_sched_class && b != &fifo_sched_class;
+}
+
+static void check_preempt_wakeup(struct runqueue *rq, struct process *woken) {
+    struct process *curr = rq->curr;
+    if (curr == rq->idle || class_above(woken->class, curr->class)) {
+        resched_rq(rq);
+    } else if (woken->class == curr->class) {
+        curr->class->update_curr(rq, curr);
+        if (curr->class->wakeup_preempt(rq, curr, woken))
+            resched_rq(rq);
+    }
+}
+
+static int base_prio(const struct process *process) {
+    if (process->policy == SCHED_FIFO)
+        return RT_TO_PRIO(process->rt_prio);
+    return NICE_TO_PRIO(process->nice);
+}
+
+// fair process that inherited fifo priority runs in fifo class
+static void update_prio(struct process *process) {
+    int prio = base_prio(process);
+    if (process->pi_prio > prio)
+        prio = process->pi_prio;
+
+    process->prio = prio;
+    if (prio >= NICE_WIDTH) {
+        process->class = &fifo_sched_class;
+    } else {
+        process->class = &fair_sched_class;
+        process->weight = nice_to_weight(MAX_NICE - prio);
+    }
+}
+
 static void init_idle_stack(void) {
     u64 stack_base_address =
         FIXUP_ADDR(KERNEL_INITIAL_STACK - sizeof(union process_stack));
     idle_process.stack = (void *)stack_base_address;
     idle_process.stack->info.p = &idle_process;
     idle_process.nice = DEFAULT_NICE;
-    idle_process.prio = nice_to_prio(idle_process.nice);
     idle_process.state = PROCESS_RUNNING;
-    list_add_tail(&idle_process.sched_list,
-                  __scheduler->rq.ranks + idle_process.prio);
+    idle_process.on_cpu = 1;
+    runqueues->curr = &idle_process;
+    runqueues->idle = &idle_process;
     list_add(&idle_process.list, &__scheduler->process_list);
 }
 
-static void init_rq(void) {
-    for (size_t i = 0; i < ARRAY_SIZE(__scheduler->rq.ranks); ++i)
-        init_list_head(__scheduler->rq.ranks + i);
+static void init_runqueues(void) {
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        struct runqueue *rq = runqueues + cpu;
+        init_spin_lock(&rq->lock);
+        set_spin_lock_class(&rq->lock, "runqueue");
+        for (size_t i = 0; i < ARRAY_SIZE(sched_classes); ++i)
+            sched_classes[i]->init_rq(rq);
+    }
 }
 
 void init_scheduler(void) {
-    init_rq();
+    set_spin_lock_class(&__scheduler->lock, "scheduler");
+    init_runqueues();
     memset(__scheduler->pid_bitmap, 0xff, sizeof(__scheduler->pid_bitmap));
     clear_bit(0, __scheduler->pid_bitmap);
     init_idle_stack();
 }
 
-void launch_process(const char *name, void (*function)(void *), void *arg) {
+struct process *create_idle_process(int cpu) {
+    expects(cpu < MAX_CPUS);
+    struct process *process = kzalloc(sizeof(*process));
+    if (process == NULL)
+        return NULL;
+
+    char name[16];
+    snprintf(name, sizeof(name), "idle/%d", cpu);
+    process->name = kstrdup(name);
+    process->stack = alloc_process_stack();
+    if (process->name == NULL || process->stack == NULL) {
+        if (process->stack)
+            free_process_stack(process->stack);
+        kfree((void *)process->name);
+        kfree(process);
+        return NULL;
+    }
+
+    process->stack->info.p = process;
+    process->nice = DEFAULT_NICE;
+    process->pi_prio = NO_PI_PRIO;
+    init_list_head(&process->pi_mutexes);
+    process->flags = PROCESS_IDLE;
+    process->cpu = cpu;
+    // idle process starts running as soon as its cpu is started
+    process->state = PROCESS_RUNNING;
+    process->on_cpu = 1;
+
+    cpuflags_t flags = spin_lock_irqsave(&__scheduler->lock);
+    process->pid = alloc_pid(__scheduler);
+    list_add(&process->list, &__scheduler->process_list);
+    spin_unlock(&__scheduler->lock);
+
+    struct runqueue *rq = runqueues + cpu;
+    spin_lock(&rq->lock);
+    rq->curr = process;
+    rq->idle = process;
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    return process;
+}
+
+struct process *launch_process(const char *name, void (*function)(void *),
+                               void *arg) {
     struct process *process = kzalloc(sizeof(*process));
     expects(process);
-    process->stack = kzalloc(sizeof(*process->stack));
+    process->stack = alloc_process_stack();
     expects(process->stack);
     process->name = kstrdup(name);
     expects(process->name);
     init_process_registers(&process->execution_state, function, arg,
                            (u64)((process->stack) + 1));
     process->stack->info.p = process;
-    process->pid = alloc_pid(__scheduler);
     process->nice = DEFAULT_NICE;
-    process->timeslice = DEFAULT_TIMESLICE;
-    process->prio = nice_to_prio(process->nice);
-    process->state = PROCESS_INTERRUPTIBLE;
+    process->policy = SCHED_NORMAL;
+    process->pi_prio = NO_PI_PRIO;
+    update_prio(process);
+    init_list_head(&process->pi_mutexes);
+    process->cpu = -1;
+    process->state = PROCESS_RUNNING;
 
     cpuflags_t flags = spin_lock_irqsave(&__scheduler->lock);
-    list_add_tail(&process->sched_list, __scheduler->rq.ranks + process->prio);
-    set_bit(process->prio, __scheduler->rq.bitmap);
+    process->pid = alloc_pid(__scheduler);
     list_add(&process->list, &__scheduler->process_list);
-    spin_unlock_irqrestore(&__scheduler->lock, flags);
+    spin_unlock(&__scheduler->lock);
+
+    struct runqueue *rq = runqueues + select_cpu(process);
+    spin_lock(&rq->lock);
+    update_rq_clock(rq);
+    enqueue_process(rq, process, 0);
+    check_preempt_wakeup(rq, process);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    return process;
+}
+
+// Process leaves its queue and class while its priority changes and is put
+// back according to the new one
+struct prio_change {
+    struct runqueue *rq;
+    cpuflags_t flags;
+    int queued;
+    int running;
+};
+
+static void begin_prio_change(struct process *process,
+                              struct prio_change *change) {
+    change->flags = irq_save();
+    struct runqueue *rq = lock_process_rq(process);
+    update_rq_clock(rq);
+    change->rq = rq;
+    change->queued = process->on_rq;
+    change->running = rq->curr == process;
+    if (change->queued)
+        dequeue_process(rq, process);
+    if (change->running)
+        process->class->detach_curr(rq, process);
+}
+
+static void end_prio_change(struct process *process,
+                            struct prio_change *change) {
+    struct runqueue *rq = change->rq;
+    update_prio(process);
+    if (change->queued) {
+        enqueue_process(rq, process, 0);
+        check_preempt_wakeup(rq, process);
+    }
+    if (change->running) {
+        process->class->attach_curr(rq, process);
+        resched_rq(rq);
+    }
+    spin_unlock_irqrestore(&rq->lock, change->flags);
+}
+
+int set_process_policy(struct process *process, enum sched_policy policy,
+                       int prio) {
+    if (process->flags & PROCESS_IDLE)
+        return -EINVAL;
+    if (policy == SCHED_FIFO && (prio < 0 || prio >= MAX_RT_PRIO))
+        return -EINVAL;
+    if (policy == SCHED_NORMAL && (prio < MIN_NICE || prio > MAX_NICE))
+        return -EINVAL;
+    if (policy != SCHED_FIFO && policy != SCHED_NORMAL)
+        return -EINVAL;
+
+    struct prio_change change;
+    begin_prio_change(process, &change);
+    process->policy = policy;
+    if (policy == SCHED_FIFO)
+        process->rt_prio = prio;
+    else
+        process->nice = prio;
+    end_prio_change(process, &change);
+
+    return 0;
+}
+
+// idle process runs only when nothing else can, so it has nothing to gain
+void set_process_pi_prio(struct process *process, int prio) {
+    if (process->flags & PROCESS_IDLE)
+        return;
+
+    struct prio_change change;
+    begin_prio_change(process, &change);
+    process->pi_prio = prio;
+    end_prio_change(process, &change);
 }
 
 static void context_switch(struct process *from, struct process *to) {
@@ -82,70 +338,259 @@ static void context_switch(struct process *from, struct process *to) {
     switch_process(from, to);
 }
 
-static int update_current(struct process *current) {
-    expects(current->state == PROCESS_RUNNING);
-    u64 jiffies = get_jiffies();
-    u64 expired = jiffies - current->timeslice_start_jiffies;
-    if (expired > current->timeslice) {
-        u32 old_prio = current->prio;
-        if (__unlikely(current->prio == MAX_PRIO)) {
-            current->prio = nice_to_prio(current->nice);
-            ++current->timeslice;
-        } else {
-            ++current->prio;
+static int need_resched(struct runqueue *rq, struct process *curr) {
+    if (curr->class != &fifo_sched_class && rq->fifo.bitmap)
+        return 1;
+    return curr->class->check_preempt(rq, curr);
+}
+
+static struct process *pick_next_process(struct runqueue *rq) {
+    for (size_t i = 0; i < ARRAY_SIZE(sched_classes); ++i) {
+        struct process *next = sched_classes[i]->pick_next(rq);
+        if (next) {
+            next->on_rq = 0;
+            atomic_dec(&rq->nr_running);
+            return next;
         }
+    }
 
-        list_remove(&current->sched_list);
-        if (list_is_empty(__scheduler->rq.ranks + old_prio))
-            clear_bit(old_prio, __scheduler->rq.bitmap);
-        list_add_tail(&current->sched_list,
-                      __scheduler->rq.ranks + current->prio);
-        set_bit(current->prio, __scheduler->rq.bitmap);
+    return rq->idle;
+}
 
-        return 1;
+static struct runqueue *find_busiest_rq(struct runqueue *this) {
+    struct runqueue *busiest = NULL;
+    u32 busiest_load = 0;
+    for (int cpu = 0; cpu < get_cpu_count(); ++cpu) {
+        struct runqueue *rq = runqueues + cpu;
+        u32 load = atomic_read(&rq->nr_running);
+        if (rq != this && load > busiest_load) {
+            busiest = rq;
+            busiest_load = load;
+        }
     }
 
-    return 0;
+    return busiest;
 }
 
-static struct process *pick_next_process(void) {
-    u32 first_set = bitmap_first_set(__scheduler->rq.bitmap, MAX_PRIO);
-    expects(first_set);
-    --first_set;
-
-    for (; first_set <= MAX_PRIO; ++first_set) {
-        struct list_head *rank = __scheduler->rq.ranks + first_set;
-        struct process *candidate;
-        list_for_each_entry(candidate, rank, list) {
-            if (candidate->state == PROCESS_INTERRUPTIBLE) {
-                return candidate;
-            } else if (candidate->state == PROCESS_UNINTERRUPTIBLE) {
-                expects(!"todo");
-            }
+// Pulls queued process from the busiest cpu to this one. Only one runqueue
+// lock is held at a time, stolen process is in no runqueue while it is
+// moved but stays in running state so that wakeups leave it alone.
+// Processes whose context is still being saved are skipped
+static void steal_process(struct runqueue *this) {
+    struct runqueue *busiest = find_busiest_rq(this);
+    if (busiest == NULL)
+        return;
+
+    struct process *stolen = NULL;
+    spin_lock(&busiest->lock);
+    for (size_t i = 0; i < ARRAY_SIZE(sched_classes) && !stolen; ++i)
+        stolen = sched_classes[i]->find_stealable(busiest);
+    if (stolen) {
+        dequeue_process(busiest, stolen);
+        stolen->cpu = this - runqueues;
+    }
+    spin_unlock(&busiest->lock);
+    if (stolen == NULL)
+        return;
+
+    spin_lock(&this->lock);
+    update_rq_clock(this);
+    enqueue_process(this, stolen, 0);
+    spin_unlock(&this->lock);
+}
+
+static int rq_is_idle(struct runqueue *rq) {
+    return __atomic_load_n(&rq->curr, __ATOMIC_RELAXED) == rq->idle &&
+           atomic_read(&rq->nr_running) == 0;
+}
+
+// Idle cpu stops its tick and steals only when it schedules, so cpu that
+// has processes waiting wakes one of idle cpus to pull from it
+void balance_tick(void) {
+    struct runqueue *this = this_rq();
+    if (atomic_read(&this->nr_running) == 0)
+        return;
+
+    for (int cpu = 0; cpu < get_cpu_count(); ++cpu) {
+        struct runqueue *rq = runqueues + cpu;
+        if (rq != this && rq_is_idle(rq)) {
+            send_reschedule(cpu);
+            return;
+        }
+    }
+}
+
+static void __schedule(int yield) {
+    struct process *prev = get_current();
+    struct runqueue *rq = this_rq();
+    // process must not sleep in rcu read-side section
+    expects(get_preempt_count() == 0);
+    // switch_to enables interrupts unconditionally on the new stack
+    expects(!irqs_disabled());
+    rcu_note_qs();
+
+    cpuflags_t flags = irq_save();
+    // cpu that would switch to idle tries to find work on other cpus first
+    int going_idle = prev == rq->idle || prev->state != PROCESS_RUNNING;
+    if (going_idle && atomic_read(&rq->nr_running) == 0)
+        steal_process(rq);
+
+    spin_lock(&rq->lock);
+    update_rq_clock(rq);
+    if (prev == rq->idle) {
+        if (atomic_read(&rq->nr_running) == 0)
+            goto out;
+    } else {
+        int runnable = prev->state == PROCESS_RUNNING;
+        prev->class->update_curr(rq, prev);
+        if (runnable && !yield && !need_resched(rq, prev))
+            goto out;
+        // nothing else to run, so new slice starts right away
+        if (runnable && atomic_read(&rq->nr_running) == 0) {
+            prev->prev_sum_exec_runtime = prev->sum_exec_runtime;
+            goto out;
+        }
+
+        prev->class->put_prev(rq, prev, yield ? PUT_YIELD : 0);
+        if (runnable) {
+            prev->on_rq = 1;
+            atomic_inc(&rq->nr_running);
         }
     }
 
-    return get_current();
+    struct process *next = pick_next_process(rq);
+    // yielding process may still be the best one to run
+    if (next == prev)
+        goto out;
+    next->on_cpu = 1;
+    rq->curr = next;
+    ++rq->nr_switches;
+    spin_unlock(&rq->lock);
+    // interrupts stay disabled until switch_to, otherwise interrupt in
+    // between would schedule from prev while rq->curr is already next
+    context_switch(prev, next);
+    return;
+
+out:
+    spin_unlock_irqrestore(&rq->lock, flags);
 }
 
 void schedule(void) {
-    struct process *current = get_current();
+    __schedule(0);
+}
 
-    if (!update_current(current))
-        return;
+void yield(void) {
+    __schedule(1);
+}
 
-    cpuflags_t flags = spin_lock_irqsave(&__scheduler->lock);
-    struct process *new_process = pick_next_process();
-    spin_unlock_irqrestore(&__scheduler->lock, flags);
-    if (current != new_process)
-        context_switch(current, new_process);
+int wake_up_process(struct process *process) {
+    expects(process->cpu >= 0);
+    cpuflags_t flags = irq_save();
+    struct runqueue *rq = lock_process_rq(process);
+    if (process->state == PROCESS_RUNNING) {
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return 0;
+    }
+
+    process->state = PROCESS_RUNNING;
+    // process that is still switching away from its cpu can only be queued
+    // there, that cpu does not pick it before its context is saved. If it
+    // did not get to switching yet, changing its state is enough
+    if (__atomic_load_n(&process->on_cpu, __ATOMIC_ACQUIRE)) {
+        if (rq->curr != process) {
+            update_rq_clock(rq);
+            enqueue_process(rq, process, ENQUEUE_WAKEUP);
+            check_preempt_wakeup(rq, process);
+        }
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return 1;
+    }
+
+    int cpu = select_cpu(process);
+    process->cpu = cpu;
+    spin_unlock(&rq->lock);
+
+    rq = runqueues + cpu;
+    spin_lock(&rq->lock);
+    update_rq_clock(rq);
+    enqueue_process(rq, process, ENQUEUE_WAKEUP);
+    check_preempt_wakeup(rq, process);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return 1;
 }
 
 // called from switch_process to finalize switching after stack and pc
-// have been changed
+// have been changed. It runs on stack of next process with interrupts
+// disabled by __schedule
 void switch_to(struct process *from, struct process *to) {
-    from->state = PROCESS_INTERRUPTIBLE;
-    to->state = PROCESS_RUNNING;
+    __atomic_store_n(&from->on_cpu, 0, __ATOMIC_RELEASE);
     set_current(to);
-    to->timeslice_start_jiffies = get_jiffies();
+    irq_enable();
+}
+
+void print_process_stacks(void) {
+    kprintf("%5s %-16s %8s %8s\n", "pid", "name", "used", "size");
+    cpuflags_t flags = spin_lock_irqsave(&__scheduler->lock);
+    struct process *process;
+    list_for_each_entry(process, &__scheduler->process_list, list) {
+        // idle runs on boot stack which is not poisoned
+        if (process == &idle_process)
+            continue;
+        kprintf("%5u %-16s %8lu %8u\n", process->pid, process->name,
+                get_stack_usage(process->stack), PROCESS_STACK_SIZE);
+    }
+    spin_unlock_irqrestore(&__scheduler->lock, flags);
 }
+
+#ifdef CONFIG_BENCH
+
+#define BENCH_SCHED_MSECS 1000
+
+static u64 bench_sched_end;
+
+// processes can not exit yet, so finished ones sleep forever
+static void bench_finish(void) {
+    set_current_state(PROCESS_UNINTERRUPTIBLE);
+    schedule();
+}
+
+static void bench_spin_task(void *arg __unused) {
+    while (get_jiffies() < bench_sched_end)
+        spinloop_hint();
+    bench_finish();
+}
+
+static void bench_yield_task(void *arg __unused) {
+    while (get_jiffies() < bench_sched_end)
+        yield();
+    bench_finish();
+}
+
+// runs cpu count of cpu-bound and yielding processes and reports context
+// switch rate of every cpu
+void bench_scheduler(void) {
+    int ncpus = get_cpu_count();
+    u64 switches[MAX_CPUS];
+
+    for (int cpu = 0; cpu < ncpus; ++cpu)
+        switches[cpu] = runqueues[cpu].nr_switches;
+    u64 start = get_jiffies();
+    bench_sched_end = start + msecs_to_jiffies(BENCH_SCHED_MSECS);
+    for (int i = 0; i < ncpus; ++i) {
+        launch_process("bench/spin", bench_spin_task, NULL);
+        launch_process("bench/yield", bench_yield_task, NULL);
+    }
+
+    // this runs in idle process, so it gets cpu back only after benchmark
+    // processes are done
+    while (get_jiffies() < bench_sched_end)
+        wait_for_int();
+    u64 msecs = jiffies_to_msecs(get_jiffies() - start);
+
+    for (int cpu = 0; cpu < ncpus; ++cpu) {
+        u64 count = runqueues[cpu].nr_switches - switches[cpu];
+        kprintf("sched cpu %d: %lu switches/s\n", cpu, count * 1000 / msecs);
+    }
+}
+
+#endif
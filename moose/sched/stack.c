@@ -0,0 +1,159 @@
+#include <moose/arch/amd64/virtmem.h>
+#include <moose/assert.h>
+#include <moose/bitops.h>
+#include <moose/mm/shrinker.h>
+#include <moose/sched/locks.h>
+#include <moose/sched/stack.h>
+
+#define STACK_PAGE_COUNT (PROCESS_STACK_SIZE >> PAGE_SIZE_BITS)
+#define STACK_WORD_COUNT (PROCESS_STACK_SIZE / sizeof(u64))
+// first word after process_info that is poisoned
+#define STACK_FIRST_WORD (sizeof(struct process_info) / sizeof(u64))
+
+static_assert(STACK_POOL_SLOTS * STACK_SLOT_SIZE <=
+              STACK_VIRTUAL_END - STACK_VIRTUAL_BASE);
+
+// Freed stack kept mapped in cache, lives at the bottom of the stack itself
+// in place of process_info so that poisoned part is left intact
+struct cached_stack {
+    struct cached_stack *next;
+};
+
+static_assert(sizeof(struct cached_stack) <= sizeof(struct process_info));
+
+static struct {
+    // set bits are free slots
+    bitmap_t free_slots[BITS_TO_BITMAP(STACK_POOL_SLOTS)];
+    struct cached_stack *cached;
+    size_t cached_count;
+    spinlock_t lock;
+} stack_pool = {.lock = INIT_SPIN_LOCK()};
+
+static u64 slot_to_stack(u64 slot) {
+    return STACK_VIRTUAL_BASE + slot * STACK_SLOT_SIZE + PAGE_SIZE;
+}
+
+static u64 stack_to_slot(u64 stack) {
+    return (stack - STACK_VIRTUAL_BASE) / STACK_SLOT_SIZE;
+}
+
+static void poison_stack(u64 *stack, size_t from) {
+    for (size_t i = from; i < STACK_WORD_COUNT; ++i)
+        stack[i] = STACK_POISON;
+}
+
+// returns index of the lowest word that was written to
+static size_t find_stack_low_mark(const u64 *stack) {
+    size_t i = STACK_FIRST_WORD;
+    while (i < STACK_WORD_COUNT && stack[i] == STACK_POISON)
+        ++i;
+    return i;
+}
+
+static union process_stack *map_stack_slot(void) {
+    cpuflags_t flags = spin_lock_irqsave(&stack_pool.lock);
+    u64 slot = bitmap_first_set(stack_pool.free_slots, STACK_POOL_SLOTS);
+    if (slot == 0) {
+        spin_unlock_irqrestore(&stack_pool.lock, flags);
+        return NULL;
+    }
+
+    clear_bit(--slot, stack_pool.free_slots);
+    spin_unlock_irqrestore(&stack_pool.lock, flags);
+
+    u64 stack = slot_to_stack(slot);
+    if (alloc_virtual_pages(stack, STACK_PAGE_COUNT)) {
+        free_virtual_pages(stack, STACK_PAGE_COUNT);
+        flags = spin_lock_irqsave(&stack_pool.lock);
+        set_bit(slot, stack_pool.free_slots);
+        spin_unlock_irqrestore(&stack_pool.lock, flags);
+        return NULL;
+    }
+
+    poison_stack((u64 *)stack, STACK_FIRST_WORD);
+    return (void *)stack;
+}
+
+// called with pool lock held
+static void unmap_stack_slot(u64 stack) {
+    free_virtual_pages(stack, STACK_PAGE_COUNT);
+    set_bit(stack_to_slot(stack), stack_pool.free_slots);
+}
+
+union process_stack *alloc_process_stack(void) {
+    cpuflags_t flags = spin_lock_irqsave(&stack_pool.lock);
+    struct cached_stack *cached = stack_pool.cached;
+    if (cached) {
+        stack_pool.cached = cached->next;
+        stack_pool.cached_count--;
+        spin_unlock_irqrestore(&stack_pool.lock, flags);
+        return (void *)cached;
+    }
+    spin_unlock_irqrestore(&stack_pool.lock, flags);
+
+    return map_stack_slot();
+}
+
+void free_process_stack(union process_stack *stack) {
+    u64 addr = (u64)stack;
+    expects(addr >= STACK_VIRTUAL_BASE && addr < STACK_VIRTUAL_END);
+    expects((addr - STACK_VIRTUAL_BASE) % STACK_SLOT_SIZE == PAGE_SIZE);
+
+    // restore poison only in the part that was used
+    poison_stack(stack->stack, find_stack_low_mark(stack->stack));
+
+    cpuflags_t flags = spin_lock_irqsave(&stack_pool.lock);
+    if (stack_pool.cached_count < STACK_CACHE_MAX) {
+        struct cached_stack *cached = (void *)stack;
+        cached->next = stack_pool.cached;
+        stack_pool.cached = cached;
+        stack_pool.cached_count++;
+    } else {
+        unmap_stack_slot(addr);
+    }
+    spin_unlock_irqrestore(&stack_pool.lock, flags);
+}
+
+size_t get_stack_usage(const union process_stack *stack) {
+    size_t low_mark = find_stack_low_mark(stack->stack);
+    return (STACK_WORD_COUNT - low_mark) * sizeof(u64);
+}
+
+static size_t count_stack_pages(struct shrinker *shrinker __unused) {
+    return stack_pool.cached_count * STACK_PAGE_COUNT;
+}
+
+static size_t scan_stack_pages(struct shrinker *shrinker __unused,
+                               size_t nr_pages) {
+    if (!spin_trylock(&stack_pool.lock))
+        return 0;
+
+    size_t freed = 0;
+    while (stack_pool.cached && freed < nr_pages) {
+        struct cached_stack *cached = stack_pool.cached;
+        stack_pool.cached = cached->next;
+        stack_pool.cached_count--;
+        unmap_stack_slot((u64)cached);
+        freed += STACK_PAGE_COUNT;
+    }
+    spin_unlock(&stack_pool.lock);
+
+    return freed;
+}
+
+static struct shrinker stack_shrinker = {.count = count_stack_pages,
+                                         .scan = scan_stack_pages};
+
+void init_stack_pool(void) {
+    for (size_t i = 0; i < STACK_POOL_SLOTS; ++i)
+        set_bit(i, stack_pool.free_slots);
+    register_shrinker(&stack_shrinker);
+}
+
+int is_stack_guard_page(u64 addr) {
+    if (addr < STACK_VIRTUAL_BASE ||
+        addr >= STACK_VIRTUAL_BASE + STACK_POOL_SLOTS * STACK_SLOT_SIZE)
+        return 0;
+
+    return (addr - STACK_VIRTUAL_BASE) % STACK_SLOT_SIZE < PAGE_SIZE;
+}
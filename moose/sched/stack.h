@@ -0,0 +1,24 @@
+#pragma once
+
+#include <moose/param.h>
+#include <moose/sched/sched.h>
+
+// Every stack slot is preceded by unmapped guard page so overflow faults
+// instead of corrupting neighbouring memory
+#define STACK_SLOT_SIZE (PROCESS_STACK_SIZE + PAGE_SIZE)
+#define STACK_POOL_SLOTS 1024
+// number of freed stacks kept mapped for reuse
+#define STACK_CACHE_MAX 16
+#define STACK_POISON 0x57ac57ac57ac57acul
+
+void init_stack_pool(void);
+
+// Stacks are not zeroed, unused part is filled with STACK_POISON
+union process_stack *alloc_process_stack(void);
+void free_process_stack(union process_stack *stack);
+
+// returns nonzero if address is in guard page of one of stack slots
+int is_stack_guard_page(u64 addr);
+
+// returns maximum number of bytes ever used on stack
+size_t get_stack_usage(const union process_stack *stack);
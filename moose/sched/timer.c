@@ -0,0 +1,157 @@
+#include <moose/arch/cpu.h>
+#include <moose/assert.h>
+#include <moose/param.h>
+#include <moose/sched/locks.h>
+#include <moose/sched/sched.h>
+#include <moose/sched/timer.h>
+#include <moose/time.h>
+
+// Pending timers of each cpu are kept in rbtree sorted by expiration, with
+// the earliest one cached. Callbacks run under lock of the base, so taking
+// it is enough to wait for running callback to finish
+struct timer_base {
+    spinlock_t lock;
+    struct rb_node *root;
+    struct timer *first;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct timer_base timer_bases[MAX_CPUS];
+
+struct process_timer {
+    struct timer timer;
+    struct process *process;
+};
+
+void init_timers(void) {
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu)
+        init_spin_lock(&timer_bases[cpu].lock);
+}
+
+void init_timer(struct timer *timer, void (*function)(struct timer *)) {
+    timer->base = NULL;
+    timer->pending = 0;
+    timer->function = function;
+}
+
+// base lock must be held, returns 1 if timer became the earliest one
+static int enqueue_timer(struct timer_base *base, struct timer *timer) {
+    struct rb_node **link = &base->root;
+    struct rb_node *parent = NULL;
+    int leftmost = 1;
+    while (*link) {
+        parent = *link;
+        // timers with equal expiration fire in order they were added
+        if (timer->expires < rb_entry(parent, struct timer, node)->expires) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(&timer->node, parent);
+    *link = &timer->node;
+    rb_insert_color(&timer->node, &base->root);
+    timer->pending = 1;
+    if (leftmost)
+        base->first = timer;
+    return leftmost;
+}
+
+// base lock must be held
+static void dequeue_timer(struct timer_base *base, struct timer *timer) {
+    if (base->first == timer)
+        base->first = rb_entry_safe(rb_next(&timer->node), struct timer, node);
+    rb_erase(&timer->node, &base->root);
+    timer->pending = 0;
+}
+
+void add_timer(struct timer *timer, u64 expires) {
+    cpuflags_t flags = irq_save();
+    struct timer_base *base = timer_bases + get_cpu_id();
+    spin_lock(&base->lock);
+    expects(!timer->pending);
+    timer->expires = expires;
+    timer->base = base;
+    int first = enqueue_timer(base, timer);
+    spin_unlock(&base->lock);
+
+    if (first)
+        reprogram_tick();
+    irq_restore(flags);
+}
+
+int mod_timer(struct timer *timer, u64 expires) {
+    int pending = del_timer(timer);
+    add_timer(timer, expires);
+    return pending;
+}
+
+// Base of pending timer is changed only by adding it again, which is not
+// allowed while it is pending. Expiration it had is left programmed, cpu
+// just finds nothing to run then
+int del_timer(struct timer *timer) {
+    struct timer_base *base = __atomic_load_n(&timer->base, __ATOMIC_RELAXED);
+    if (base == NULL)
+        return 0;
+
+    cpuflags_t flags = spin_lock_irqsave(&base->lock);
+    int pending = timer->pending;
+    if (pending)
+        dequeue_timer(base, timer);
+    spin_unlock_irqrestore(&base->lock, flags);
+    return pending;
+}
+
+void run_timers(void) {
+    struct timer_base *base = timer_bases + get_cpu_id();
+    u64 now = ktime_get();
+    spin_lock(&base->lock);
+    while (base->first && base->first->expires <= now) {
+        struct timer *timer = base->first;
+        dequeue_timer(base, timer);
+        timer->function(timer);
+    }
+    spin_unlock(&base->lock);
+}
+
+u64 next_timer_expiry(void) {
+    struct timer_base *base = timer_bases + get_cpu_id();
+    cpuflags_t flags = spin_lock_irqsave(&base->lock);
+    u64 expires = base->first ? base->first->expires : TIMER_NEVER;
+    spin_unlock_irqrestore(&base->lock, flags);
+    return expires;
+}
+
+static void process_timeout(struct timer *timer) {
+    wake_up_process(container_of(timer, struct process_timer, timer)->process);
+}
+
+u64 schedule_timeout(u64 timeout) {
+    if (timeout == MAX_SCHEDULE_TIMEOUT) {
+        schedule();
+        return timeout;
+    }
+
+    u64 expires = ktime_get() + timeout;
+    struct process_timer timer = {.process = get_current()};
+    init_timer(&timer.timer, process_timeout);
+    add_timer(&timer.timer, expires);
+    schedule();
+    del_timer(&timer.timer);
+
+    u64 now = ktime_get();
+    return expires > now ? expires - now : 0;
+}
+
+void usleep(u64 usecs) {
+    u64 timeout = usecs * NSEC_PER_USEC;
+    while (timeout) {
+        set_current_state(PROCESS_UNINTERRUPTIBLE);
+        timeout = schedule_timeout(timeout);
+    }
+}
+
+void msleep(u64 msecs) {
+    usleep(msecs * USEC_PER_MSEC);
+}
@@ -0,0 +1,48 @@
+//
+// High resolution timers
+//
+#pragma once
+
+#include <moose/rbtree.h>
+#include <moose/types.h>
+
+#define MAX_SCHEDULE_TIMEOUT (~0ul)
+// expiration of cpu that has no pending timers
+#define TIMER_NEVER (~0ul)
+
+struct timer_base;
+
+struct timer {
+    struct rb_node node;
+    // ktime_get() nanoseconds at which timer fires
+    u64 expires;
+    // cpu base timer was last added to
+    struct timer_base *base;
+    int pending;
+    // called from timer interrupt of cpu that added the timer
+    void (*function)(struct timer *timer);
+};
+
+void init_timers(void);
+void init_timer(struct timer *timer, void (*function)(struct timer *));
+// Timer is queued on calling cpu and must not be pending. Callback can not
+// add timers, it runs with lock of its cpu timers held
+void add_timer(struct timer *timer, u64 expires);
+// changes expiration of pending or inactive timer, returns nonzero if timer
+// was pending
+int mod_timer(struct timer *timer, u64 expires);
+// returns nonzero if timer was pending, callback is not running once this
+// returns, so timer may be freed
+int del_timer(struct timer *timer);
+// runs expired timers of calling cpu, called from timer interrupt
+void run_timers(void);
+// returns expiration of the earliest timer of calling cpu or TIMER_NEVER
+u64 next_timer_expiry(void);
+
+// Sleeps until current process is woken or timeout in nanoseconds passes.
+// Process state has to be set before the call. Returns remaining
+// nanoseconds, 0 if timeout expired
+u64 schedule_timeout(u64 timeout);
+// sleep for at least given time
+void usleep(u64 usecs);
+void msleep(u64 msecs);
@@ -0,0 +1,52 @@
+#include <moose/sched/sched.h>
+#include <moose/sched/wait.h>
+
+void init_wait_queue_head(wait_queue_head_t *wq) {
+    init_spin_lock(&wq->lock);
+    init_list_head(&wq->waiters);
+}
+
+void init_wait_entry(struct wait_queue_entry *entry) {
+    entry->process = get_current();
+    init_list_head(&entry->list);
+}
+
+void prepare_to_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry,
+                     enum process_state state) {
+    cpuflags_t flags = spin_lock_irqsave(&wq->lock);
+    if (list_is_empty(&entry->list))
+        list_add_tail(&entry->list, &wq->waiters);
+    set_current_state(state);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void finish_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry) {
+    set_current_state(PROCESS_RUNNING);
+    cpuflags_t flags = spin_lock_irqsave(&wq->lock);
+    if (!list_is_empty(&entry->list)) {
+        list_remove(&entry->list);
+        init_list_head(&entry->list);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void wake_up(wait_queue_head_t *wq) {
+    cpuflags_t flags = spin_lock_irqsave(&wq->lock);
+    struct wait_queue_entry *entry;
+    list_for_each_entry(entry, &wq->waiters, list) {
+        wake_up_process(entry->process);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// waiter that is already woken but did not remove itself yet does not count,
+// otherwise wakeup could be lost
+void wake_up_one(wait_queue_head_t *wq) {
+    cpuflags_t flags = spin_lock_irqsave(&wq->lock);
+    struct wait_queue_entry *entry;
+    list_for_each_entry(entry, &wq->waiters, list) {
+        if (wake_up_process(entry->process))
+            break;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
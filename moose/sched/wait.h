@@ -0,0 +1,74 @@
+//
+// Wait queues
+//
+#pragma once
+
+#include <moose/list.h>
+#include <moose/sched/locks.h>
+#include <moose/sched/sched.h>
+#include <moose/sched/timer.h>
+
+typedef struct wait_queue_head {
+    spinlock_t lock;
+    struct list_head waiters;
+} wait_queue_head_t;
+
+#define INIT_WAIT_QUEUE_HEAD(_name)                                            \
+    { INIT_SPIN_LOCK(), INIT_LIST_HEAD((_name).waiters) }
+
+struct wait_queue_entry {
+    struct process *process;
+    struct list_head list;
+};
+
+void init_wait_queue_head(wait_queue_head_t *wq);
+void init_wait_entry(struct wait_queue_entry *entry);
+// adds entry to queue if it is not there yet and sets state of current
+// process, condition must be checked after this call
+void prepare_to_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry,
+                     enum process_state state);
+void finish_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry);
+
+// wakes every waiter
+void wake_up(wait_queue_head_t *wq);
+// wakes first waiter that is still sleeping
+void wake_up_one(wait_queue_head_t *wq);
+
+#define __wait_event(_wq, _cond, _timeout)                                     \
+    ({                                                                         \
+        struct wait_queue_entry __entry;                                       \
+        u64 __timeout = (_timeout);                                            \
+        init_wait_entry(&__entry);                                             \
+        for (;;) {                                                             \
+            prepare_to_wait(_wq, &__entry, PROCESS_UNINTERRUPTIBLE);           \
+            if (_cond)                                                         \
+                break;                                                         \
+            __timeout = schedule_timeout(__timeout);                           \
+            if (__timeout == 0) {                                              \
+                __timeout = (_cond);                                           \
+                break;                                                         \
+            }                                                                  \
+        }                                                                      \
+        finish_wait(_wq, &__entry);                                            \
+        __timeout;                                                             \
+    })
+
+// sleeps until condition becomes true, condition is checked after every
+// wakeup of the queue
+#define wait_event(_wq, _cond)                                                 \
+    do {                                                                       \
+        if (!(_cond))                                                          \
+            (void)__wait_event(_wq, _cond, MAX_SCHEDULE_TIMEOUT);              \
+    } while (0)
+
+// timeout is in nanoseconds, returns 0 if condition is still false after
+// timeout, otherwise remaining nanoseconds but at least 1
+#define wait_event_timeout(_wq, _cond, _timeout)                               \
+    ({                                                                         \
+        u64 __ret = (_timeout);                                                \
+        if (!(_cond))                                                          \
+            __ret = __wait_event(_wq, _cond, __ret);                           \
+        else if (__ret == 0)                                                   \
+            __ret = 1;                                                         \
+        __ret;                                                                 \
+    })
@@ -4,6 +4,7 @@
 #include <fs/fat.h>
 #include <kmem.h>
 #include <kstdio.h>
+#include <sched/lock_stat.h>
 #include <shell.h>
 
 enum shell_command {
@@ -16,7 +17,8 @@ enum shell_command {
     CMD_MD,
     CMD_REN,
     CMD_TREE,
-    CMD_WRITE
+    CMD_WRITE,
+    CMD_LOCKSTAT
 };
 
 struct cmd {
@@ -31,8 +33,9 @@ static struct {
 
 static int parse_command_name(const char *name, size_t name_length,
                               enum shell_command *cmd) {
-    static const char *names[] = {"LS", "TIME", "CAT", "TOUCH", "HELP",
-                                  "RM", "MD",   "REN", "TREE",  "WRITE"};
+    static const char *names[] = {"LS",   "TIME",  "CAT", "TOUCH",
+                                  "HELP", "RM",    "MD",  "REN",
+                                  "TREE", "WRITE", "LOCKSTAT"};
     for (size_t i = 0; i < ARRAY_SIZE(names); ++i) {
         const char *opt = names[i];
         size_t opt_len = strlen(opt);
@@ -64,6 +67,7 @@ static int parse_cmd(const char *str, struct cmd *cmd) {
     switch (cmd->cmd) {
     case CMD_TIME:
     case CMD_HELP:
+    case CMD_LOCKSTAT:
         break;
     case CMD_LS:
     case CMD_TREE:
@@ -264,7 +268,8 @@ static void execute(const struct cmd *cmd) {
                 "RM <PATH>    - delete file or directory\n"
                 "MD <PATH>    - create directory\n"
                 "REN <A> <B>  - rename\n"
-                "TREE <PATH>  - recursive ls\n");
+                "TREE <PATH>  - recursive ls\n"
+                "LOCKSTAT     - print lock contention\n");
         break;
     case CMD_CAT:
         do_cat(cmd->a);
@@ -284,6 +289,9 @@ static void execute(const struct cmd *cmd) {
     case CMD_REN:
         do_rename(cmd->a, cmd->b);
         break;
+    case CMD_LOCKSTAT:
+        print_lock_stats();
+        break;
     }
 }
 
@@ -1,7 +1,15 @@
+#include <moose/arch/jiffies.h>
 #include <moose/assert.h>
 #include <moose/kstdio.h>
+#include <moose/sched/locks.h>
 #include <moose/time.h>
 
+// wall time at which clocksource read zero
+static struct {
+    seqcount_t seq;
+    struct ktimespec wall_base;
+} timekeeper;
+
 time_t ktm_to_time(const struct ktm *tm) {
     time_t days = days_since_epoch(tm->tm_year + 1900, tm->tm_mon, tm->tm_mday);
     return ((((days * 24) + tm->tm_hour) * 60) + tm->tm_min) * 60 + tm->tm_sec;
@@ -9,7 +17,7 @@ time_t ktm_to_time(const struct ktm *tm) {
 
 static int leap_years_before(int year) {
     --year;
-    return (year / 4) - (year / 100) - (year / 400);
+    return (year / 4) - (year / 100) + (year / 400);
 }
 
 static int leap_years_between(int a, int b) {
@@ -30,15 +38,97 @@ time_t days_since_epoch(int year, int month, int day) {
 
     static const int days_in_months[] = {31, 28, 31, 30, 31, 30,
                                          31, 31, 30, 31, 30, 31};
-    if (is_year_leap(year) && month >= 1)
+    if (is_year_leap(year) && month >= 2)
         ++days; // feb
     for (int i = 0; i < month; ++i)
         days += days_in_months[i];
-    days += day;
+    days += day - 1;
 
     return days;
 }
 
+// converts days since epoch to civil date, years are counted from march so
+// that leap day is the last one of a year
+void time_to_ktm(time_t time, struct ktm *tm) {
+    time_t days = time / 86400;
+    time_t secs = time % 86400;
+    tm->tm_hour = secs / 3600;
+    tm->tm_min = secs / 60 % 60;
+    tm->tm_sec = secs % 60;
+
+    days += 719468;
+    time_t era = days / 146097;
+    time_t day_of_era = days - era * 146097;
+    time_t year_of_era = (day_of_era - day_of_era / 1460 +
+                          day_of_era / 36524 - day_of_era / 146096) /
+                         365;
+    time_t day_of_year =
+        day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    time_t mp = (5 * day_of_year + 2) / 153;
+    int month = mp < 10 ? mp + 3 : mp - 9;
+    time_t year = year_of_era + era * 400 + (month <= 2);
+
+    tm->tm_mday = day_of_year - (153 * mp + 2) / 5 + 1;
+    tm->tm_mon = month - 1;
+    tm->tm_year = year - 1900;
+}
+
+void init_timekeeping(time_t wall) {
+    u64 now = ktime_get();
+    u64 wall_ns = wall * NSEC_PER_SEC;
+    // bogus hardware clock may be behind time since boot
+    wall_ns = wall_ns > now ? wall_ns - now : 0;
+    write_seqcount_begin(&timekeeper.seq);
+    timekeeper.wall_base.tv_sec = wall_ns / NSEC_PER_SEC;
+    timekeeper.wall_base.tv_nsec = wall_ns % NSEC_PER_SEC;
+    write_seqcount_end(&timekeeper.seq);
+}
+
+u64 ktime_get(void) {
+    return sched_clock();
+}
+
+u64 get_jiffies(void) {
+    return ktime_get() / TICK_NSEC;
+}
+
+u64 jiffies_to_msecs(u64 jiffies) {
+    return jiffies * 1000 / HZ;
+}
+
+u64 msecs_to_jiffies(u64 msecs) {
+    return (msecs * HZ + 999) / 1000;
+}
+
+void get_monotonic_time(struct ktimespec *ts) {
+    u64 ns = ktime_get();
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+void get_wall_time(struct ktimespec *ts) {
+    u32 seq;
+    struct ktimespec base;
+    do {
+        seq = read_seqcount_begin(&timekeeper.seq);
+        base = timekeeper.wall_base;
+    } while (read_seqcount_retry(&timekeeper.seq, seq));
+
+    u64 ns = base.tv_nsec + ktime_get();
+    ts->tv_sec = base.tv_sec + ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+time_t current_time(void) {
+    struct ktimespec ts;
+    get_wall_time(&ts);
+    return ts.tv_sec;
+}
+
+void current_time_tm(struct ktm *tm) {
+    time_to_ktm(current_time(), tm);
+}
+
 void print_tm(const struct ktm *tm) {
     kprintf("sec=%d min=%d hour=%d day=%d mon=%d year=%d\n", tm->tm_sec,
             tm->tm_min, tm->tm_hour, tm->tm_mday, tm->tm_mon,
@@ -2,6 +2,11 @@
 
 #include <moose/types.h>
 
+#define NSEC_PER_SEC 1000000000ul
+#define NSEC_PER_MSEC 1000000ul
+#define NSEC_PER_USEC 1000ul
+#define USEC_PER_MSEC 1000ul
+
 // Stripped down version of 'struct tm' from libc
 struct ktm {
     int tm_sec;
@@ -18,7 +23,17 @@ struct ktimespec {
 };
 
 time_t ktm_to_time(const struct ktm *tm);
+void time_to_ktm(time_t time, struct ktm *tm);
 time_t days_since_epoch(int year, int month, int day);
+
+// Kernel time is read from TSC clocksource, so it does not depend on timer
+// interrupts. Wall time is read from hardware clock once at initialization
+// and kept as offset from the clocksource
+void init_timekeeping(time_t wall);
+// nanoseconds since boot
+u64 ktime_get(void);
+void get_monotonic_time(struct ktimespec *ts);
+void get_wall_time(struct ktimespec *ts);
 time_t current_time(void);
 void current_time_tm(struct ktm *tm);
 
@@ -1,4 +1,5 @@
 #include <moose/mm/kmalloc.h>
+#include <moose/sched/lock_stat.h>
 #include <moose/string.h>
 #include <moose/tty/console.h>
 #include <moose/tty/vterm.h>
@@ -22,6 +23,7 @@ struct vterm *create_vterm(struct console *console) {
         return NULL;
     }
     init_spin_lock(&term->lock);
+    set_spin_lock_class(&term->lock, "vterm");
     term->console = console;
     term->default_bg = CONSOLE_BLACK;
     term->default_fg = CONSOLE_WHITE;
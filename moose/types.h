@@ -26,6 +26,8 @@
 #define __printf(_a, _b) __attribute__((format(printf, _a, _b)))
 #define __noinline __attribute__((noinline))
 #define __naked __attribute__((naked))
+// prevents compiler from moving memory accesses across it
+#define barrier() asm volatile("" ::: "memory")
 
 static_assert(sizeof(i8) == 1);
 static_assert(sizeof(u8) == 1);